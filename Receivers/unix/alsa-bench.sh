@@ -0,0 +1,48 @@
+#!/bin/sh
+# Plays a shared memory stream from ivshmem-stub (8 channels, 32 bit,
+# 192 kHz by default) to an ALSA device, once through snd_pcm_writei
+# (-o alsa) and once through mmap (-o alsa-mmap), and prints the bytes/s
+# written, the CPU time per MB, the longest write and the time from the
+# chunk's arrival to the output, as scream -v -v reports them over 10 s.
+# Run it from the build directory.
+
+device=default
+outputs="alsa alsa-mmap"
+rate=192000
+bits=32
+channels=8
+while getopts d:o:r:b:c: opt; do
+  case $opt in
+  d) device=$OPTARG ;;
+  o) outputs=$OPTARG ;;
+  r) rate=$OPTARG ;;
+  b) bits=$OPTARG ;;
+  c) channels=$OPTARG ;;
+  *) echo "Usage: $0 [-d <device>] [-o \"<outputs>\"] [-r <rate>] [-b <bits>] [-c <channels>]" >&2
+     exit 1 ;;
+  esac
+done
+
+shm=$(mktemp -u /dev/shm/scream-bench.XXXXXX)
+log=$(mktemp)
+trap 'rm -f "$log" "$shm"' EXIT
+
+for output in $outputs; do
+  ./ivshmem-stub -m "$shm" -r "$rate" -b "$bits" -c "$channels" -d 23 2>/dev/null &
+  stub=$!
+  sleep 1
+  # scream reports every 10 s from its start, the second report covers
+  # the stream only
+  timeout 21 ./scream -m "$shm" -o "$output" -d "$device" -v -v >"$log" 2>&1
+  wait $stub
+  rm -f "$shm"
+  awk -v output="$output" '
+    /^alsa: / && ++alsa == 2 { sub(/^alsa: /, ""); written = $0 }
+    /^output: / && ++delay == 2 { sub(/^output: /, ""); arrival = $0 }
+    { last = $0 }
+    END {
+      if (written == "") { print output ": no report, scream said: " last; exit }
+      print output ": " written
+      print output ": " arrival
+    }' "$log"
+done
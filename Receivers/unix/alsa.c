@@ -15,8 +15,26 @@ static struct alsa_output_data {
   unsigned int rate;
   unsigned int bytes_per_sample;
 
+  // With mmap access (-o alsa-mmap), the audio is converted to the
+  // device's format and channel order while it is copied into the device
+  // buffer
+  int use_mmap;
+  int mmap;
+  snd_pcm_format_t pcm_format;  // of the stream
+  snd_pcm_format_t device_format;
+  int remap[MAX_CHANNELS];  // source channel of each device channel, -1 for silence
+  int remapping;
+  snd_pcm_uframes_t buffer_size;
+  snd_pcm_uframes_t start_threshold;
+
   int latency;
   char *alsa_device;
+
+  // -v -v: what the writes took since the last report
+  struct timespec last_report;
+  uint64_t bytes;
+  int64_t cpu_ns;
+  int64_t max_write_ns;
 } ao_data;
 
 void alsa_error(const char *msg, int r)
@@ -41,30 +59,131 @@ int dump_alsa_info(snd_pcm_t *pcm)
   return 0;
 }
 
-int setup_alsa(snd_pcm_t **psnd, snd_pcm_format_t format, unsigned int rate, unsigned int target_latency_ms, const char *output_device, int channels, snd_pcm_chmap_t **channel_map)
+// With -o alsa-mmap, sets up mmap access in the stream's format, or else in
+// the format the device takes that loses the least, for alsa_output_send to
+// convert to. Otherwise, or without mmap support, uses snd_pcm_writei in
+// the stream's format.
+static int set_params(snd_pcm_t *snd, snd_pcm_format_t format, int channels, unsigned int rate, unsigned int latency)
 {
-  int ret;
+  static const snd_pcm_format_t device_formats[] = {
+    SND_PCM_FORMAT_S32_LE, SND_PCM_FORMAT_S24_LE, SND_PCM_FORMAT_S24_3LE, SND_PCM_FORMAT_S16_LE
+  };
+  snd_pcm_sw_params_t *sw_params;
+  snd_pcm_uframes_t period_size;
   int soft_resample = 1;
+  int ret;
+  unsigned int i;
+
+  ao_data.mmap = ao_data.use_mmap;
+  ao_data.device_format = format;
+  ret = -1;
+  if (ao_data.mmap)
+    ret = snd_pcm_set_params(snd, format, SND_PCM_ACCESS_MMAP_INTERLEAVED, channels, rate, soft_resample, latency);
+  for (i = 0; ao_data.mmap && ret < 0 && i < sizeof(device_formats) / sizeof(device_formats[0]); i++) {
+    if (device_formats[i] == format) continue;
+    ao_data.device_format = device_formats[i];
+    ret = snd_pcm_set_params(snd, device_formats[i], SND_PCM_ACCESS_MMAP_INTERLEAVED, channels, rate, soft_resample, latency);
+  }
+  if (ret < 0) {
+    if (ao_data.mmap && verbosity > 0)
+      fprintf(stderr, "The device has no mmap access, writing to it instead.\n");
+    ao_data.mmap = 0;
+    ao_data.device_format = format;
+    ret = snd_pcm_set_params(snd, format, SND_PCM_ACCESS_RW_INTERLEAVED, channels, rate, soft_resample, latency);
+  }
+  SNDCHK("snd_pcm_set_params", ret);
+
+  if (ao_data.mmap) {
+    ret = snd_pcm_get_params(snd, &ao_data.buffer_size, &period_size);
+    SNDCHK("snd_pcm_get_params", ret);
+    snd_pcm_sw_params_alloca(&sw_params);
+    ret = snd_pcm_sw_params_current(snd, sw_params);
+    SNDCHK("snd_pcm_sw_params_current", ret);
+    ret = snd_pcm_sw_params_get_start_threshold(sw_params, &ao_data.start_threshold);
+    SNDCHK("snd_pcm_sw_params_get_start_threshold", ret);
+    if (verbosity > 0 && ao_data.device_format != format)
+      fprintf(stderr, "Converting to %s for the device.\n", snd_pcm_format_name(ao_data.device_format));
+  }
+  return 0;
+}
+
+// A device without (settable) channel maps takes the channels in its own
+// order, or else ALSA's default order. The channels of the stream are
+// reordered to match; ones the device has no position for take its
+// remaining channels.
+static void setup_remap(snd_pcm_t *snd, const snd_pcm_chmap_t *source)
+{
+  static const unsigned int default_order[MAX_CHANNELS] = {
+    SND_CHMAP_FL, SND_CHMAP_FR, SND_CHMAP_RL, SND_CHMAP_RR,
+    SND_CHMAP_FC, SND_CHMAP_LFE, SND_CHMAP_SL, SND_CHMAP_SR
+  };
+  snd_pcm_chmap_t *device = snd_pcm_get_chmap(snd);
+  int used[MAX_CHANNELS] = { 0 };
+  unsigned int i, j, pos;
+
+  for (i = 0; i < source->channels; i++) {
+    pos = (device && device->channels == source->channels) ? device->pos[i] : default_order[i];
+    ao_data.remap[i] = -1;
+    for (j = 0; j < source->channels; j++) {
+      if (!used[j] && source->pos[j] == pos) {
+        ao_data.remap[i] = j;
+        used[j] = 1;
+        break;
+      }
+    }
+  }
+  for (i = 0; i < source->channels; i++) {
+    for (j = 0; ao_data.remap[i] < 0 && j < source->channels; j++) {
+      if (!used[j]) {
+        ao_data.remap[i] = j;
+        used[j] = 1;
+      }
+    }
+  }
+
+  ao_data.remapping = 0;
+  for (i = 0; i < source->channels; i++) {
+    if (ao_data.remap[i] != (int)i) ao_data.remapping = 1;
+  }
+  free(device);
+}
+
+int setup_alsa(snd_pcm_t **psnd, snd_pcm_format_t format, unsigned int rate, unsigned int target_latency_ms, const char *output_device, int channels, snd_pcm_chmap_t **channel_map)
+{
+  int ret, i;
   unsigned int latency = target_latency_ms * 1000;
 
   ret = snd_pcm_open(psnd, output_device, SND_PCM_STREAM_PLAYBACK, 0);
   SNDCHK("snd_pcm_open", ret);
 
-  ret = snd_pcm_set_params(*psnd, format, SND_PCM_ACCESS_RW_INTERLEAVED,
-                           channels, rate, soft_resample, latency);
-  SNDCHK("snd_pcm_set_params", ret);
+  if (set_params(*psnd, format, channels, rate, latency) != 0) return -1;
+
+  for (i = 0; i < channels; i++) ao_data.remap[i] = i;
+  ao_data.remapping = 0;
 
   ret = snd_pcm_set_chmap(*psnd, *channel_map);
   if (ret == -ENXIO) { // snd_pcm_set_chmap returns -ENXIO if device does not support channel maps at all
     if (channels > 2) { // but it's relevant only above 2 channels
-      fprintf(stderr, "Your device doesn't support channel maps. Channels may be in the wrong order.\n");
-      // TODO ALSA has a fixed channel order and we have the source channel_map.
-      // It's possible to reorder the channels in software. Maybe a place to start is the remap_data function in aplay.c
+      if (ao_data.mmap) {
+        setup_remap(*psnd, *channel_map);
+        if (verbosity > 0 && ao_data.remapping)
+          fprintf(stderr, "Your device doesn't support channel maps. Reordering the channels to its order.\n");
+      }
+      else {
+        fprintf(stderr, "Your device doesn't support channel maps. Channels may be in the wrong order.\n");
+      }
     }
   }
   else if (ret == -EBADFD) {
     if (channels > 2) {
-      fprintf(stderr, "It was not possible to set the channel map. You are limited to use stereo. See https://github.com/duncanthrax/scream/issues/79\n");
+      if (ao_data.mmap) {
+        setup_remap(*psnd, *channel_map);
+        if (verbosity > 0 && ao_data.remapping)
+          fprintf(stderr, "It was not possible to set the channel map. Reordering the channels to the device's order.\n");
+      }
+      else {
+        fprintf(stderr, "It was not possible to set the channel map. You are limited to use stereo. See https://github.com/duncanthrax/scream/issues/79\n");
+      }
     }
   }
   else {
@@ -86,8 +205,11 @@ static int close_alsa(snd_pcm_t *snd) {
   return 0;
 }
 
-int alsa_output_init(int latency, char *alsa_device)
+int alsa_output_init(int latency, char *alsa_device, int mmap)
 {
+  ao_data.use_mmap = mmap;
+  clock_gettime(CLOCK_MONOTONIC, &ao_data.last_report);
+
   // init receiver format to track changes
   ao_data.receiver_format.sample_rate = 0;
   ao_data.receiver_format.sample_size = 0;
@@ -110,6 +232,181 @@ int alsa_output_init(int latency, char *alsa_device)
   return 0;
 }
 
+// Samples are handled left aligned in 32 bits, whatever their size
+static int32_t get_sample(const unsigned char *p, unsigned int bytes)
+{
+  switch (bytes) {
+    case 2: return (int32_t)((uint32_t)p[0] << 16 | (uint32_t)p[1] << 24);
+    case 3: return (int32_t)((uint32_t)p[0] << 8 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 24);
+    default: return (int32_t)((uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+  }
+}
+
+// Returns the bytes written
+static unsigned int put_device_sample(unsigned char *p, int32_t v)
+{
+  uint32_t u = (uint32_t)v;
+
+  switch (ao_data.device_format) {
+    case SND_PCM_FORMAT_S16_LE: p[0] = u >> 16; p[1] = u >> 24; return 2;
+    case SND_PCM_FORMAT_S24_3LE: p[0] = u >> 8; p[1] = u >> 16; p[2] = u >> 24; return 3;
+    case SND_PCM_FORMAT_S24_LE:
+      u = (uint32_t)(v >> 8);
+      p[0] = u; p[1] = u >> 8; p[2] = u >> 16; p[3] = u >> 24; return 4;
+    default: p[0] = u; p[1] = u >> 8; p[2] = u >> 16; p[3] = u >> 24; return 4;
+  }
+}
+
+// Reorders the channels only; inlined for each sample size
+static inline void remap(unsigned char *dst, const unsigned char *src, snd_pcm_uframes_t frames, unsigned int channels, unsigned int bytes)
+{
+  unsigned int c;
+  snd_pcm_uframes_t f;
+
+  for (f = 0; f < frames; f++, src += bytes * channels) {
+    for (c = 0; c < channels; c++, dst += bytes) {
+      if (ao_data.remap[c] < 0)
+        memset(dst, 0, bytes);
+      else
+        memcpy(dst, src + ao_data.remap[c] * bytes, bytes);
+    }
+  }
+}
+
+// Copies <frames> of the stream into the device buffer, converting the
+// format and reordering the channels on the way
+static void convert(unsigned char *dst, const unsigned char *src, snd_pcm_uframes_t frames, unsigned int channels)
+{
+  unsigned int bytes = ao_data.bytes_per_sample;
+  unsigned int c;
+  snd_pcm_uframes_t f;
+
+  if (ao_data.device_format == ao_data.pcm_format) {
+    if (!ao_data.remapping)
+      memcpy(dst, src, frames * bytes * channels);
+    else if (bytes == 2)
+      remap(dst, src, frames, channels, 2);
+    else if (bytes == 3)
+      remap(dst, src, frames, channels, 3);
+    else
+      remap(dst, src, frames, channels, 4);
+    return;
+  }
+  for (f = 0; f < frames; f++, src += bytes * channels) {
+    for (c = 0; c < channels; c++) {
+      dst += put_device_sample(dst, ao_data.remap[c] < 0 ? 0 : get_sample(src + ao_data.remap[c] * bytes, bytes));
+    }
+  }
+}
+
+// Writes straight into the device buffer, waiting for room like
+// snd_pcm_writei. On errors, the rest of the audio is dropped.
+static int mmap_write(const unsigned char *audio, snd_pcm_uframes_t frames, unsigned int channels)
+{
+  const snd_pcm_channel_area_t *areas;
+  snd_pcm_uframes_t offset, n;
+  snd_pcm_sframes_t avail, committed;
+  int ret;
+
+  while (frames) {
+    avail = snd_pcm_avail_update(ao_data.snd);
+    if (avail < 0) {
+      ret = snd_pcm_recover(ao_data.snd, avail, 0);
+      SNDCHK("snd_pcm_recover", ret);
+      return 0;
+    }
+    if (avail == 0) {
+      ret = snd_pcm_wait(ao_data.snd, 1000);
+      if (ret < 0) {
+        ret = snd_pcm_recover(ao_data.snd, ret, 0);
+        SNDCHK("snd_pcm_recover", ret);
+        return 0;
+      }
+      continue;
+    }
+
+    n = frames;
+    ret = snd_pcm_mmap_begin(ao_data.snd, &areas, &offset, &n);
+    if (ret < 0) {
+      ret = snd_pcm_recover(ao_data.snd, ret, 0);
+      SNDCHK("snd_pcm_recover", ret);
+      return 0;
+    }
+    // interleaved: all channels are in the first area, a frame apart
+    convert((unsigned char *)areas[0].addr + (areas[0].first + offset * areas[0].step) / 8, audio, n, channels);
+    committed = snd_pcm_mmap_commit(ao_data.snd, offset, n);
+    if (committed < 0 || (snd_pcm_uframes_t)committed != n) {
+      ret = snd_pcm_recover(ao_data.snd, committed < 0 ? committed : -EPIPE, 0);
+      SNDCHK("snd_pcm_recover", ret);
+      return 0;
+    }
+    audio += n * ao_data.bytes_per_sample * channels;
+    frames -= n;
+
+    // unlike snd_pcm_writei, committing doesn't start the device
+    if (snd_pcm_state(ao_data.snd) == SND_PCM_STATE_PREPARED
+        && ao_data.buffer_size - (avail - n) >= ao_data.start_threshold) {
+      ret = snd_pcm_start(ao_data.snd);
+      SNDCHK("snd_pcm_start", ret);
+    }
+  }
+  return 0;
+}
+
+static int64_t elapsed_ns(const struct timespec *from, const struct timespec *to)
+{
+  return (to->tv_sec - from->tv_sec) * 1000000000LL + (to->tv_nsec - from->tv_nsec);
+}
+
+// Prints the bytes/s written, the CPU time it took per MB (and so the
+// bytes/s one CPU could write) and the longest write every STATS_INTERVAL
+static void account_write(unsigned int bytes, const struct timespec *start, const struct timespec *start_cpu,
+  const struct timespec *end, const struct timespec *end_cpu)
+{
+  int64_t write_ns = elapsed_ns(start, end);
+  double elapsed, us_per_mb;
+
+  ao_data.bytes += bytes;
+  ao_data.cpu_ns += elapsed_ns(start_cpu, end_cpu);
+  if (write_ns > ao_data.max_write_ns) ao_data.max_write_ns = write_ns;
+
+  elapsed = elapsed_ns(&ao_data.last_report, end) / 1e9;
+  if (elapsed < STATS_INTERVAL) return;
+
+  us_per_mb = ao_data.bytes ? ao_data.cpu_ns / 1e3 / (ao_data.bytes / 1e6) : 0;
+  fprintf(stderr, "alsa: %.0f bytes/s %s, %.1f us CPU/MB (%.0f MB/s per CPU), %.3f ms longest write\n",
+    ao_data.bytes / elapsed, ao_data.mmap ? "through mmap" : "written",
+    us_per_mb, us_per_mb ? 1e6 / us_per_mb : 0, ao_data.max_write_ns / 1e6);
+  ao_data.bytes = 0;
+  ao_data.cpu_ns = 0;
+  ao_data.max_write_ns = 0;
+  ao_data.last_report = *end;
+}
+
+static int alsa_write(receiver_data_t *data)
+{
+  receiver_format_t *rf = &data->format;
+  int ret;
+  snd_pcm_sframes_t written;
+
+  int i = 0;
+  int samples = (data->audio_size) / (ao_data.bytes_per_sample * rf->channels);
+  if (ao_data.mmap) return mmap_write(data->audio, samples, rf->channels);
+  while (i < samples) {
+    written = snd_pcm_writei(ao_data.snd, &data->audio[i * ao_data.bytes_per_sample * rf->channels], samples - i);
+    if (written < 0) {
+      ret = snd_pcm_recover(ao_data.snd, written, 0);
+      SNDCHK("snd_pcm_recover", ret);
+      return 0;
+    } else if (written < samples - i) {
+      if (verbosity) fprintf(stderr, "Writing again after short write %ld < %d\n", written, samples - i);
+    }
+    i += written;
+  }
+
+  return 0;
+}
+
 int alsa_output_send(receiver_data_t *data)
 {
   snd_pcm_format_t format;
@@ -191,6 +488,7 @@ int alsa_output_send(receiver_data_t *data)
     }
 
     if (ao_data.rate) {
+      ao_data.pcm_format = format;
       close_alsa(ao_data.snd);
       if (setup_alsa(&ao_data.snd, format, ao_data.rate, ao_data.latency, ao_data.alsa_device, rf->channels, &ao_data.channel_map) == -1) {
         if (verbosity > 0)
@@ -208,22 +506,17 @@ int alsa_output_send(receiver_data_t *data)
 
   if (!ao_data.rate) return 0;
 
-  int ret;
-  snd_pcm_sframes_t written;
-
-  int i = 0;
-  int samples = (data->audio_size) / (ao_data.bytes_per_sample * rf->channels);
-  while (i < samples) {
-    written = snd_pcm_writei(ao_data.snd, &data->audio[i * ao_data.bytes_per_sample * rf->channels], samples - i);
-    if (written < 0) {
-      ret = snd_pcm_recover(ao_data.snd, written, 0);
-      SNDCHK("snd_pcm_recover", ret);
-      return 0;
-    } else if (written < samples - i) {
-      if (verbosity) fprintf(stderr, "Writing again after short write %ld < %d\n", written, samples - i);
-    }
-    i += written;
+  if (verbosity > 1) {
+    struct timespec start, start_cpu, end, end_cpu;
+    int ret;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start_cpu);
+    ret = alsa_write(data);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end_cpu);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    account_write(data->audio_size, &start, &start_cpu, &end, &end_cpu);
+    return ret;
   }
-
-  return 0;
+  return alsa_write(data);
 }
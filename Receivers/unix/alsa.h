@@ -4,10 +4,11 @@
 #include <alsa/asoundlib.h>
 
 #include "scream.h"
+#include "stats.h"
 
 #define MAX_CHANNELS 8
 
-int alsa_output_init(int latency, char *alsa_device);
+int alsa_output_init(int latency, char *alsa_device, int mmap);
 int alsa_output_send(receiver_data_t *data);
 
 #endif
@@ -0,0 +1,75 @@
+#!/bin/sh
+# Loads scream with sender-stub -k and prints, for each receive engine, the
+# packets/s its receive threads took in, their CPU time per packet and the
+# delay from the packets' arrival to the output, as scream -v -v reports
+# them over 10 s of the load. With -n, the load comes from that many
+# senders, for each count in the list, and with -A from addresses of their
+# own. -N runs the senders in a network namespace, e.g. at the far end of a
+# veth pair, for the XDP and sniffer engines to take the packets from the
+# interface -i (the sniffer engines, tpacket and pcap, with -- -P). Run it
+# from the build directory; options after -- go to scream. Sender and
+# receiver share the host's CPUs, on a small host the sender's share limits
+# the rate.
+
+rate=20000
+engines="recvfrom mmsg uring"
+senders=1
+source=
+address=127.0.0.1
+interface=
+netns=
+port=4099
+while getopts k:e:n:A:a:i:N:p: opt; do
+  case $opt in
+  k) rate=$OPTARG ;;
+  e) engines=$OPTARG ;;
+  n) senders=$OPTARG ;;
+  A) source="-A $OPTARG" ;;
+  a) address=$OPTARG ;;
+  i) interface=$OPTARG ;;
+  N) netns="ip netns exec $OPTARG" ;;
+  p) port=$OPTARG ;;
+  *) echo "Usage: $0 [-k <packets/s>] [-e \"<engines>\"] [-n \"<senders>\"] [-A <address>] [-a <address>] [-i <interface>] [-N <netns>] [-p <port>] [-- <scream options>]" >&2
+     exit 1 ;;
+  esac
+done
+shift $((OPTIND - 1))
+[ -n "$interface" ] || interface=$address
+
+log=$(mktemp)
+trap 'rm -f "$log"' EXIT
+
+for engine in $engines; do
+  for n in $senders; do
+    ./scream -u -i "$interface" -p "$port" -I "$engine" -o raw -v -v "$@" >/dev/null 2>"$log" &
+    pid=$!
+    sleep 1
+    if ! kill -0 $pid 2>/dev/null; then
+      echo "$engine: scream said: $(tail -n 1 "$log")"
+      continue
+    fi
+    # scream reports every 10 s from its start, the second report covers
+    # the load only
+    sent=$($netns ./sender-stub -k "$rate" -n "$n" $source -a "$address" -p "$port" -d 21 2>&1)
+    kill $pid 2>/dev/null
+    wait $pid 2>/dev/null
+    # io_uring and AF_XDP sockets are released in the background, give the
+    # kernel time before the next run binds the port again
+    sleep 1
+    echo "$engine: $sent"
+    awk -v engine="$engine" '
+      { last = $0 }
+      / pkts\/s, .* us CPU\/pkt/ {
+        if (++reports[$1] != 2) next
+        pkts += $2; cpu += $2 * $8; threads++
+        if ($11 != "") drops += $11
+      }
+      /^output: / && ++delays == 2 { sub(/^output: /, ""); delay = $0 }
+      END {
+        if (!threads) { print engine ": no report, scream said: " last; exit }
+        printf "%s: %.0f pkts/s received, %.2f us CPU/pkt on %d receive thread(s), %d dropped by the kernel\n",
+          engine, pkts, pkts ? cpu / pkts : 0, threads, drops
+        if (delay != "") print engine ": " delay
+      }' "$log"
+  done
+done
@@ -0,0 +1,360 @@
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "conceal.h"
+#include "stats.h"
+
+static rctx_conceal_t rctx_conceal;
+
+void conceal_init()
+{
+  memset(&rctx_conceal, 0, sizeof(rctx_conceal));
+  clock_gettime(CLOCK_MONOTONIC, &rctx_conceal.last_report);
+}
+
+// Samples are handled left aligned in 32 bits, whatever their size
+static int32_t get_sample(const unsigned char *p, unsigned int bytes)
+{
+  switch (bytes) {
+    case 2: return (int32_t)((uint32_t)p[0] << 16 | (uint32_t)p[1] << 24);
+    case 3: return (int32_t)((uint32_t)p[0] << 8 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 24);
+    default: return (int32_t)((uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+  }
+}
+
+static void put_sample(unsigned char *p, unsigned int bytes, int32_t v)
+{
+  uint32_t u = (uint32_t)v;
+
+  switch (bytes) {
+    case 2: p[0] = u >> 16; p[1] = u >> 24; break;
+    case 3: p[0] = u >> 8; p[1] = u >> 16; p[2] = u >> 24; break;
+    default: p[0] = u; p[1] = u >> 8; p[2] = u >> 16; p[3] = u >> 24; break;
+  }
+}
+
+static unsigned int history_capacity()
+{
+  return rctx_conceal.rate * CONCEAL_HISTORY_MS / 1000 * rctx_conceal.frame_size;
+}
+
+static void set_format(receiver_format_t *rf)
+{
+  memcpy(&rctx_conceal.format, rf, sizeof(receiver_format_t));
+  rctx_conceal.rate = ((rf->sample_rate >= 128) ? 44100 : 48000) * (rf->sample_rate % 128);
+  switch (rf->sample_size) {
+    case 16:
+    case 24:
+    case 32:
+      rctx_conceal.sample_bytes = rf->sample_size / 8;
+      break;
+    default:
+      rctx_conceal.sample_bytes = 0;
+  }
+  rctx_conceal.frame_size = rctx_conceal.sample_bytes * rf->channels;
+  if (rctx_conceal.frame_size > MAX_FRAME_SIZE || rctx_conceal.rate * CONCEAL_HISTORY_MS / 1000 > CONCEAL_HISTORY_FRAMES)
+    rctx_conceal.frame_size = 0;
+
+  rctx_conceal.history_pos = 0;
+  rctx_conceal.history_frames = 0;
+  rctx_conceal.has_timestamp = 0;
+  rctx_conceal.has_arrival = 0;
+}
+
+static void append_history(const unsigned char *audio, unsigned int size)
+{
+  unsigned int cap = history_capacity();
+  unsigned int n;
+
+  size -= size % rctx_conceal.frame_size;
+  if (size >= cap) {
+    memcpy(rctx_conceal.history, audio + size - cap, cap);
+    rctx_conceal.history_pos = 0;
+    rctx_conceal.history_frames = cap / rctx_conceal.frame_size;
+    return;
+  }
+
+  n = cap - rctx_conceal.history_pos;
+  if (n > size) n = size;
+  memcpy(rctx_conceal.history + rctx_conceal.history_pos, audio, n);
+  memcpy(rctx_conceal.history, audio + n, size - n);
+  rctx_conceal.history_pos = (rctx_conceal.history_pos + size) % cap;
+  rctx_conceal.history_frames += size / rctx_conceal.frame_size;
+  if (rctx_conceal.history_frames > cap / rctx_conceal.frame_size)
+    rctx_conceal.history_frames = cap / rctx_conceal.frame_size;
+}
+
+static double search_sample(unsigned int frame)
+{
+  return get_sample(rctx_conceal.lin + frame * rctx_conceal.frame_size, rctx_conceal.sample_bytes) / 65536.0;
+}
+
+// Finds the pitch period: the lag at which the last CONCEAL_WINDOW_MS of
+// history best match (normalized cross correlation) the audio before them.
+// Only the first channel is searched, at about CONCEAL_SEARCH_RATE, so the
+// cost per gap doesn't depend on the format.
+static unsigned int find_period(unsigned int frames)
+{
+  unsigned int step = rctx_conceal.rate / CONCEAL_SEARCH_RATE;
+  unsigned int window = rctx_conceal.rate * CONCEAL_WINDOW_MS / 1000;
+  unsigned int min_period = rctx_conceal.rate * CONCEAL_MIN_PERIOD_MS / 1000;
+  unsigned int max_period = rctx_conceal.rate * CONCEAL_MAX_PERIOD_MS / 1000;
+  unsigned int period, best = frames, i;
+  double xy, xx, yy, x, y, corr, best_corr = -1;
+
+  if (step < 1) step = 1;
+  if (frames < window + min_period) return frames;
+  if (max_period > frames - window) max_period = frames - window;
+
+  for (period = min_period; period <= max_period; period += step) {
+    xy = xx = yy = 0;
+    for (i = frames - window; i < frames; i += step) {
+      x = search_sample(i);
+      y = search_sample(i - period);
+      xy += x * y;
+      xx += x * x;
+      yy += y * y;
+    }
+    corr = xy / sqrt(xx * yy + 1);
+    if (corr > best_corr) {
+      best_corr = corr;
+      best = period;
+    }
+  }
+  return best;
+}
+
+static void start_fill()
+{
+  unsigned int cap = history_capacity();
+  unsigned int size = rctx_conceal.history_frames * rctx_conceal.frame_size;
+  unsigned int start = (rctx_conceal.history_pos + cap - size) % cap;
+  unsigned int n = cap - start;
+
+  if (n > size) n = size;
+  memcpy(rctx_conceal.lin, rctx_conceal.history + start, n);
+  memcpy(rctx_conceal.lin + n, rctx_conceal.history, size - n);
+
+  rctx_conceal.period = rctx_conceal.history_frames ? find_period(rctx_conceal.history_frames) : 0;
+  rctx_conceal.fill_pos = 0;
+  rctx_conceal.fade_frames = rctx_conceal.rate * CONCEAL_FADE_MS / 1000;
+}
+
+// Fill sample <channel> of frame <pos> of the gap: the last pitch period
+// repeated, fading to silence.
+static int32_t fill_sample(unsigned int pos, unsigned int channel)
+{
+  unsigned int frames = rctx_conceal.history_frames;
+  unsigned int period = rctx_conceal.period;
+  double gain;
+
+  if (!period || pos >= rctx_conceal.fade_frames) return 0;
+
+  gain = 1.0 - (double)pos / rctx_conceal.fade_frames;
+  return (int32_t)(gain * get_sample(rctx_conceal.lin + (frames - period + pos % period) * rctx_conceal.frame_size
+    + channel * rctx_conceal.sample_bytes, rctx_conceal.sample_bytes));
+}
+
+static int send_chunk(unsigned int frames, int (*output_send_fn)(receiver_data_t* receiver_data))
+{
+  receiver_data_t fill;
+
+  memset(&fill, 0, sizeof(fill));
+  fill.format = rctx_conceal.format;
+  fill.audio_size = frames * rctx_conceal.frame_size;
+  fill.audio = rctx_conceal.chunk;
+  // made up audio arrives the moment it is made up
+  clock_gettime(CLOCK_MONOTONIC, &fill.arrival);
+  return output_send_fn(&fill);
+}
+
+static int send_fill(unsigned int frames, int (*output_send_fn)(receiver_data_t* receiver_data))
+{
+  unsigned int n, f, c;
+
+  while (frames) {
+    n = frames < CONCEAL_CHUNK_FRAMES ? frames : CONCEAL_CHUNK_FRAMES;
+    for (f = 0; f < n; f++) {
+      for (c = 0; c < rctx_conceal.format.channels; c++) {
+        put_sample(rctx_conceal.chunk + f * rctx_conceal.frame_size + c * rctx_conceal.sample_bytes,
+          rctx_conceal.sample_bytes, fill_sample(rctx_conceal.fill_pos + f, c));
+      }
+    }
+    if (send_chunk(n, output_send_fn) != 0) return 1;
+    rctx_conceal.fill_pos += n;
+    frames -= n;
+  }
+  return 0;
+}
+
+// Plays the start of the received audio crossfaded with the continued
+// fill, and the rest as it is.
+static int send_resume(receiver_data_t* receiver_data, int (*output_send_fn)(receiver_data_t* receiver_data))
+{
+  receiver_data_t rest = *receiver_data;
+  unsigned int frames = receiver_data->audio_size / rctx_conceal.frame_size;
+  unsigned int n = frames < CONCEAL_XFADE_FRAMES ? frames : CONCEAL_XFADE_FRAMES;
+  unsigned int f, c, offset;
+  double a;
+
+  for (f = 0; f < n; f++) {
+    a = (double)(f + 1) / (n + 1);
+    for (c = 0; c < rctx_conceal.format.channels; c++) {
+      offset = f * rctx_conceal.frame_size + c * rctx_conceal.sample_bytes;
+      put_sample(rctx_conceal.chunk + offset, rctx_conceal.sample_bytes,
+        (int32_t)(a * get_sample(receiver_data->audio + offset, rctx_conceal.sample_bytes)
+          + (1 - a) * fill_sample(rctx_conceal.fill_pos + f, c)));
+    }
+  }
+  if (n && send_chunk(n, output_send_fn) != 0) return 1;
+
+  rest.audio += n * rctx_conceal.frame_size;
+  rest.audio_size -= n * rctx_conceal.frame_size;
+  return rest.audio_size ? output_send_fn(&rest) : 0;
+}
+
+static int64_t ts_to_ns(const struct timespec *ts)
+{
+  return ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+static void record_late(int64_t late)
+{
+  if (late < rctx_conceal.window_min_ns) rctx_conceal.window_min_ns = late;
+  if (late > rctx_conceal.window_max_ns) rctx_conceal.window_max_ns = late;
+}
+
+// Protocol v1 has no sequence numbers, but the sender sends the audio at
+// its pace: a packet that arrives a packet's duration or more after it
+// was due follows lost ones. Packets are due on the schedule of the
+// earliest arrivals, realigned every CONCEAL_ARRIVAL_WINDOW_MS to follow
+// the drift between the clocks. Lateness within the spread of the previous
+// window counts as jitter. Two packets in a row that late mean a loss that
+// went by as jitter, and the schedule moves at once. Packets that arrive
+// right after another one (in the same UDP GRO datagram, or a burst of the
+// sender) are only scheduled. Returns the number of frames lost before the
+// packet.
+unsigned int conceal_arrival_gap(receiver_data_t* receiver_data)
+{
+  int64_t arrival_ns = ts_to_ns(&receiver_data->arrival);
+  int64_t packet_ns, late, lost = 0;
+  unsigned int frames;
+
+  if (memcmp(&rctx_conceal.format, &receiver_data->format, sizeof(receiver_format_t)))
+    set_format(&receiver_data->format);
+  if (!rctx_conceal.frame_size) return 0;
+  frames = receiver_data->audio_size / rctx_conceal.frame_size;
+  packet_ns = (int64_t)frames * 1000000000LL / rctx_conceal.rate;
+  if (!packet_ns) return 0;
+
+  if (!rctx_conceal.has_arrival) {
+    rctx_conceal.has_arrival = 1;
+    rctx_conceal.expected_ns = arrival_ns;
+    rctx_conceal.last_arrival_ns = arrival_ns;
+    rctx_conceal.jitter_ns = 0;
+    rctx_conceal.step_ns = 0;
+    rctx_conceal.window_start_ns = arrival_ns;
+    rctx_conceal.window_min_ns = INT64_MAX;
+    rctx_conceal.window_max_ns = 0;
+  }
+
+  if (arrival_ns - rctx_conceal.last_arrival_ns >= packet_ns / 4) {
+    late = arrival_ns - rctx_conceal.expected_ns;
+    if (late < 0) {
+      // earlier than any packet before, schedule from here on
+      rctx_conceal.expected_ns = arrival_ns;
+      late = 0;
+    }
+    if (late > rctx_conceal.jitter_ns)
+      lost = (late - rctx_conceal.jitter_ns + packet_ns / 4) / packet_ns;
+    if (lost) {
+      rctx_conceal.arrival_gaps++;
+      rctx_conceal.expected_ns += lost * packet_ns;
+      late -= lost * packet_ns;
+    }
+    if (rctx_conceal.step_ns && late >= packet_ns * 3 / 4) {
+      if (late > rctx_conceal.step_ns) late = rctx_conceal.step_ns;
+      rctx_conceal.expected_ns += late;
+      rctx_conceal.step_ns = 0;
+    } else {
+      if (rctx_conceal.step_ns) record_late(rctx_conceal.step_ns);
+      rctx_conceal.step_ns = 0;
+      if (late >= packet_ns * 3 / 4) rctx_conceal.step_ns = late;
+      else record_late(late);
+    }
+
+    if (arrival_ns - rctx_conceal.window_start_ns >= CONCEAL_ARRIVAL_WINDOW_MS * 1000000LL) {
+      if (rctx_conceal.window_min_ns != INT64_MAX) {
+        rctx_conceal.expected_ns += rctx_conceal.window_min_ns;
+        rctx_conceal.jitter_ns = rctx_conceal.window_max_ns - rctx_conceal.window_min_ns;
+      }
+      rctx_conceal.window_start_ns = arrival_ns;
+      rctx_conceal.window_min_ns = INT64_MAX;
+      rctx_conceal.window_max_ns = 0;
+    }
+  }
+  rctx_conceal.last_arrival_ns = arrival_ns;
+  rctx_conceal.expected_ns += packet_ns;
+
+  return lost * frames;
+}
+
+static void conceal_report()
+{
+  struct timespec now;
+
+  if (verbosity < 2) return;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (now.tv_sec - rctx_conceal.last_report.tv_sec < STATS_INTERVAL) return;
+
+  fprintf(stderr, "conceal: %llu gaps (%llu from arrival times), %.1f ms filled, %llu gaps too long to fill\n",
+    (unsigned long long)rctx_conceal.gaps, (unsigned long long)rctx_conceal.arrival_gaps,
+    rctx_conceal.rate ? rctx_conceal.frames * 1000.0 / rctx_conceal.rate : 0.0,
+    (unsigned long long)rctx_conceal.skipped);
+  rctx_conceal.last_report = now;
+}
+
+// Sends a packet to the output, filling the gap before it first. The gap
+// is the audio missing between the previous packet and this one, known
+// from the protocol v2 media time, plus <gap_frames> the output would go
+// without otherwise (a packet that came too late for the jitter buffer,
+// or v1 packets lost, see conceal_arrival_gap).
+int conceal_send(receiver_data_t* receiver_data, unsigned int gap_frames, int (*output_send_fn)(receiver_data_t* receiver_data))
+{
+  uint64_t missing = gap_frames;
+  int64_t skipped;
+  int ret;
+
+  if (memcmp(&rctx_conceal.format, &receiver_data->format, sizeof(receiver_format_t)))
+    set_format(&receiver_data->format);
+  if (!rctx_conceal.frame_size) return output_send_fn(receiver_data);
+
+  if (receiver_data->flags & RECEIVER_HAS_SEQ) {
+    skipped = (int64_t)(receiver_data->timestamp - rctx_conceal.next_timestamp);
+    if (rctx_conceal.has_timestamp && skipped > 0) missing += skipped;
+    rctx_conceal.has_timestamp = 1;
+    rctx_conceal.next_timestamp = receiver_data->timestamp + receiver_data->audio_size / rctx_conceal.frame_size;
+  }
+
+  if (missing > rctx_conceal.rate * CONCEAL_MAX_MS / 1000) {
+    rctx_conceal.skipped++;
+    missing = 0;
+  }
+
+  if (missing) {
+    rctx_conceal.gaps++;
+    rctx_conceal.frames += missing;
+    start_fill();
+    ret = send_fill(missing, output_send_fn);
+    if (ret == 0) ret = send_resume(receiver_data, output_send_fn);
+  }
+  else {
+    ret = output_send_fn(receiver_data);
+  }
+
+  append_history(receiver_data->audio, receiver_data->audio_size);
+  conceal_report();
+  return ret;
+}
@@ -0,0 +1,66 @@
+#ifndef CONCEAL_H
+#define CONCEAL_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "scream.h"
+
+#define CONCEAL_MAX_MS 100        // longer gaps are pauses, left alone
+#define CONCEAL_FADE_MS 20        // repeated audio fades to silence over this
+#define CONCEAL_HISTORY_MS 20     // audio kept to repeat from
+#define CONCEAL_WINDOW_MS 5       // compared to find the pitch period
+#define CONCEAL_MIN_PERIOD_MS 2
+#define CONCEAL_MAX_PERIOD_MS 10
+#define CONCEAL_SEARCH_RATE 48000 // period search runs at about this rate
+#define CONCEAL_XFADE_FRAMES 64   // crossfade back into the received audio
+#define CONCEAL_CHUNK_FRAMES 1024 // fill is handed to the output in chunks
+#define CONCEAL_ARRIVAL_WINDOW_MS 250 // v1: arrival schedule realigned this often
+
+#define MAX_FRAME_SIZE (8 * 4)
+#define CONCEAL_HISTORY_FRAMES (192000 * CONCEAL_HISTORY_MS / 1000)
+
+typedef struct rctx_conceal {
+  receiver_format_t format;
+  unsigned int rate;
+  unsigned int frame_size;
+  unsigned int sample_bytes;
+
+  // the most recently played audio, circular
+  unsigned char history[CONCEAL_HISTORY_FRAMES * MAX_FRAME_SIZE];
+  unsigned int history_pos;
+  unsigned int history_frames;
+
+  // linearized history while filling a gap
+  unsigned char lin[CONCEAL_HISTORY_FRAMES * MAX_FRAME_SIZE];
+  unsigned int period;
+  unsigned int fill_pos;
+  unsigned int fade_frames;
+
+  unsigned char chunk[CONCEAL_CHUNK_FRAMES * MAX_FRAME_SIZE];
+
+  int has_timestamp;
+  uint64_t next_timestamp;
+
+  // protocol v1 without the jitter buffer: when packets are due to arrive
+  int has_arrival;
+  int64_t expected_ns;
+  int64_t last_arrival_ns;
+  int64_t jitter_ns;        // lateness spread of the previous window
+  int64_t step_ns;          // lateness of the packet before, if it was that late
+  int64_t window_start_ns;
+  int64_t window_min_ns;
+  int64_t window_max_ns;
+
+  uint64_t gaps;
+  uint64_t arrival_gaps;    // of them, found from arrival times
+  uint64_t frames;
+  uint64_t skipped;
+  struct timespec last_report;
+} rctx_conceal_t;
+
+void conceal_init();
+unsigned int conceal_arrival_gap(receiver_data_t* receiver_data);
+int conceal_send(receiver_data_t* receiver_data, unsigned int gap_frames, int (*output_send_fn)(receiver_data_t* receiver_data));
+
+#endif
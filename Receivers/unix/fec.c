@@ -0,0 +1,249 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "fec.h"
+#include "pool.h"
+#include "stats.h"
+
+enum fec_slot_state {
+  Missing, Held, Played
+};
+
+static rctx_fec_t rctx_fec;
+
+void fec_init()
+{
+  memset(&rctx_fec, 0, sizeof(rctx_fec));
+  clock_gettime(CLOCK_MONOTONIC, &rctx_fec.last_report);
+}
+
+static void release(fec_slot_t *slot)
+{
+  if (slot->data.buf) pool_put(slot->data.buf);
+  slot->data.buf = NULL;
+}
+
+static void drop_held()
+{
+  unsigned int i;
+
+  for (i = 0; i < FEC_MAX_GROUP; i++) {
+    if (rctx_fec.slots[i].state == Held) release(&rctx_fec.slots[i]);
+    rctx_fec.slots[i].state = Missing;
+  }
+}
+
+// Another sender took over: drops the packets held for the previous one's
+// group, and learns the group size again from the new one's parity packets
+void fec_restart()
+{
+  drop_held();
+  rctx_fec.group_size = 0;
+  rctx_fec.active = 0;
+  rctx_fec.finished = 0;
+}
+
+static void fec_report()
+{
+  struct timespec now;
+
+  if (verbosity < 2 || !rctx_fec.group_size) return;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (now.tv_sec - rctx_fec.last_report.tv_sec < STATS_INTERVAL) return;
+
+  fprintf(stderr, "fec: groups of %u, %llu parity packets, %llu recovered, %llu unrecoverable\n",
+    rctx_fec.group_size, (unsigned long long)rctx_fec.parity_packets,
+    (unsigned long long)rctx_fec.recovered, (unsigned long long)rctx_fec.unrecovered);
+  rctx_fec.last_report = now;
+}
+
+static void xor_bytes(unsigned char *dst, const unsigned char *src, unsigned int n)
+{
+  unsigned int i = 0;
+  uint64_t a, b;
+
+  for (; i + 8 <= n; i += 8) {
+    memcpy(&a, dst + i, 8);
+    memcpy(&b, src + i, 8);
+    a ^= b;
+    memcpy(dst + i, &a, 8);
+  }
+  for (; i < n; i++) dst[i] ^= src[i];
+}
+
+// Plays the held packets from the first one not played yet, up to the
+// first one still missing (or all of them, when the group is done).
+static int play_held(int flush, play_fn_t play_fn)
+{
+  fec_slot_t *slot;
+  int ret;
+
+  for (; rctx_fec.next < rctx_fec.group_size; rctx_fec.next++) {
+    slot = &rctx_fec.slots[rctx_fec.next];
+    if (slot->state == Missing) {
+      if (!flush) break;
+      continue;
+    }
+    if (slot->state == Held) {
+      slot->state = Played;
+      ret = play_fn(&slot->data);
+      release(slot);
+      if (ret != 0) return 1;
+    }
+  }
+  return 0;
+}
+
+static int finish_group(play_fn_t play_fn)
+{
+  int ret = 0;
+
+  if (rctx_fec.active) {
+    rctx_fec.unrecovered += rctx_fec.group_size - rctx_fec.received;
+    ret = play_held(1, play_fn);
+    rctx_fec.finished = 1;
+    rctx_fec.finished_base = rctx_fec.base;
+  }
+  rctx_fec.active = 0;
+  return ret;
+}
+
+static void start_group(uint32_t seq)
+{
+  rctx_fec.active = 1;
+  rctx_fec.base = seq - seq % rctx_fec.group_size;
+  rctx_fec.next = 0;
+  rctx_fec.received = 0;
+  rctx_fec.timestamp_xor = 0;
+  rctx_fec.length_xor = 0;
+  memset(rctx_fec.payload_xor, 0, rctx_fec.xor_size);
+  rctx_fec.xor_size = 0;
+  drop_held();
+}
+
+// Rebuilds the one missing packet of the group from the parity packet
+static void recover(receiver_data_t* parity)
+{
+  fec_slot_t *slot;
+  unsigned int i, length;
+  uint64_t timestamp = 0;
+
+  for (i = 0; i < rctx_fec.group_size; i++)
+    if (rctx_fec.slots[i].state == Missing) break;
+  slot = &rctx_fec.slots[i];
+
+  length = ((parity->timestamp >> 8) & 0xffff) ^ rctx_fec.length_xor;
+  if (parity->audio_size < 8 || length > parity->audio_size - 8) return;
+
+  for (i = 0; i < 8; i++)
+    timestamp |= (uint64_t)parity->audio[i] << (8 * i);
+
+  memcpy(slot->buf, parity->audio + 8, length);
+  xor_bytes(slot->buf, rctx_fec.payload_xor, length);
+
+  slot->data.format = parity->format;
+  slot->data.flags = RECEIVER_HAS_SEQ;
+  slot->data.seq = rctx_fec.base + (slot - rctx_fec.slots);
+  slot->data.timestamp = timestamp ^ rctx_fec.timestamp_xor;
+  slot->data.audio_size = length;
+  slot->data.audio = slot->buf;
+  slot->data.buf = NULL;
+  slot->data.src_addr = parity->src_addr;
+  slot->data.src_port = parity->src_port;
+  slot->data.arrival = parity->arrival;
+  slot->state = Held;
+  rctx_fec.received++;
+  rctx_fec.recovered++;
+}
+
+static int receive_parity(receiver_data_t* parity, play_fn_t play_fn)
+{
+  unsigned int group_size = parity->timestamp & 0xff;
+
+  if (group_size < 2 || group_size > FEC_MAX_GROUP) return 0;
+  rctx_fec.parity_packets++;
+
+  if (group_size != rctx_fec.group_size) {
+    if (finish_group(play_fn) != 0) return 1;
+    rctx_fec.group_size = group_size;
+    rctx_fec.finished = 0;
+    if (verbosity) fprintf(stderr, "Sender uses FEC with groups of %u packets\n", group_size);
+    return 0;
+  }
+
+  if (!rctx_fec.active || parity->seq != rctx_fec.base) return 0;
+
+  if (rctx_fec.received == rctx_fec.group_size - 1)
+    recover(parity);
+
+  return finish_group(play_fn);
+}
+
+// Passes a packet on to <play_fn>, repairing the packet stream on the way.
+// Once the sender's parity packets have been seen, a packet that follows a
+// missing one is held back, until either the missing one turns up (it was
+// reordered) or the parity packet rebuilds it. That delay only occurs
+// after a loss. If the parity packet doesn't arrive either, the held
+// packets are played when the next group starts.
+int fec_receive(receiver_data_t* receiver_data, play_fn_t play_fn)
+{
+  fec_slot_t *slot;
+  uint32_t offset;
+  int ret = 0;
+
+  if (receiver_data->flags & RECEIVER_FEC_PARITY) {
+    ret = receive_parity(receiver_data, play_fn);
+    fec_report();
+    return ret;
+  }
+
+  if (!(receiver_data->flags & RECEIVER_HAS_SEQ) || !rctx_fec.group_size || receiver_data->audio_size > FEC_MAX_PAYLOAD)
+    return play_fn(receiver_data);
+
+  // a straggler of a group that is done already
+  if (rctx_fec.finished && receiver_data->seq - rctx_fec.finished_base < rctx_fec.group_size)
+    return play_fn(receiver_data);
+
+  offset = receiver_data->seq - rctx_fec.base;
+  if (!rctx_fec.active || offset >= rctx_fec.group_size) {
+    // from an earlier group: too late, the sequence check drops it
+    if (rctx_fec.active && (int32_t)offset < 0)
+      return play_fn(receiver_data);
+    if (finish_group(play_fn) != 0) return 1;
+    start_group(receiver_data->seq);
+    offset = receiver_data->seq - rctx_fec.base;
+  }
+
+  slot = &rctx_fec.slots[offset];
+  if (slot->state != Missing)
+    return play_fn(receiver_data);
+
+  rctx_fec.received++;
+  rctx_fec.timestamp_xor ^= receiver_data->timestamp;
+  rctx_fec.length_xor ^= receiver_data->audio_size;
+  xor_bytes(rctx_fec.payload_xor, receiver_data->audio, receiver_data->audio_size);
+  if (receiver_data->audio_size > rctx_fec.xor_size) rctx_fec.xor_size = receiver_data->audio_size;
+
+  if (offset == rctx_fec.next) {
+    slot->state = Played;
+    rctx_fec.next++;
+    ret = play_fn(receiver_data);
+    if (ret == 0) ret = play_held(0, play_fn);
+  }
+  else {
+    slot->data = *receiver_data;
+    if (receiver_data->buf) {
+      pool_ref(receiver_data->buf);
+    }
+    else {
+      // the audio is only valid until the receiver's next call
+      memcpy(slot->buf, receiver_data->audio, receiver_data->audio_size);
+      slot->data.audio = slot->buf;
+    }
+    slot->state = Held;
+  }
+
+  fec_report();
+  return ret;
+}
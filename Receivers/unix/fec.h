@@ -0,0 +1,54 @@
+#ifndef FEC_H
+#define FEC_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "scream.h"
+#include "network.h"
+
+// A parity packet is a protocol v2 packet with HEADER_FEC_FLAG set as well.
+// It covers the group of data packets starting at its sequence number;
+// groups start at multiples of the group size. Instead of the timestamp,
+// its header holds the group size (byte 9) and the XOR of the payload
+// lengths (bytes 10-11, little endian). Its payload is the XOR of the
+// timestamps (8 bytes, little endian) followed by the XOR of the payloads,
+// zero padded to the longest one.
+#define FEC_MAX_GROUP 32
+#define FEC_MAX_PAYLOAD (MAX_SO_PACKETSIZE - HEADER_V2_SIZE - 8)
+
+typedef int (*play_fn_t)(receiver_data_t* receiver_data);
+
+typedef struct fec_slot {
+  int state;
+  receiver_data_t data;
+  unsigned char buf[FEC_MAX_PAYLOAD];
+} fec_slot_t;
+
+typedef struct rctx_fec {
+  unsigned int group_size;  // 0 until the first parity packet
+  int active;
+  uint32_t base;            // sequence number of the current group's first packet
+  unsigned int next;        // first packet of the group not played yet
+  unsigned int received;
+  fec_slot_t slots[FEC_MAX_GROUP];
+  int finished;             // the group before the current one is done
+  uint32_t finished_base;
+
+  // XOR of the data packets received so far in the group
+  uint64_t timestamp_xor;
+  unsigned int length_xor;
+  unsigned int xor_size;    // longest payload, payload_xor is zero beyond
+  unsigned char payload_xor[FEC_MAX_PAYLOAD];
+
+  uint64_t parity_packets;
+  uint64_t recovered;
+  uint64_t unrecovered;
+  struct timespec last_report;
+} rctx_fec_t;
+
+void fec_init();
+void fec_restart();
+int fec_receive(receiver_data_t* receiver_data, play_fn_t play_fn);
+
+#endif
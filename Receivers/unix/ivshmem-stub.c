@@ -0,0 +1,575 @@
+// ivshmem-stub: stands in for QEMU's ivshmem-server and a guest running the
+// Scream IVSHMEM driver, so that scream -m can be tried without a VM.
+//
+// With -s, it serves the ivshmem-server protocol on a UNIX socket: every
+// peer that connects gets the shared memory and an eventfd as its doorbell,
+// and is told about the other peers. The stub then writes the audio like
+// the guest does and, once the receiver has published its peer ID in the
+// header, rings its doorbell after every chunk. With -m, it writes a plain
+// shared memory file (ivshmem-plain) instead, which the receiver polls.
+//
+// The audio is silence, except that the first 8 bytes of every chunk hold
+// the CLOCK_MONOTONIC time (ns) it was written at, so that the latency up
+// to the output can be measured from e.g. scream -o raw.
+//
+// With -x, it instead stress tests the receiver's reading of the shared
+// memory: a producer thread starts stream after stream with random formats
+// in a small memfd, while a reader thread takes the chunks with
+// rcv_shmem() and checks that each one is whole and of the format it was
+// handed out with. The producer waits for the reader to check each chunk,
+// unless -f lets it run freely: chunks are then rewritten while they are
+// copied, and the test checks that rcv_shmem() drops every chunk that
+// came out wrong.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "shmem.h"
+
+#define MAX_PEERS 16
+#define CHUNKS_PER_SEC 50  // 20 ms chunks, as the driver writes them
+#define STRESS_SIZE (64 << 10)
+#define STRESS_STREAMS 4096
+
+typedef struct producer {
+  unsigned char *mmap;
+  size_t size;
+  int legacy;  // version 1 layout, as older drivers write it
+  int stall;   // stress: sleep halfway through rewriting the header
+  struct shmheader *header;
+  struct shmchunk_tag *tags;
+  uint16_t write_idx;
+  uint32_t generation;
+  uint32_t seq;
+} producer_t;
+
+typedef struct stress_stream {
+  uint32_t chunk_size;
+  receiver_format_t format;
+} stress_stream_t;
+
+int verbosity;  // for shmem.c
+
+typedef struct peer {
+  int sock;
+  int64_t id;
+  int vector_fd;  // the peer's doorbell, vector 0
+} peer_t;
+
+static peer_t peers[MAX_PEERS];
+static int num_peers;
+static int64_t next_id;
+static int shm_fd = -1;
+
+static void show_usage(const char *arg0)
+{
+  fprintf(stderr, "\n");
+  fprintf(stderr, "Usage: %s -s <socket> | -m <file> | -x <seconds> [-r <rate>] [-b <bits>] [-c <channels>]\n", arg0);
+  fprintf(stderr, "\n");
+  fprintf(stderr, "         -s <socket>                  : Serve the ivshmem-server protocol on <socket>,\n");
+  fprintf(stderr, "                                        and ring the receiver's doorbell (ivshmem-doorbell).\n");
+  fprintf(stderr, "         -m <file>                    : Write the plain shared memory <file> (ivshmem-plain).\n");
+  fprintf(stderr, "         -M <MiB>                     : Size of the shared memory, default 2.\n");
+  fprintf(stderr, "         -r <rate>                    : Sample rate, default 48000.\n");
+  fprintf(stderr, "         -b <bits>                    : Sample size, default 16.\n");
+  fprintf(stderr, "         -c <channels>                : Channels, default 2.\n");
+  fprintf(stderr, "         -n                           : Don't ring the doorbell, like a driver\n");
+  fprintf(stderr, "                                        without doorbell support.\n");
+  fprintf(stderr, "         -d <seconds>                 : Stop after <seconds>.\n");
+  fprintf(stderr, "         -L                           : Write the version 1 layout of older drivers.\n");
+  fprintf(stderr, "         -x <seconds>                 : Stress test the receiver's shared memory reader.\n");
+  fprintf(stderr, "         -f                           : With -x, don't wait for the reader to check each\n");
+  fprintf(stderr, "                                        chunk before writing the next one.\n");
+  fprintf(stderr, "\n");
+  exit(1);
+}
+
+static int send_msg(int sock, int64_t value, int fd)
+{
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } control;
+  struct iovec iov = { &value, sizeof(value) };
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+
+  value = htole64(value);
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (fd >= 0) {
+    memset(&control, 0, sizeof(control));
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+  }
+  return sendmsg(sock, &msg, MSG_NOSIGNAL) == sizeof(value) ? 0 : 1;
+}
+
+// Same order as QEMU's ivshmem-server: protocol version, the new peer's
+// ID, the shared memory, the other peers' vectors, and last its own
+static void accept_peer(int listen_fd)
+{
+  peer_t *peer;
+  int sock, i;
+
+  sock = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+  if (sock < 0) return;
+  if (num_peers == MAX_PEERS) {
+    fprintf(stderr, "Too many peers\n");
+    close(sock);
+    return;
+  }
+  peer = &peers[num_peers];
+  peer->sock = sock;
+  peer->id = next_id++;
+  peer->vector_fd = eventfd(0, EFD_CLOEXEC);
+  if (peer->vector_fd < 0) {
+    perror("eventfd");
+    close(sock);
+    return;
+  }
+
+  send_msg(sock, 0, -1);
+  send_msg(sock, peer->id, -1);
+  send_msg(sock, -1, shm_fd);
+  for (i = 0; i < num_peers; i++) {
+    send_msg(sock, peers[i].id, peers[i].vector_fd);
+    send_msg(peers[i].sock, peer->id, peer->vector_fd);
+  }
+  send_msg(sock, peer->id, peer->vector_fd);
+  num_peers++;
+
+  fprintf(stderr, "Peer %lld connected\n", (long long)peer->id);
+}
+
+static void remove_peer(int n)
+{
+  int64_t id = peers[n].id;
+  int i;
+
+  close(peers[n].sock);
+  close(peers[n].vector_fd);
+  peers[n] = peers[--num_peers];
+  for (i = 0; i < num_peers; i++) {
+    send_msg(peers[i].sock, id, -1);
+  }
+  fprintf(stderr, "Peer %lld disconnected\n", (long long)id);
+}
+
+static void ring(int64_t id)
+{
+  uint64_t one = 1;
+  int i;
+
+  for (i = 0; i < num_peers; i++) {
+    if (peers[i].id == id) {
+      if (write(peers[i].vector_fd, &one, sizeof(one)) < 0) perror("write eventfd");
+      return;
+    }
+  }
+}
+
+static int sample_rate_code(int rate)
+{
+  return (rate % 44100) ? rate / 48000 : 128 + rate / 44100;
+}
+
+// Like the driver's Initialize(). With version 2, the generation is odd
+// while the header is rewritten; the magic goes in last either way.
+static void start_stream(producer_t *p, int rate, int bits, int channels, uint32_t chunk_size)
+{
+  struct shmheader *header = p->header;
+  uint32_t generation = shmem_version(header) >= 2 ? header->generation : 0;
+
+  if (!p->legacy) {
+    __atomic_store_n(&header->generation, (generation + 1) | 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+  }
+  memset(header, 0, p->legacy ? SHMEM_V1_HEADER_SIZE : offsetof(struct shmheader, generation));
+  header->offset = p->legacy ? SHMEM_V1_HEADER_SIZE : sizeof(*header);
+  header->chunk_size = chunk_size;
+  if (p->stall) usleep(100);
+  if (p->legacy)
+    header->max_chunks = (p->size - header->offset) / chunk_size;
+  else
+    header->max_chunks = (p->size - header->offset - 8) / (chunk_size + sizeof(struct shmchunk_tag));
+  header->sample_rate = sample_rate_code(rate);
+  header->sample_size = bits;
+  header->channels = channels;
+  header->channel_map = channels == 1 ? 0x4 : (1 << channels) - 1;
+  p->write_idx = 0;
+  p->tags = (struct shmchunk_tag *)&p->mmap[shmem_tags_offset(header)];
+
+  if (!p->legacy) {
+    header->ext_magic = SHMEM_EXT_MAGIC;
+    header->version = 2;
+    p->generation = header->generation + 1;
+    __atomic_store_n(&header->generation, p->generation, __ATOMIC_RELEASE);
+  }
+  __atomic_store_n(&header->magic, SHMEM_MAGIC, __ATOMIC_RELEASE);
+}
+
+// Returns where the next chunk goes, end_chunk() publishes it
+static unsigned char *begin_chunk(producer_t *p)
+{
+  if (++p->write_idx >= p->header->max_chunks) p->write_idx = 0;
+  if (!p->legacy) {
+    __atomic_store_n(&p->tags[p->write_idx].seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+  }
+  return &p->mmap[p->header->offset + (size_t)p->write_idx * p->header->chunk_size];
+}
+
+static void end_chunk(producer_t *p)
+{
+  if (!p->legacy) {
+    p->tags[p->write_idx].generation = p->generation;
+    if (++p->seq == 0) p->seq = 1;
+    __atomic_store_n(&p->tags[p->write_idx].seq, p->seq, __ATOMIC_RELEASE);
+  }
+  __atomic_store_n(&p->header->write_idx, p->write_idx, __ATOMIC_RELEASE);
+}
+
+static stress_stream_t stress_streams[STRESS_STREAMS];
+static uint32_t stress_latest;
+static uint64_t stress_written, stress_checked;
+static volatile int stress_stop;
+static int stress_free;
+
+// Waits for the reader to check the chunks written, for up to 20 ms: it
+// skips chunks when it falls behind
+static void stress_wait()
+{
+  int i;
+
+  if (stress_free) return;
+  for (i = 0; i < 200 && __atomic_load_n(&stress_checked, __ATOMIC_ACQUIRE) < stress_written; i++)
+    usleep(100);
+  __atomic_store_n(&stress_checked, stress_written, __ATOMIC_RELAXED);
+}
+
+// Starts streams of 1 to 20 chunks, each with a random format and chunk
+// size. Every chunk holds its sequence number and stream, a pattern, and
+// its sequence number again at the end. Unless running freely, nothing is
+// written while the reader checks a chunk, so that chunks aren't
+// overwritten meanwhile; the header and the chunks are still rewritten
+// while rcv_shmem() reads them.
+static void *stress_producer(void *arg)
+{
+  static const int rates[] = { 44100, 48000, 96000, 192000 };
+  producer_t *p = arg;
+  unsigned int rnd = 1;
+  uint32_t seq = 0, stream = 0, n, i, j;
+  int rate, bits, channels;
+  unsigned char *chunk;
+  stress_stream_t *s;
+
+  while (!stress_stop) {
+    rate = rates[rand_r(&rnd) % 4];
+    bits = 16 + 8 * (rand_r(&rnd) % 3);
+    channels = 1 + rand_r(&rnd) % 8;
+    // A reader falling behind drops frames, but never the first or last
+    // one: running freely, they must hold the sequence numbers and stream
+    while (stress_free && channels * bits / 8 < 8) channels++;
+    s = &stress_streams[++stream % STRESS_STREAMS];
+    s->chunk_size = (8 + rand_r(&rnd) % 120) * (bits / 8) * channels;
+    s->format.sample_rate = sample_rate_code(rate);
+    s->format.sample_size = bits;
+    s->format.channels = channels;
+    s->format.channel_map = channels == 1 ? 0x4 : (1 << channels) - 1;
+    __atomic_store_n(&stress_latest, stream, __ATOMIC_RELEASE);
+    p->stall = rand_r(&rnd) % 4 == 0;
+    stress_wait();
+    start_stream(p, rate, bits, channels, s->chunk_size);
+
+    n = 1 + rand_r(&rnd) % 20;
+    for (i = 0; i < n && !stress_stop; i++) {
+      stress_wait();
+      chunk = begin_chunk(p);
+      seq++;
+      memcpy(chunk, &seq, 4);
+      memcpy(chunk + 4, &stream, 4);
+      for (j = 8; j < s->chunk_size - 4; j++) chunk[j] = seq + j;
+      memcpy(chunk + s->chunk_size - 4, &seq, 4);
+      end_chunk(p);
+      __atomic_add_fetch(&stress_written, 1, __ATOMIC_RELEASE);
+      // fast enough to lap the reader now and then
+      if (stress_free) usleep(rand_r(&rnd) % 100);
+    }
+  }
+  return NULL;
+}
+
+typedef struct stress_result {
+  uint64_t chunks;
+  uint64_t bad;
+} stress_result_t;
+
+// Whether <audio> is chunk <seq> of <s>, as the producer wrote it. While
+// the reader catches up, a frame in every so many may be missing.
+static int stress_chunk_ok(const receiver_data_t *rd, const stress_stream_t *s, uint32_t seq, uint32_t stream)
+{
+  static unsigned char expected[STRESS_SIZE];
+  uint32_t frame_size = rd->format.channels * (rd->format.sample_size / 8);
+  uint32_t skips, in = 0, out, j;
+
+  if (rd->audio_size > s->chunk_size || (s->chunk_size - rd->audio_size) % frame_size) return 0;
+  memcpy(expected, &seq, 4);
+  memcpy(expected + 4, &stream, 4);
+  for (j = 8; j < s->chunk_size - 4; j++) expected[j] = seq + j;
+  memcpy(expected + s->chunk_size - 4, &seq, 4);
+
+  skips = (s->chunk_size - rd->audio_size) / frame_size;
+  for (out = 0; out < rd->audio_size; out += frame_size, in += frame_size) {
+    if (memcmp(rd->audio + out, expected + in, frame_size) == 0) continue;
+    if (!skips--) return 0;
+    in += frame_size;
+    if (memcmp(rd->audio + out, expected + in, frame_size) != 0) return 0;
+  }
+  return 1;
+}
+
+static void *stress_reader(void *arg)
+{
+  stress_result_t *result = arg;
+  receiver_data_t rd;
+  uint32_t seq, stream;
+  stress_stream_t *s;
+  unsigned int rnd = 2;
+  int good;
+
+  for (;;) {
+    if (rcv_shmem(&rd, 1) == 0) continue;
+    // an output taking its time, for the producer to lap
+    if (stress_free && rand_r(&rnd) % 4 == 0) usleep(rand_r(&rnd) % 2000);
+    good = rd.audio_size >= 12;
+    if (good) {
+      memcpy(&seq, rd.audio, 4);
+      memcpy(&stream, rd.audio + 4, 4);
+      s = &stress_streams[stream % STRESS_STREAMS];
+      good = stream <= __atomic_load_n(&stress_latest, __ATOMIC_ACQUIRE)
+        && memcmp(&rd.format, &s->format, sizeof(rd.format)) == 0 && stress_chunk_ok(&rd, s, seq, stream);
+    }
+    result->chunks++;
+    if (!good) result->bad++;
+    __atomic_add_fetch(&stress_checked, 1, __ATOMIC_RELEASE);
+  }
+  return NULL;
+}
+
+static int stress_test(int seconds, int legacy)
+{
+  producer_t p;
+  pthread_t producer, reader;
+  stress_result_t result = { 0, 0 };
+  char path[64];
+  int fd;
+
+  fd = memfd_create("ivshmem-stress", MFD_CLOEXEC);
+  if (fd < 0 || ftruncate(fd, STRESS_SIZE) != 0) {
+    perror("Failed to create the shared memory");
+    return 1;
+  }
+  memset(&p, 0, sizeof(p));
+  p.size = STRESS_SIZE;
+  p.legacy = legacy;
+  p.mmap = mmap(0, p.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p.mmap == MAP_FAILED) {
+    perror("Failed to map the shared memory");
+    return 1;
+  }
+  p.header = (struct shmheader *)p.mmap;
+
+  // the reader waits for the chunks on their deadlines, and polls 8 times
+  // per ms when they are late
+  snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+  init_shmem(path, 1, 0);
+  pthread_create(&producer, NULL, stress_producer, &p);
+  pthread_create(&reader, NULL, stress_reader, &result);
+  sleep(seconds);
+  stress_stop = 1;
+  pthread_join(producer, NULL);
+  pthread_cancel(reader);
+  pthread_join(reader, NULL);
+
+  fprintf(stderr, "Version %d layout: %u streams, %llu chunks written, %llu read, %llu bad\n",
+    legacy ? 1 : 2, stress_latest, (unsigned long long)stress_written,
+    (unsigned long long)result.chunks, (unsigned long long)result.bad);
+  // version 1 has no tags, its chunks rewritten while copied are played
+  if (stress_free) {
+    fprintf(stderr, "%llu rewritten while copied and dropped by the reader\n",
+      (unsigned long long)shmem_torn_chunks());
+  }
+  return result.bad != 0;
+}
+
+int main(int argc, char *argv[])
+{
+  char *socket_path = NULL, *file_path = NULL;
+  int size_mib = 2, rate = 48000, bits = 16, channels = 2, no_ring = 0, duration = 0;
+  int legacy = 0, stress = 0;
+  struct sockaddr_un addr;
+  struct pollfd fds[MAX_PEERS + 1];
+  struct timespec next, now, timeout;
+  producer_t p;
+  unsigned char *chunk;
+  uint32_t chunk_size;
+  uint64_t chunks = 0;
+  size_t size;
+  int listen_fd = -1, opt, i, n;
+
+  while ((opt = getopt(argc, argv, "s:m:M:r:b:c:nd:Lx:fh")) != -1) {
+    switch (opt) {
+    case 's':
+      socket_path = optarg;
+      break;
+    case 'm':
+      file_path = optarg;
+      break;
+    case 'M':
+      size_mib = atoi(optarg);
+      if (size_mib <= 0) show_usage(argv[0]);
+      break;
+    case 'r':
+      rate = atoi(optarg);
+      if (rate % 44100 && rate % 48000) show_usage(argv[0]);
+      break;
+    case 'b':
+      bits = atoi(optarg);
+      if (bits != 16 && bits != 24 && bits != 32) show_usage(argv[0]);
+      break;
+    case 'c':
+      channels = atoi(optarg);
+      if (channels < 1 || channels > 8) show_usage(argv[0]);
+      break;
+    case 'n':
+      no_ring = 1;
+      break;
+    case 'd':
+      duration = atoi(optarg);
+      break;
+    case 'L':
+      legacy = 1;
+      break;
+    case 'x':
+      stress = atoi(optarg);
+      if (stress <= 0) show_usage(argv[0]);
+      break;
+    case 'f':
+      stress_free = 1;
+      break;
+    default:
+      show_usage(argv[0]);
+    }
+  }
+  if (stress) return stress_test(stress, legacy);
+  if (!socket_path == !file_path) show_usage(argv[0]);
+
+  size = (size_t)size_mib << 20;
+  if (socket_path) {
+    shm_fd = memfd_create("ivshmem", MFD_CLOEXEC);
+  }
+  else {
+    shm_fd = open(file_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  }
+  if (shm_fd < 0 || ftruncate(shm_fd, size) != 0) {
+    perror("Failed to create the shared memory");
+    return 1;
+  }
+  memset(&p, 0, sizeof(p));
+  p.size = size;
+  p.legacy = legacy;
+  p.mmap = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+  if (p.mmap == MAP_FAILED) {
+    perror("Failed to map the shared memory");
+    return 1;
+  }
+
+  if (socket_path) {
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+    unlink(socket_path);
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(listen_fd, 4) != 0) {
+      perror("Failed to listen on the socket");
+      return 1;
+    }
+  }
+
+  p.header = (struct shmheader *)p.mmap;
+  chunk_size = (bits >> 3) * channels * rate / CHUNKS_PER_SEC;
+  start_stream(&p, rate, bits, channels, chunk_size);
+
+  fprintf(stderr, "Writing %u byte chunks into %d chunk slots of %s\n",
+    chunk_size, p.header->max_chunks, socket_path ? socket_path : file_path);
+
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  while (!duration || chunks < (uint64_t)duration * CHUNKS_PER_SEC) {
+    // serve the peers until the next chunk is due
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    timeout.tv_sec = next.tv_sec - now.tv_sec;
+    timeout.tv_nsec = next.tv_nsec - now.tv_nsec;
+    if (timeout.tv_nsec < 0) {
+      timeout.tv_sec--;
+      timeout.tv_nsec += 1000000000;
+    }
+    if (timeout.tv_sec >= 0) {
+      n = 0;
+      if (listen_fd >= 0) {
+        fds[n].fd = listen_fd;
+        fds[n++].events = POLLIN;
+      }
+      for (i = 0; i < num_peers; i++) {
+        fds[n].fd = peers[i].sock;
+        fds[n++].events = POLLIN;
+      }
+      if (ppoll(fds, n, &timeout, NULL) > 0) {
+        // peers only ever talk by hanging up
+        for (i = n - 1; i >= (listen_fd >= 0); i--) {
+          if (fds[i].revents) remove_peer(i - (listen_fd >= 0));
+        }
+        if (listen_fd >= 0 && fds[0].revents) accept_peer(listen_fd);
+        continue;
+      }
+    }
+
+    chunk = begin_chunk(&p);
+    memset(chunk, 0, chunk_size);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int64_t now_ns = now.tv_sec * 1000000000LL + now.tv_nsec;
+    memcpy(chunk, &now_ns, sizeof(now_ns));
+    end_chunk(&p);
+    if (!no_ring && p.header->doorbell_peer) ring(p.header->doorbell_peer - 1);
+    chunks++;
+
+    next.tv_nsec += 1000000000 / CHUNKS_PER_SEC;
+    if (next.tv_nsec >= 1000000000) {
+      next.tv_sec++;
+      next.tv_nsec -= 1000000000;
+    }
+  }
+
+  if (socket_path) unlink(socket_path);
+  return 0;
+}
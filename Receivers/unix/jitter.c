@@ -0,0 +1,153 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "jitter.h"
+#include "stats.h"
+
+static rctx_jitter_t rctx_jitter;
+
+static int64_t ts_to_ns(const struct timespec *ts)
+{
+  return ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+static unsigned int frame_size(receiver_format_t *rf)
+{
+  switch (rf->sample_size) {
+    case 16:
+    case 24:
+    case 32:
+      return rf->channels * (rf->sample_size / 8);
+    default:
+      return 0;
+  }
+}
+
+void jitter_init(int margin_ms)
+{
+  memset(&rctx_jitter, 0, sizeof(rctx_jitter));
+  rctx_jitter.margin_ns = margin_ms * 1000000LL;
+  rctx_jitter.target_ns = rctx_jitter.margin_ns + JITTER_INITIAL_MS * 1000000LL;
+  rctx_jitter.window_min_ns = INT64_MAX;
+}
+
+// Another sender took over: schedule from its next packet on
+void jitter_restart()
+{
+  if (rctx_jitter.running) rctx_jitter.restarts++;
+  rctx_jitter.running = 0;
+}
+
+// Lateness that JITTER_PERCENTILE of the packets of the last two windows
+// stayed below.
+static int64_t lateness_percentile()
+{
+  uint64_t total = 0, sum = 0, limit;
+  int i;
+
+  for (i = 0; i < JITTER_BINS; i++)
+    total += rctx_jitter.hist[0][i] + rctx_jitter.hist[1][i];
+  if (!total) return 0;
+
+  limit = (uint64_t)(total * JITTER_PERCENTILE + 0.5);
+  for (i = 0; i < JITTER_BINS; i++) {
+    sum += rctx_jitter.hist[0][i] + rctx_jitter.hist[1][i];
+    if (sum >= limit) break;
+  }
+  return (int64_t)(i + 1) * JITTER_BIN_NS;
+}
+
+static void new_window(int64_t now_ns)
+{
+  int64_t percentile = lateness_percentile();
+
+  // The buffer grows at once on a late packet, but only shrinks here, once
+  // the network has been quiet for a while.
+  rctx_jitter.target_ns = percentile + rctx_jitter.margin_ns;
+
+  // Measure against the fastest packet of the window. This follows changes
+  // in path delay and the drift between sender and receiver clock.
+  if (rctx_jitter.window_min_ns > 0 && rctx_jitter.window_min_ns != INT64_MAX)
+    rctx_jitter.expected_ns += rctx_jitter.window_min_ns;
+
+  if (verbosity >= 2) {
+    fprintf(stderr, "jitter: %.1f ms buffered (p%.1f %.1f ms + %.1f ms margin), %llu late, %llu restarts\n",
+      rctx_jitter.target_ns / 1e6, JITTER_PERCENTILE * 100, percentile / 1e6, rctx_jitter.margin_ns / 1e6,
+      (unsigned long long)rctx_jitter.late, (unsigned long long)rctx_jitter.restarts);
+  }
+
+  rctx_jitter.cur ^= 1;
+  memset(rctx_jitter.hist[rctx_jitter.cur], 0, sizeof(rctx_jitter.hist[0]));
+  rctx_jitter.window_start_ns = now_ns;
+  rctx_jitter.window_min_ns = INT64_MAX;
+}
+
+// Holds a packet back until its playout time: the time it would have
+// arrived on a jitter free network, plus the buffer depth. The schedule
+// advances by the audio duration of each packet, so packets are released
+// at the stream's sample rate no matter how bursty they came in. Returns
+// the number of frames the output went without, if the packet came late.
+unsigned int jitter_wait(receiver_data_t* receiver_data)
+{
+  int64_t arrival_ns = ts_to_ns(&receiver_data->arrival);
+  int64_t lateness, deadline_ns, gap_ns = 0;
+  struct timespec now, deadline;
+  int bin;
+
+  if (memcmp(&rctx_jitter.format, &receiver_data->format, sizeof(receiver_format_t))) {
+    memcpy(&rctx_jitter.format, &receiver_data->format, sizeof(receiver_format_t));
+    rctx_jitter.rate = ((receiver_data->format.sample_rate >= 128) ? 44100 : 48000) * (receiver_data->format.sample_rate % 128);
+    rctx_jitter.frame_size = frame_size(&receiver_data->format);
+    rctx_jitter.running = 0;
+  }
+  if (!rctx_jitter.rate || !rctx_jitter.frame_size) return 0;
+
+  if (!rctx_jitter.running || arrival_ns - rctx_jitter.last_arrival_ns > JITTER_GAP_MS * 1000000LL) {
+    if (rctx_jitter.running) rctx_jitter.restarts++;
+    rctx_jitter.running = 1;
+    rctx_jitter.expected_ns = arrival_ns;
+    rctx_jitter.next_timestamp = receiver_data->timestamp;
+    if (!rctx_jitter.window_start_ns) rctx_jitter.window_start_ns = arrival_ns;
+  }
+  rctx_jitter.last_arrival_ns = arrival_ns;
+
+  // With the sender's media time, lost packets don't shift the schedule
+  if (receiver_data->flags & RECEIVER_HAS_SEQ) {
+    rctx_jitter.expected_ns += (int64_t)(receiver_data->timestamp - rctx_jitter.next_timestamp) * 1000000000LL / rctx_jitter.rate;
+    rctx_jitter.next_timestamp = receiver_data->timestamp + receiver_data->audio_size / rctx_jitter.frame_size;
+  }
+
+  lateness = arrival_ns - rctx_jitter.expected_ns;
+  if (lateness < 0) {
+    // earlier than any packet before, schedule from here on
+    rctx_jitter.expected_ns = arrival_ns;
+    lateness = 0;
+  }
+
+  bin = lateness / JITTER_BIN_NS;
+  if (bin >= JITTER_BINS) bin = JITTER_BINS - 1;
+  rctx_jitter.hist[rctx_jitter.cur][bin]++;
+  if (lateness < rctx_jitter.window_min_ns) rctx_jitter.window_min_ns = lateness;
+
+  if (lateness > rctx_jitter.target_ns) {
+    rctx_jitter.late++;
+    gap_ns = lateness + rctx_jitter.margin_ns - rctx_jitter.target_ns;
+    rctx_jitter.target_ns = lateness + rctx_jitter.margin_ns;
+  }
+
+  deadline_ns = rctx_jitter.expected_ns + rctx_jitter.target_ns;
+  rctx_jitter.expected_ns += (int64_t)receiver_data->audio_size * 1000000000LL / ((int64_t)rctx_jitter.rate * rctx_jitter.frame_size);
+
+  if (arrival_ns - rctx_jitter.window_start_ns >= STATS_INTERVAL * 1000000000LL)
+    new_window(arrival_ns);
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (ts_to_ns(&now) < deadline_ns) {
+    deadline.tv_sec = deadline_ns / 1000000000LL;
+    deadline.tv_nsec = deadline_ns % 1000000000LL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR);
+  }
+
+  return gap_ns * rctx_jitter.rate / 1000000000LL;
+}
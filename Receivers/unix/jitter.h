@@ -0,0 +1,42 @@
+#ifndef JITTER_H
+#define JITTER_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "scream.h"
+
+#define JITTER_BIN_NS 100000      // lateness histogram resolution, 0.1ms
+#define JITTER_BINS 2000          // up to 200ms, the last bin takes the rest
+#define JITTER_PERCENTILE 0.999   // share of packets that must be in time
+#define JITTER_INITIAL_MS 10      // buffer depth before anything was measured
+#define JITTER_GAP_MS 200         // senders pause on silence; a longer gap restarts playout
+
+typedef struct rctx_jitter {
+  receiver_format_t format;
+  unsigned int rate;
+  unsigned int frame_size;
+  int running;
+  uint64_t next_timestamp;  // protocol v2 media time expected next
+
+  int64_t margin_ns;
+  int64_t target_ns;        // current buffer depth
+  int64_t expected_ns;      // arrival time of the next packet on a jitter free network
+  int64_t last_arrival_ns;
+
+  // lateness of the packets against expected_ns, for the current and
+  // the previous window of STATS_INTERVAL seconds
+  uint32_t hist[2][JITTER_BINS];
+  int cur;
+  int64_t window_start_ns;
+  int64_t window_min_ns;
+
+  uint64_t late;
+  uint64_t restarts;
+} rctx_jitter_t;
+
+void jitter_init(int margin_ms);
+void jitter_restart();
+unsigned int jitter_wait(receiver_data_t* receiver_data);
+
+#endif
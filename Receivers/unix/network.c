@@ -1,14 +1,234 @@
 #include "network.h"
+#include "pool.h"
 #include "stdio.h"
+#include <stddef.h>
+#include <unistd.h>
+#include <netinet/udp.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 
-static rctx_network_t rctx_network;
+static rctx_network_t rctx_network = { .max_packet = DEFAULT_MAX_PACKET_SIZE };
 
-int init_network(enum receiver_type receiver_mode, in_addr_t interface, int port, char* multicast_group)
+// Source specific joins (IGMPv3): routers and switches that support them
+// only forward the traffic of these senders to the host
+static int join_sources(int sockfd)
 {
-  rctx_network.sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-  if (rctx_network.sockfd < 0) {
+  struct ip_mreq_source mreq;
+
+  for (unsigned int i = 0; i < rctx_network.num_sources; i++) {
+    memset(&mreq, 0, sizeof(mreq));
+    mreq.imr_multiaddr = rctx_network.imreq.imr_multiaddr;
+    mreq.imr_interface = rctx_network.imreq.imr_interface;
+    mreq.imr_sourceaddr.s_addr = rctx_network.sources[i];
+    if (setsockopt(sockfd, IPPROTO_IP, IP_ADD_SOURCE_MEMBERSHIP, &mreq, sizeof(mreq)) != 0) {
+      perror("Failed to join multicast group for sender");
+      return 1;
+    }
+  }
+  return 0;
+}
+
+#ifdef __linux__
+static int sys_bpf(int cmd, union bpf_attr *attr)
+{
+  return (int)syscall(__NR_bpf, cmd, attr, sizeof(union bpf_attr));
+}
+
+#define INSN(c, d, s, o, i) ((struct bpf_insn){ .code = (c), .dst_reg = (d), .src_reg = (s), .off = (o), .imm = (i) })
+
+// eBPF version of the classic filter below, which adds up its rejects in
+// the first element of the array map <mapfd>
+static int load_header_filter(int mapfd)
+{
+  struct bpf_insn prog[40];
+  int reject_jumps[10];
+  int n = 0, j = 0, i;
+  union bpf_attr attr;
+
+  // the packet loads take the context from r6, and clobber r1 to r5
+  prog[n++] = INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0);
+  prog[n++] = INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_7, BPF_REG_6, offsetof(struct __sk_buff, len), 0);
+  reject_jumps[j++] = n;
+  prog[n++] = INSN(BPF_JMP | BPF_JLT | BPF_K, BPF_REG_7, 0, 0, 8 + HEADER_SIZE);
+  // sample rate multiplier
+  prog[n++] = INSN(BPF_LD | BPF_ABS | BPF_B, 0, 0, 0, 8);
+  prog[n++] = INSN(BPF_ALU64 | BPF_AND | BPF_K, BPF_REG_0, 0, 0, 0x7f);
+  reject_jumps[j++] = n;
+  prog[n++] = INSN(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 0, 0);
+  // sample size
+  prog[n++] = INSN(BPF_LD | BPF_ABS | BPF_B, 0, 0, 0, 9);
+  prog[n++] = INSN(BPF_ALU64 | BPF_AND | BPF_K, BPF_REG_0, 0, 0, (uint8_t)~(HEADER_V2_FLAG | HEADER_FEC_FLAG));
+  prog[n++] = INSN(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 2, 16);
+  prog[n++] = INSN(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 1, 24);
+  reject_jumps[j++] = n;
+  prog[n++] = INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_0, 0, 0, 32);
+  // protocol v2 has the longer header
+  prog[n++] = INSN(BPF_LD | BPF_ABS | BPF_B, 0, 0, 0, 9);
+  prog[n++] = INSN(BPF_ALU64 | BPF_AND | BPF_K, BPF_REG_0, 0, 0, HEADER_V2_FLAG);
+  prog[n++] = INSN(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 1, 0);
+  reject_jumps[j++] = n;
+  prog[n++] = INSN(BPF_JMP | BPF_JLT | BPF_K, BPF_REG_7, 0, 0, 8 + HEADER_V2_SIZE);
+  // channel count
+  prog[n++] = INSN(BPF_LD | BPF_ABS | BPF_B, 0, 0, 0, 10);
+  reject_jumps[j++] = n;
+  prog[n++] = INSN(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 0, 0);
+  reject_jumps[j++] = n;
+  prog[n++] = INSN(BPF_JMP | BPF_JGT | BPF_K, BPF_REG_0, 0, 0, MAX_STREAM_CHANNELS);
+  prog[n++] = INSN(BPF_ALU | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, -1);
+  prog[n++] = INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+  // reject: __sync_fetch_and_add(bpf_map_lookup_elem(&rejects, &0), 1)
+  for (i = 0; i < j; i++) {
+    prog[reject_jumps[i]].off = n - reject_jumps[i] - 1;
+  }
+  prog[n++] = INSN(BPF_ST | BPF_MEM | BPF_W, BPF_REG_10, 0, -4, 0);
+  prog[n++] = INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0);
+  prog[n++] = INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, -4);
+  prog[n++] = INSN(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, mapfd);
+  prog[n++] = INSN(0, 0, 0, 0, 0);
+  prog[n++] = INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem);
+  prog[n++] = INSN(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 2, 0);
+  prog[n++] = INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_1, 0, 0, 1);
+  prog[n++] = INSN(BPF_STX | BPF_XADD | BPF_DW, BPF_REG_0, BPF_REG_1, 0, 0);
+  prog[n++] = INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, 0);
+  prog[n++] = INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+
+  memset(&attr, 0, sizeof(attr));
+  attr.prog_type = BPF_PROG_TYPE_SOCKET_FILTER;
+  attr.insns = (uint64_t)(uintptr_t)prog;
+  attr.insn_cnt = n;
+  attr.license = (uint64_t)(uintptr_t)"GPL";
+  return sys_bpf(BPF_PROG_LOAD, &attr);
+}
+
+// Attaches the eBPF header filter, returns its reject counter map
+static int attach_counting_filter(int sockfd)
+{
+  union bpf_attr attr;
+  int mapfd, progfd;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.map_type = BPF_MAP_TYPE_ARRAY;
+  attr.key_size = sizeof(uint32_t);
+  attr.value_size = sizeof(uint64_t);
+  attr.max_entries = 1;
+  mapfd = sys_bpf(BPF_MAP_CREATE, &attr);
+  if (mapfd < 0) return -1;
+
+  progfd = load_header_filter(mapfd);
+  if (progfd < 0 || setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_BPF, &progfd, sizeof(progfd)) != 0) {
+    if (progfd >= 0) close(progfd);
+    close(mapfd);
+    return -1;
+  }
+  // the socket keeps the program
+  close(progfd);
+  return mapfd;
+}
+
+// The header filter's rejects so far, 0 if they can't be read
+static uint64_t header_filter_rejects(int mapfd)
+{
+  union bpf_attr attr;
+  uint32_t key = 0;
+  uint64_t rejects = 0;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.map_fd = mapfd;
+  attr.key = (uint64_t)(uintptr_t)&key;
+  attr.value = (uint64_t)(uintptr_t)&rejects;
+  if (sys_bpf(BPF_MAP_LOOKUP_ELEM, &attr) != 0) return 0;
+  return rejects;
+}
+#endif
+
+// Drops datagrams that can't be Scream packets in the kernel, before they
+// are queued and wake up the receiver. A UDP socket filter sees the UDP
+// header first, the Scream header follows at offset 8. Checked are the
+// length, a sample rate multiplier of at least 1, a sample size of 16, 24
+// or 32 bits (the protocol v2 and FEC flags masked off) and the channel
+// count. Returns the eBPF filter's reject counter map, or -1 if only the
+// classic filter (or none) could be attached.
+static int attach_header_filter(int sockfd)
+{
+#ifdef __linux__
+  static struct sock_filter code[] = {
+    BPF_STMT(BPF_LD | BPF_W | BPF_LEN, 0),
+    BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, 8 + HEADER_SIZE, 0, 16),
+    BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 8),
+    BPF_STMT(BPF_ALU | BPF_AND | BPF_K, 0x7f),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 13, 0),
+    BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 9),
+    BPF_STMT(BPF_ALU | BPF_AND | BPF_K, (uint8_t)~(HEADER_V2_FLAG | HEADER_FEC_FLAG)),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 16, 2, 0),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 24, 1, 0),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 32, 0, 8),
+    // protocol v2 has the longer header
+    BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 9),
+    BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, HEADER_V2_FLAG, 0, 2),
+    BPF_STMT(BPF_LD | BPF_W | BPF_LEN, 0),
+    BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, 8 + HEADER_V2_SIZE, 0, 4),
+    BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 10),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 2, 0),
+    BPF_JUMP(BPF_JMP | BPF_JGT | BPF_K, MAX_STREAM_CHANNELS, 1, 0),
+    BPF_STMT(BPF_RET | BPF_K, 0xffffffff),
+    BPF_STMT(BPF_RET | BPF_K, 0),
+  };
+  struct sock_fprog prog = { sizeof(code) / sizeof(code[0]), code };
+  int mapfd = attach_counting_filter(sockfd);
+
+  if (mapfd >= 0) return mapfd;
+  // The classic filter's rejects can't be told from the drops for want of
+  // buffer space, which -b auto grows the buffer on
+  if (rctx_network.rcvbuf_mode == RCVBUF_AUTO) {
+    if (verbosity) perror("eBPF packet filter not available, not filtering in the kernel");
+    return -1;
+  }
+  if (setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) != 0 && verbosity) {
+    perror("Failed to attach the packet filter");
+  }
+#endif
+  return -1;
+}
+
+static int open_socket(enum receiver_type receiver_mode, in_addr_t interface, int port, char* multicast_group, int reuseport)
+{
+  int sockfd, on = 1;
+
+  sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (sockfd < 0) {
     perror("Failed to craete socket");
-    return 1;
+    return -1;
+  }
+
+  // have the kernel timestamp every datagram on arrival
+  if (setsockopt(sockfd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) != 0 && verbosity) {
+    perror("SO_TIMESTAMPNS not available");
+  }
+
+  // and report how many datagrams it dropped for want of buffer space
+  if (setsockopt(sockfd, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on)) != 0 && verbosity) {
+    perror("SO_RXQ_OVFL not available");
+  }
+
+  if (rctx_network.busy_poll_us) {
+    // let a receive call poll the device queue itself for a while, rather
+    // than sleep until the interrupt (needs CAP_NET_ADMIN to go beyond
+    // net.core.busy_read)
+    if (setsockopt(sockfd, SOL_SOCKET, SO_BUSY_POLL, &rctx_network.busy_poll_us, sizeof(int)) != 0 && verbosity) {
+      perror("SO_BUSY_POLL not available");
+    }
+#ifdef SO_PREFER_BUSY_POLL
+    if (setsockopt(sockfd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &on, sizeof(on)) != 0 && verbosity) {
+      perror("SO_PREFER_BUSY_POLL not available");
+    }
+#endif
+  }
+
+  // all worker sockets bind to the same port
+  if (reuseport && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) != 0) {
+    perror("Failed to set SO_REUSEPORT");
+    return -1;
   }
 
   memset((void *)&(rctx_network.servaddr), 0, sizeof(rctx_network.servaddr));
@@ -16,37 +236,493 @@ int init_network(enum receiver_type receiver_mode, in_addr_t interface, int port
   rctx_network.servaddr.sin_addr.s_addr = (receiver_mode == Unicast) ? interface : htonl(INADDR_ANY);
   rctx_network.servaddr.sin_port = htons(port);
 
-  if (bind(rctx_network.sockfd, (struct sockaddr *)&rctx_network.servaddr, sizeof(rctx_network.servaddr)) != 0) {
+  if (bind(sockfd, (struct sockaddr *)&rctx_network.servaddr, sizeof(rctx_network.servaddr)) != 0) {
     perror("Failed to bind to interface");
-    return 1;
+    return -1;
   }
 
   if (receiver_mode == Multicast) {
     rctx_network.imreq.imr_multiaddr.s_addr = inet_addr(multicast_group ? multicast_group : DEFAULT_MULTICAST_GROUP);
     rctx_network.imreq.imr_interface.s_addr = interface;
 
-    if (setsockopt(rctx_network.sockfd, IPPROTO_IP, IP_ADD_MEMBERSHIP,
+    if (rctx_network.num_sources) {
+      if (join_sources(sockfd) != 0) return -1;
+    }
+    else if (setsockopt(sockfd, IPPROTO_IP, IP_ADD_MEMBERSHIP,
                   (const void *)&rctx_network.imreq, sizeof(struct ip_mreq)) != 0) {
       perror("Failed to join multicast group");
-      return 1;
+      return -1;
     };
   }
 
+  return sockfd;
+}
+
+// Of the <dropped> datagrams the kernel reported, those it dropped for
+// want of buffer space rather than on the header filter's verdict. Rejects
+// counted past the kernel's report are taken off the next drops.
+static uint32_t buffer_drops(rcvbuf_state_t *rcvbuf, uint32_t dropped)
+{
+#ifdef __linux__
+  uint64_t rejects, rejected;
+
+  if (rcvbuf->rejects_fd < 0) return dropped;
+  rejects = header_filter_rejects(rcvbuf->rejects_fd);
+  if (rejects < rcvbuf->rejects_seen) return dropped;
+  rejected = rejects - rcvbuf->rejects_seen;
+  if (rejected > dropped) {
+    rcvbuf->rejects_seen += dropped;
+    return 0;
+  }
+  rcvbuf->rejects_seen = rejects;
+  return dropped - (uint32_t)rejected;
+#else
+  return dropped;
+#endif
+}
+
+static void get_rcvbuf(rcvbuf_state_t *rcvbuf)
+{
+  int set;
+  socklen_t len = sizeof(set);
+
+  // the kernel doubles it, to make up for its bookkeeping overhead
+  if (getsockopt(rcvbuf->sockfd, SOL_SOCKET, SO_RCVBUF, &set, &len) == 0) {
+    rcvbuf->size = set / 2;
+  }
+}
+
+// Returns the size actually set
+static int set_rcvbuf(rcvbuf_state_t *rcvbuf, int size)
+{
+  // SO_RCVBUFFORCE may go past net.core.rmem_max, but needs CAP_NET_ADMIN
+  if (setsockopt(rcvbuf->sockfd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) != 0
+      && setsockopt(rcvbuf->sockfd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) != 0) {
+    perror("Failed to set receive buffer size");
+  }
+
+  get_rcvbuf(rcvbuf);
+  if (rcvbuf->size < size) rcvbuf->capped = 1;
+  return rcvbuf->size;
+}
+
+static void init_rcvbuf(rcvbuf_state_t *rcvbuf, int sockfd)
+{
+  memset(rcvbuf, 0, sizeof(rcvbuf_state_t));
+  rcvbuf->sockfd = sockfd;
+  rcvbuf->rejects_fd = attach_header_filter(sockfd);
+
+  if (rctx_network.rcvbuf_mode > 0) {
+    set_rcvbuf(rcvbuf, rctx_network.rcvbuf_mode);
+    if (verbosity) fprintf(stderr, "Receive buffer of %d KiB%s\n", rcvbuf->size / 1024,
+      rcvbuf->capped ? " (limited by net.core.rmem_max)" : "");
+  }
+  else {
+    // just to know where autosizing starts from
+    get_rcvbuf(rcvbuf);
+  }
+}
+
+// Bytes per second the stream fills the receive buffer with
+static int64_t stream_byte_rate(const receiver_data_t* receiver_data)
+{
+  const receiver_format_t *rf = &receiver_data->format;
+  int64_t rate = ((rf->sample_rate >= 128) ? 44100 : 48000) * (rf->sample_rate % 128);
+
+  if (!receiver_data->audio_size) return 0;
+  // with the headers, roughly what the kernel charges for a datagram
+  return rate * rf->channels * (rf->sample_size / 8)
+    * (receiver_data->audio_size + HEADER_V2_SIZE) / receiver_data->audio_size;
+}
+
+// Accounts the drops the kernel reported, up to the datagram carrying the
+// latest counter. With -b auto, grows the buffer to hold RCVBUF_AUTO_MIN_MS
+// of the stream to start with, and on drops by twice what was dropped (at
+// least by half), up to RCVBUF_AUTO_MAX_MS.
+static void check_drops(rcvbuf_state_t *rcvbuf, uint32_t drops, const receiver_data_t* receiver_data, ingest_stats_t *stats)
+{
+  uint32_t dropped = drops - rcvbuf->drops_seen;
+  int64_t byte_rate, want;
+
+  rcvbuf->drops_seen = drops;
+  if (dropped) dropped = buffer_drops(rcvbuf, dropped);
+  stats->drops += dropped;
+  if (rctx_network.rcvbuf_mode != RCVBUF_AUTO || rcvbuf->capped) return;
+
+  byte_rate = stream_byte_rate(receiver_data);
+  if (!byte_rate) return;
+
+  want = byte_rate * RCVBUF_AUTO_MIN_MS / 1000;
+  if (dropped) {
+    want = rcvbuf->size + 2LL * dropped * (receiver_data->audio_size + HEADER_V2_SIZE);
+    if (want < rcvbuf->size * 3LL / 2) want = rcvbuf->size * 3LL / 2;
+  }
+  if (want > byte_rate * RCVBUF_AUTO_MAX_MS / 1000) want = byte_rate * RCVBUF_AUTO_MAX_MS / 1000;
+  if (want <= rcvbuf->size) return;
+
+  set_rcvbuf(rcvbuf, want);
+  if (verbosity) {
+    fprintf(stderr, "Receive buffer grown to %d KiB, %lld ms of the stream%s\n",
+      rcvbuf->size / 1024, (long long)(rcvbuf->size * 1000LL / byte_rate),
+      rcvbuf->capped ? " (limited by net.core.rmem_max)" : "");
+  }
+}
+
+// For engines receiving from the socket of init_network()
+void network_drops(uint32_t drops, const receiver_data_t* receiver_data, ingest_stats_t *stats)
+{
+  check_drops(&rctx_network.rcvbuf, drops, receiver_data, stats);
+}
+
+#if RECVMMSG_ENABLE
+// <rcvbuf> is the receive buffer state of a socket shared with another
+// engine, NULL for a socket of its own
+static int init_batch(network_batch_t *batch, int sockfd, const char *name, rcvbuf_state_t *rcvbuf)
+{
+  batch->slots = malloc((size_t)MAX_BATCH * rctx_network.max_packet);
+  if (!batch->slots) {
+    perror("Failed to allocate packet slots");
+    return 1;
+  }
+  memset(batch->msgs, 0, sizeof(batch->msgs));
+  for (int i = 0; i < MAX_BATCH; i++) {
+    batch->iovecs[i].iov_base = batch->slots + (size_t)i * rctx_network.max_packet;
+    batch->iovecs[i].iov_len = rctx_network.max_packet;
+    batch->msgs[i].msg_hdr.msg_iov = &batch->iovecs[i];
+    batch->msgs[i].msg_hdr.msg_iovlen = 1;
+    batch->msgs[i].msg_hdr.msg_name = &batch->names[i];
+    batch->msgs[i].msg_hdr.msg_control = batch->controls[i];
+  }
+  batch->sockfd = sockfd;
+  snprintf(batch->name, sizeof(batch->name), "%s", name);
+  stats_init(&batch->stats, batch->name);
+  batch->stats.count_drops = 1;
+  if (!rcvbuf) {
+    init_rcvbuf(&batch->own_rcvbuf, sockfd);
+    rcvbuf = &batch->own_rcvbuf;
+  }
+  batch->rcvbuf = rcvbuf;
+  return 0;
+}
+#endif
+
+int init_network(enum receiver_type receiver_mode, enum ingest_type ingest_mode, in_addr_t interface, int port, char* multicast_group, unsigned int workers, int rcvbuf, int busy_poll_us, const uint32_t *sources, unsigned int num_sources)
+{
+#if RECVMMSG_ENABLE
+  char name[24];
+#endif
+
+  rctx_network.rcvbuf_mode = rcvbuf;
+  rctx_network.busy_poll_us = busy_poll_us;
+  memcpy(rctx_network.sources, sources, num_sources * sizeof(uint32_t));
+  rctx_network.num_sources = num_sources;
+
+#if RECVMMSG_ENABLE
+
+  if (workers) {
+    // The kernel spreads unicast flows over the sockets by a hash of the
+    // addresses and ports, so each sender sticks to one worker
+    rctx_network.workers = calloc(workers, sizeof(network_batch_t));
+    if (!rctx_network.workers) {
+      perror("Failed to allocate worker sockets");
+      return 1;
+    }
+    for (unsigned int i = 0; i < workers; i++) {
+      int sockfd = open_socket(receiver_mode, interface, port, multicast_group, 1);
+      if (sockfd < 0) return 1;
+      snprintf(name, sizeof(name), "mmsg[%u]", i);
+      if (init_batch(&rctx_network.workers[i], sockfd, name, NULL) != 0) return 1;
+    }
+    rctx_network.num_workers = workers;
+    rctx_network.sockfd = rctx_network.workers[0].sockfd;
+    return 0;
+  }
+#endif
+
+  rctx_network.sockfd = open_socket(receiver_mode, interface, port, multicast_group, 0);
+  if (rctx_network.sockfd < 0) return 1;
+  init_rcvbuf(&rctx_network.rcvbuf, rctx_network.sockfd);
+
+#ifdef UDP_GRO
+  // Let the kernel coalesce back-to-back datagrams of a sender into one
+  // super-datagram, rcv_network() splits them up again.
+  if (ingest_mode == Recvfrom) {
+    int on = 1;
+    if (setsockopt(rctx_network.sockfd, SOL_UDP, UDP_GRO, &on, sizeof(on)) != 0 && verbosity) {
+      perror("UDP_GRO not available");
+    }
+  }
+#endif
+
+#if RECVMMSG_ENABLE
+  // set up unconditionally, other engines fall back to recvmmsg
+  if (init_batch(&rctx_network.batch, rctx_network.sockfd, "recvmmsg", &rctx_network.rcvbuf) != 0) return 1;
+#endif
+
+  stats_init(&rctx_network.stats, "recvfrom");
+  rctx_network.stats.count_drops = 1;
+
   return 0;
 }
 
-void rcv_network(receiver_data_t* receiver_data)
+int get_network_socket()
+{
+  return rctx_network.sockfd;
+}
+
+// Before any receive engine or the packet pool is set up
+void set_max_packet_size(unsigned int size)
+{
+  rctx_network.max_packet = size;
+}
+
+unsigned int get_max_packet_size()
+{
+  return rctx_network.max_packet;
+}
+
+// Counts a packet larger than the receive buffers (cut off by the kernel)
+// or the pool buffers, and says so the first time
+void network_oversized()
+{
+  if (__atomic_fetch_add(&rctx_network.oversized, 1, __ATOMIC_RELAXED) == 0) {
+    fprintf(stderr, "Dropping packets larger than %u bytes, see -M\n", rctx_network.max_packet);
+  }
+}
+
+int64_t realtime_offset_ns()
+{
+  struct timespec rt, mono;
+
+  clock_gettime(CLOCK_MONOTONIC, &mono);
+  clock_gettime(CLOCK_REALTIME, &rt);
+  return (rt.tv_sec - mono.tv_sec) * 1000000000LL + (rt.tv_nsec - mono.tv_nsec);
+}
+
+// <offset_ns> is from realtime_offset_ns(), taken once per batch
+void arrival_from_realtime(struct timespec *arrival, const struct timespec *realtime, int64_t offset_ns)
+{
+  int64_t ns = realtime->tv_sec * 1000000000LL + realtime->tv_nsec - offset_ns;
+
+  arrival->tv_sec = ns / 1000000000LL;
+  arrival->tv_nsec = ns % 1000000000LL;
+}
+
+// Picks the SO_TIMESTAMPNS and SO_RXQ_OVFL control messages of a datagram.
+// Returns 0 if there is no timestamp. <drops> is left alone without a drop
+// counter, the kernel only sends it once it has dropped something.
+int parse_cmsg(struct msghdr *msg, struct timespec *realtime, uint32_t *drops)
 {
-  ssize_t n = 0;
+  struct cmsghdr *cmsg;
+  int found = 0;
 
-  while (n < HEADER_SIZE) {
-    n = recvfrom(rctx_network.sockfd, rctx_network.buf, MAX_SO_PACKETSIZE, 0, NULL, 0);
+  for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET) continue;
+    if (cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+      memcpy(realtime, CMSG_DATA(cmsg), sizeof(*realtime));
+      found = 1;
+    }
+    else if (cmsg->cmsg_type == SO_RXQ_OVFL) {
+      memcpy(drops, CMSG_DATA(cmsg), sizeof(*drops));
+    }
   }
-  receiver_data->format.sample_rate = rctx_network.buf[0];
-  receiver_data->format.sample_size = rctx_network.buf[1];
-  receiver_data->format.channels = rctx_network.buf[2];
-  receiver_data->format.channel_map = (rctx_network.buf[4] << 8) | rctx_network.buf[3];
-  receiver_data->audio_size = n - HEADER_SIZE;
-  receiver_data->audio = &rctx_network.buf[5];
+  return found;
+}
+
+// With -B, the receive calls don't block right away: they are retried
+// with MSG_DONTWAIT until <deadline_ns> (set on the first call), so a
+// datagram arriving meanwhile is picked up without waking the thread.
+// Once the spin budget is spent, returns 0 to block.
+static int spin_flags(int64_t *deadline_ns)
+{
+  struct timespec now;
+  int64_t now_ns;
+
+  if (!rctx_network.busy_poll_us) return 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  now_ns = now.tv_sec * 1000000000LL + now.tv_nsec;
+  if (!*deadline_ns) *deadline_ns = now_ns + rctx_network.busy_poll_us * 1000LL;
+  return now_ns < *deadline_ns ? MSG_DONTWAIT : 0;
 }
 
+static uint64_t get_le(unsigned char* buf, int bytes)
+{
+  uint64_t v = 0;
+  while (bytes--) v = (v << 8) | buf[bytes];
+  return v;
+}
+
+// Parses a Scream packet in place. Returns 0 if it is too short, or if its
+// audio isn't whole frames. The driver's default payload splits the frames
+// of 5 and 7 channel streams between packets, so that size always passes.
+int parse_packet(receiver_data_t* receiver_data, unsigned char* buf, ssize_t n)
+{
+  int header_size = HEADER_SIZE;
+  unsigned int frame_size;
+
+  if (n < HEADER_SIZE) return 0;
+  if (n > (ssize_t)rctx_network.max_packet) {
+    network_oversized();
+    return 0;
+  }
+
+  receiver_data->flags = 0;
+  if (buf[1] & HEADER_V2_FLAG) {
+    if (n < HEADER_V2_SIZE) return 0;
+    receiver_data->flags |= (buf[1] & HEADER_FEC_FLAG) ? RECEIVER_FEC_PARITY : RECEIVER_HAS_SEQ;
+    receiver_data->seq = get_le(&buf[5], 4);
+    receiver_data->timestamp = get_le(&buf[9], 8);
+    header_size = HEADER_V2_SIZE;
+  }
+
+  receiver_data->format.sample_rate = buf[0];
+  receiver_data->format.sample_size = buf[1] & ~(HEADER_V2_FLAG | HEADER_FEC_FLAG);
+  receiver_data->format.channels = buf[2];
+  receiver_data->format.channel_map = (buf[4] << 8) | buf[3];
+  receiver_data->audio_size = n - header_size;
+  receiver_data->audio = &buf[header_size];
+  receiver_data->buf = NULL;
+
+  frame_size = receiver_data->format.channels * (receiver_data->format.sample_size / 8);
+  if (!(receiver_data->flags & RECEIVER_FEC_PARITY) && receiver_data->audio_size != DEFAULT_PAYLOAD_SIZE
+      && (!frame_size || receiver_data->audio_size % frame_size))
+    return 0;
+  return 1;
+}
+
+int rcv_network(receiver_data_t* receiver_data, int max_packets)
+{
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  unsigned char control[CMSG_SPACE(sizeof(int)) + CONTROL_SIZE];
+  struct timespec realtime;
+  unsigned int len;
+  ssize_t n;
+  int packets = 0;
+  int64_t spin_deadline = 0;
+
+  while (packets == 0) {
+    if (rctx_network.gro_off >= rctx_network.gro_len) {
+      n = 0;
+      iov.iov_base = rctx_network.buf;
+      iov.iov_len = MAX_GRO_SIZE;
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_iov = &iov;
+      msg.msg_iovlen = 1;
+      msg.msg_name = &rctx_network.gro_from;
+
+      while (n < HEADER_SIZE) {
+        msg.msg_namelen = sizeof(rctx_network.gro_from);
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        n = recvmsg(rctx_network.sockfd, &msg, spin_flags(&spin_deadline));
+      }
+
+      rctx_network.gro_size = n;
+      for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+#ifdef UDP_GRO
+        if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+          memcpy(&rctx_network.gro_size, CMSG_DATA(cmsg), sizeof(int));
+        }
+#endif
+      }
+      if (parse_cmsg(&msg, &realtime, &rctx_network.gro_drops))
+        arrival_from_realtime(&rctx_network.gro_arrival, &realtime, realtime_offset_ns());
+      else
+        clock_gettime(CLOCK_MONOTONIC, &rctx_network.gro_arrival);
+      rctx_network.gro_off = 0;
+      rctx_network.gro_len = n;
+    }
+
+    // hand out the segments in place, leftovers go with the next call
+    while (rctx_network.gro_off < rctx_network.gro_len && packets < max_packets) {
+      len = rctx_network.gro_len - rctx_network.gro_off;
+      if (len > rctx_network.gro_size) len = rctx_network.gro_size;
+      if (parse_packet(&receiver_data[packets], &rctx_network.buf[rctx_network.gro_off], len)) {
+        // GRO only coalesces datagrams of one flow
+        receiver_data[packets].src_addr = rctx_network.gro_from.sin_addr.s_addr;
+        receiver_data[packets].src_port = rctx_network.gro_from.sin_port;
+        receiver_data[packets].arrival = rctx_network.gro_arrival;
+        packets++;
+      }
+      rctx_network.gro_off += len;
+    }
+  }
+  check_drops(&rctx_network.rcvbuf, rctx_network.gro_drops, &receiver_data[packets - 1], &rctx_network.stats);
+  stats_batch(&rctx_network.stats, packets);
+
+  return packets;
+}
+
+#if RECVMMSG_ENABLE
+// Drains up to max_packets datagrams with one syscall. The returned audio
+// points into the packet slots and stays valid until the next call.
+static int rcv_batch(network_batch_t *batch, receiver_data_t* receiver_data, int max_packets)
+{
+  int n, i, packets = 0;
+  struct sockaddr_in *name;
+  struct timespec realtime, now;
+  int64_t offset_ns;
+  uint32_t drops = batch->rcvbuf->drops_seen;
+  int timestamped;
+  int64_t spin_deadline = 0;
+
+  if (max_packets > MAX_BATCH) max_packets = MAX_BATCH;
+
+  while (packets == 0) {
+    for (i = 0; i < max_packets; i++) {
+      batch->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+      batch->msgs[i].msg_hdr.msg_controllen = sizeof(batch->controls[i]);
+      // replace the buffers handed on with the last call
+      if (!batch->bufs[i] && pool_ready()) {
+        batch->bufs[i] = pool_get();
+        batch->iovecs[i].iov_base = batch->bufs[i] ? batch->bufs[i]->data : batch->slots + (size_t)i * rctx_network.max_packet;
+      }
+    }
+
+    // block (or spin) for the first datagram, then take whatever else is queued
+    n = recvmmsg(batch->sockfd, batch->msgs, max_packets, MSG_WAITFORONE | spin_flags(&spin_deadline), NULL);
+    if (n <= 0) continue;
+
+    offset_ns = realtime_offset_ns();
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (i = 0; i < n; i++) {
+      timestamped = parse_cmsg(&batch->msgs[i].msg_hdr, &realtime, &drops);
+      name = &batch->names[i];
+      if (batch->msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+        network_oversized();
+        continue;
+      }
+      if (parse_packet(&receiver_data[packets], batch->iovecs[i].iov_base, batch->msgs[i].msg_len)) {
+        receiver_data[packets].buf = batch->bufs[i];
+        batch->bufs[i] = NULL;
+        receiver_data[packets].src_addr = name->sin_addr.s_addr;
+        receiver_data[packets].src_port = name->sin_port;
+        if (timestamped)
+          arrival_from_realtime(&receiver_data[packets].arrival, &realtime, offset_ns);
+        else
+          receiver_data[packets].arrival = now;
+        packets++;
+      }
+    }
+    if (packets)
+      check_drops(batch->rcvbuf, drops, &receiver_data[packets - 1], &batch->stats);
+    stats_batch(&batch->stats, n);
+  }
+
+  return packets;
+}
+
+int rcv_network_mmsg(receiver_data_t* receiver_data, int max_packets)
+{
+  return rcv_batch(&rctx_network.batch, receiver_data, max_packets);
+}
+
+// Receive function of worker thread <worker>
+int rcv_network_worker(unsigned int worker, receiver_data_t* receiver_data, int max_packets)
+{
+  return rcv_batch(&rctx_network.workers[worker], receiver_data, max_packets);
+}
+#endif
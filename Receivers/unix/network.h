@@ -6,23 +6,127 @@
 #include <string.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#ifdef __linux__
+#include <linux/filter.h>
+#include <linux/bpf.h>
+#endif
 
+#include "config.h"
 #include "scream.h"
+#include "stats.h"
 
 #define DEFAULT_MULTICAST_GROUP "239.255.77.77"
 #define DEFAULT_PORT 4010
 
+// Protocol v2 sets HEADER_V2_FLAG in the sample size byte, and extends the
+// header with a 32 bit sequence number and a 64 bit media timestamp (both
+// little endian). Senders only use it when configured to, so the plain
+// header is still accepted.
 #define HEADER_SIZE 5
-#define MAX_SO_PACKETSIZE 1152+HEADER_SIZE
+#define HEADER_V2_SIZE 17
+#define HEADER_V2_FLAG 0x80
+#define HEADER_FEC_FLAG 0x40
+// The Windows driver sends 1152 bytes of audio per packet by default. Any
+// other payload size must be a multiple of the frame size, up to what a
+// UDP datagram holds (on jumbo frames, or in IP fragments). Receive buffers
+// are sized for packets up to -M bytes, by default what fits a standard
+// 1500 byte Ethernet frame; larger ones are dropped.
+#define DEFAULT_PAYLOAD_SIZE 1152
+#define DEFAULT_MAX_PACKET_SIZE 1472
+#define MAX_SO_PACKETSIZE 65507
+#define MAX_GRO_SIZE 65535
+// the Windows driver's limit
+#define MAX_STREAM_CHANNELS 8
+
+// -b auto: the receive buffer starts out holding RCVBUF_AUTO_MIN_MS of the
+// stream, and grows on kernel drops up to RCVBUF_AUTO_MAX_MS. Audio
+// buffered longer than that is too late to be played anyway.
+#define RCVBUF_AUTO -1
+#define RCVBUF_AUTO_MIN_MS 100
+#define RCVBUF_AUTO_MAX_MS 1000
+
+// Receive buffer of one socket, and the drops the kernel reported on it
+// with SO_RXQ_OVFL
+typedef struct rcvbuf_state {
+  int sockfd;
+  uint32_t drops_seen;  // the kernel's drop counter at the last check
+  int size;             // SO_RCVBUF set, 0: the kernel's default
+  int capped;           // the kernel refused to grow it further
+  // The kernel counts the header filter's rejects as drops too. The eBPF
+  // filter counts them in a map of its own, -1 without it.
+  int rejects_fd;
+  uint64_t rejects_seen;  // its count, as far as taken off the drops
+} rcvbuf_state_t;
+
+// control messages of a received datagram
+#define CONTROL_SIZE (CMSG_SPACE(sizeof(struct timespec)) + CMSG_SPACE(sizeof(uint32_t)))
+
+#if RECVMMSG_ENABLE
+// Packet slots filled by one recvmmsg() call
+typedef struct network_batch {
+  int sockfd;
+  struct mmsghdr msgs[MAX_BATCH];
+  struct iovec iovecs[MAX_BATCH];
+  struct sockaddr_in names[MAX_BATCH];
+  // with the pool set up (-q), datagrams are received right into pool
+  // buffers and handed on; the slots are only used if it runs dry
+  struct packet_buf *bufs[MAX_BATCH];
+  unsigned char *slots;  // MAX_BATCH slots of the maximum packet size
+  unsigned char controls[MAX_BATCH][CONTROL_SIZE];
+  ingest_stats_t stats;
+  rcvbuf_state_t *rcvbuf;
+  rcvbuf_state_t own_rcvbuf;  // workers' sockets
+  char name[24];
+} network_batch_t;
+#endif
 
 typedef struct rctx_network {
   int sockfd;
   struct sockaddr_in servaddr;
   struct ip_mreq imreq;
-  unsigned char buf[MAX_SO_PACKETSIZE];
+  // with -S, multicast is joined for these senders only (SSM)
+  uint32_t sources[MAX_SOURCES];
+  unsigned int num_sources;
+  // a UDP GRO super-datagram holds several Scream packets of gro_size
+  // bytes each (the last one may be shorter)
+  unsigned char buf[MAX_GRO_SIZE];
+  unsigned int gro_size;
+  unsigned int gro_off;
+  unsigned int gro_len;
+  struct sockaddr_in gro_from;
+  struct timespec gro_arrival;
+  uint32_t gro_drops;
+  int rcvbuf_mode;  // -b: bytes, RCVBUF_AUTO, or 0 for the kernel's default
+  rcvbuf_state_t rcvbuf;
+  int busy_poll_us;  // -B: spin budget of a receive call, 0 to block right away
+  unsigned int max_packet;  // -M
+  uint64_t oversized;
+  ingest_stats_t stats;
+#if RECVMMSG_ENABLE
+  network_batch_t batch;
+  // with -w, one SO_REUSEPORT socket per worker thread
+  network_batch_t *workers;
+  unsigned int num_workers;
+#endif
 } rctx_network_t;
 
-int init_network(enum receiver_type receiver_mode, in_addr_t interface, int port, char* multicast_group);
-void rcv_network(receiver_data_t* receiver_data);
+// Kernel receive timestamps are CLOCK_REALTIME; receiver_data_t has them
+// on CLOCK_MONOTONIC, the clock the playout is scheduled by
+int64_t realtime_offset_ns();
+void arrival_from_realtime(struct timespec *arrival, const struct timespec *realtime, int64_t offset_ns);
+int parse_cmsg(struct msghdr *msg, struct timespec *realtime, uint32_t *drops);
+void network_drops(uint32_t drops, const receiver_data_t* receiver_data, ingest_stats_t *stats);
+void network_oversized();
+
+int init_network(enum receiver_type receiver_mode, enum ingest_type ingest_mode, in_addr_t interface, int port, char* multicast_group, unsigned int workers, int rcvbuf, int busy_poll_us, const uint32_t *sources, unsigned int num_sources);
+int get_network_socket();
+void set_max_packet_size(unsigned int size);
+unsigned int get_max_packet_size();
+int parse_packet(receiver_data_t* receiver_data, unsigned char* buf, ssize_t n);
+int rcv_network(receiver_data_t* receiver_data, int max_packets);
+#if RECVMMSG_ENABLE
+int rcv_network_mmsg(receiver_data_t* receiver_data, int max_packets);
+int rcv_network_worker(unsigned int worker, receiver_data_t* receiver_data, int max_packets);
+#endif
 
 #endif
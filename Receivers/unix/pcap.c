@@ -1,104 +1,266 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
 #include "pcap.h"
+#include "pool.h"
 
-static pcap_t *handle;
-static int (*pcap_output_callback)(receiver_data_t* receiver_data);
+static rctx_pcap_t rctx_pcap;
 
-int init_pcap(const char* interface_name, int port, char* multicast_group) {
+// Filters the Scream traffic of a live or offline <handle>
+static int setup_handle(pcap_t *handle, const char* name, int port, bpf_u_int32 net)
+{
   struct bpf_program fp;             /* The compiled filter expression */
+  char filter_exp[PCAP_ERRBUF_SIZE]; /* Large enough */
+
+  switch (pcap_datalink(handle)) {
+    case DLT_EN10MB:
+      rctx_pcap.link_offset = 0;
+      rctx_pcap.sll2 = 0;
+      break;
+    case DLT_LINUX_SLL:
+      // "any" device: the protocol ends the 16 byte cooked header, just
+      // like the ether type ends an Ethernet header 2 bytes shorter
+      rctx_pcap.link_offset = 2;
+      rctx_pcap.sll2 = 0;
+      break;
+    case DLT_LINUX_SLL2:
+      // "any" device of libpcap 1.10 and later: the protocol starts the
+      // 20 byte header instead
+      rctx_pcap.link_offset = 0;
+      rctx_pcap.sll2 = 1;
+      break;
+    default:
+      fprintf(stderr, "libpcap device %s doesn't provide Ethernet headers, not supported\n", name);
+      return 2;
+  }
+
+  snprintf(filter_exp, PCAP_ERRBUF_SIZE, "udp port %d", port);
+  if (pcap_compile(handle, &fp, filter_exp, 0, net) == -1) {
+    fprintf(stderr, "libpcap parse filter %s: %s\n", filter_exp, pcap_geterr(handle));
+    return 3;
+  }
+  if (pcap_setfilter(handle, &fp) == -1) {
+    fprintf(stderr, "libpcap install filter %s: %s\n", filter_exp, pcap_geterr(handle));
+    return 4;
+  }
+  pcap_freecode(&fp);
+
+  rctx_pcap.handle = handle;
+  rctx_pcap.port = port;
+#ifdef PCAP_TSTAMP_PRECISION_NANO
+  rctx_pcap.nano_ts = pcap_get_tstamp_precision(handle) == PCAP_TSTAMP_PRECISION_NANO;
+#endif
+  clock_gettime(CLOCK_MONOTONIC, &rctx_pcap.last_warning);
+  stats_init(&rctx_pcap.stats, "pcap");
+  return 0;
+}
+
+// <buffer_size> in bytes, 0 for libpcap's default. <timeout_ms> only
+// matters if the libpcap version lacks immediate mode.
+int init_pcap(const char* interface_name, int port, int buffer_size, int timeout_ms) {
   bpf_u_int32 mask;                  /* The netmask of our sniffing device */
   bpf_u_int32 net;                   /* The IP of our sniffing device */
-  char filter_exp[PCAP_ERRBUF_SIZE]; /* Large enough */
   char errbuf[PCAP_ERRBUF_SIZE];     /* Error buffer for calls into libpcap */
+  pcap_t *handle;
+  int ret;
 
-  handle = pcap_open_live(interface_name, PCAP_BUFSIZ, 1, 1000, errbuf);
+  handle = pcap_create(interface_name, errbuf);
   if (handle == NULL) {
-      // If you have the hard requirement of having to run the receiver as non-root due to pulse/alsa uid/gid issues:
-      //    setcap cap_net_raw,cap_net_admin=eip ./scream
     fprintf(stderr, "libpcap couldn't open device %s: %s\n", interface_name, errbuf);
     return 1;
   }
+  pcap_set_snaplen(handle, PCAP_BUFSIZ);
+  pcap_set_promisc(handle, 1);
+  pcap_set_timeout(handle, timeout_ms);
+  // Hand each packet on as it arrives. Otherwise libpcap waits for its
+  // TPACKET_V3 block to fill up or time out, and the audio comes in bursts.
+  if (pcap_set_immediate_mode(handle, 1) != 0) {
+    fprintf(stderr, "WARN: libpcap immediate mode not available, packets are delayed by up to %dms\n", timeout_ms);
+  }
+  if (buffer_size > 0 && pcap_set_buffer_size(handle, buffer_size) != 0) {
+    fprintf(stderr, "WARN: libpcap couldn't set the buffer size\n");
+  }
+#ifdef PCAP_TSTAMP_PRECISION_NANO
+  pcap_set_tstamp_precision(handle, PCAP_TSTAMP_PRECISION_NANO);
+#endif
+
+  ret = pcap_activate(handle);
+  if (ret < 0) {
+    // If you have the hard requirement of having to run the receiver as non-root due to pulse/alsa uid/gid issues:
+    //    setcap cap_net_raw,cap_net_admin=eip ./scream
+    fprintf(stderr, "libpcap couldn't open device %s: %s\n", interface_name, pcap_geterr(handle));
+    return 1;
+  }
+  if (ret > 0) {
+    fprintf(stderr, "WARN: libpcap: %s\n", pcap_geterr(handle));
+  }
 
-  snprintf(filter_exp, PCAP_ERRBUF_SIZE, "udp port %d", port);
   if (pcap_lookupnet(interface_name, &net, &mask, errbuf) == -1) {
     fprintf(stderr, "WARN: libpcap couldn't get netmask for device %s (often okay to ignore, especially for macvtap)\n", interface_name);
     net = 0;
     mask = 0;
   }
 
-  if (pcap_datalink(handle) != DLT_EN10MB) {
-    fprintf(stderr, "libpcap device %s doesn't provide Ethernet headers, not supported\n", interface_name);
-    return 2;
-  }
+  return setup_handle(handle, interface_name, port, net);
+}
 
-  if (pcap_compile(handle, &fp, filter_exp, 0, net) == -1) {
-    fprintf(stderr, "libpcap parse filter %s: %s\n", filter_exp, pcap_geterr(handle));
-    return 3;
-  }
-  if (pcap_setfilter(handle, &fp) == -1) {
-    fprintf(stderr, "libpcap install filter %s: %s\n", filter_exp, pcap_geterr(handle));
-    return 4;
+// Reads the packets of a capture file (e.g. from tcpdump) instead of an
+// interface, at their original pace or, with <fast>, as fast as the output
+// takes them
+int init_pcap_offline(const char* path, int port, int fast)
+{
+  char errbuf[PCAP_ERRBUF_SIZE];
+  pcap_t *handle;
+
+#ifdef PCAP_TSTAMP_PRECISION_NANO
+  handle = pcap_open_offline_with_tstamp_precision(path, PCAP_TSTAMP_PRECISION_NANO, errbuf);
+#else
+  handle = pcap_open_offline(path, errbuf);
+#endif
+  if (handle == NULL) {
+    fprintf(stderr, "libpcap couldn't open %s: %s\n", path, errbuf);
+    return 1;
   }
+
+  if (setup_handle(handle, path, port, 0) != 0) return 1;
+  rctx_pcap.offline = 1;
+  rctx_pcap.fast = fast;
+  clock_gettime(CLOCK_MONOTONIC, &rctx_pcap.opened);
+  return 0;
 }
 
-void pcap_callback(u_char *args, const struct pcap_pkthdr *header, const u_char *pkg)
+// The first invalid packet is reported at once, the ones after it at most
+// every STATS_INTERVAL seconds, so a stray sender can't flood the log
+static void warn_invalid()
 {
-  const struct sniff_ethernet *ethernet;  /* The ethernet header */
-  const struct sniff_ip *ip;              /* The IP header */
-  const struct sniff_udp *udp;            /* The UDP header */
-  u_char* payload;                        /* Packet payload */
+  struct timespec now;
 
-  int size_ip;
-  int size_udp;
-  int size_payload;
+  rctx_pcap.invalid++;
+  if (rctx_pcap.invalid_reported) {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (now.tv_sec - rctx_pcap.last_warning.tv_sec < STATS_INTERVAL) return;
+    fprintf(stderr, "WARN: received %llu more invalid Scream packets\n",
+      (unsigned long long)(rctx_pcap.invalid - rctx_pcap.invalid_reported));
+    rctx_pcap.last_warning = now;
+  }
+  else {
+    fprintf(stderr, "WARN: received an invalid Scream packet\n");
+  }
+  rctx_pcap.invalid_reported = rctx_pcap.invalid;
+}
 
-  /* define ethernet header */
-  ethernet = (struct sniff_ethernet*)(pkg);
+// In a replay at the original timing, waits until the packet is due. The
+// packet then counts as arriving at that time, so the output sees the
+// capture's jitter; a fast replay hands it on at once.
+static void replay_arrival(struct timespec *arrival, const struct timespec *captured)
+{
+  int64_t captured_ns = captured->tv_sec * 1000000000LL + captured->tv_nsec;
+  int64_t due_ns;
 
-  /* define/compute ip header offset */
-  ip = (struct sniff_ip*)(pkg + SIZE_ETHERNET);
-  size_ip = IP_HL(ip) * 4;
+  clock_gettime(CLOCK_MONOTONIC, arrival);
+  if (rctx_pcap.fast) return;
 
-  if (size_ip < 20) {
-    fprintf(stderr, "pcap captured a packet with invalid IP header length of %u\n", size_ip);
-    return;
+  if (!rctx_pcap.replay_started) {
+    rctx_pcap.replay_started = 1;
+    rctx_pcap.replay_first_ns = captured_ns;
+    rctx_pcap.replay_start_ns = arrival->tv_sec * 1000000000LL + arrival->tv_nsec;
   }
+  due_ns = rctx_pcap.replay_start_ns + (captured_ns - rctx_pcap.replay_first_ns);
+  if (due_ns <= arrival->tv_sec * 1000000000LL + arrival->tv_nsec) return;
 
-  /* define/compute udp header offset */
-  udp = (struct sniff_udp*)(pkg + SIZE_ETHERNET + size_ip);
-  size_udp = ntohs(udp->uh_ulen);
+  arrival->tv_sec = due_ns / 1000000000LL;
+  arrival->tv_nsec = due_ns % 1000000000LL;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, arrival, NULL) == EINTR);
+}
 
-  /* define/compute udp payload (daragram) offset */
-  payload = (u_char *)(pkg + SIZE_ETHERNET + size_ip + 8);
+static int parse_link(receiver_data_t *receiver_data, const u_char *pkg, unsigned int caplen)
+{
+  if (rctx_pcap.sll2) {
+    if (caplen < SIZE_SLL2 || (pkg[0] << 8 | pkg[1]) != ETHERTYPE_IPV4) return 0;
+    return parse_ip(receiver_data, (unsigned char *)pkg + SIZE_SLL2, caplen - SIZE_SLL2, rctx_pcap.port);
+  }
+  if (caplen < (unsigned int)rctx_pcap.link_offset) return 0;
+  return parse_frame(receiver_data, (unsigned char *)pkg + rctx_pcap.link_offset, caplen - rctx_pcap.link_offset, rctx_pcap.port);
+}
 
-  /* compute udp payload (datagram) size */
-  size_payload = ntohs(ip->ip_len) - (size_ip + 8);
+static void pcap_callback(u_char *args, const struct pcap_pkthdr *header, const u_char *pkg)
+{
+  receiver_data_t *receiver_data = &rctx_pcap.batch[rctx_pcap.packets];
+  packet_buf_t *buf = NULL;
+  unsigned char *copy;
+  struct timespec realtime;               /* Capture timestamp */
 
-  if (size_payload == 0 || size_udp == 0) {
-    fprintf(stderr, "pcap captured a udp packet with (size_payload=%d, size_udp=%d)\n", size_payload, size_ip);
+  if (!parse_link(receiver_data, pkg, header->caplen)) {
+    warn_invalid();
     return;
   }
 
-  receiver_data_t receiver_data = {0};
-  if (size_payload < HEADER_SIZE) {
-    fprintf(stderr, "WARN: received packet shorter than %d\n", HEADER_SIZE);
-    return;
-  }
+  realtime.tv_sec = header->ts.tv_sec;
+  realtime.tv_nsec = rctx_pcap.nano_ts ? header->ts.tv_usec : header->ts.tv_usec * 1000;
+  if (rctx_pcap.offline)
+    replay_arrival(&receiver_data->arrival, &realtime);
+  else
+    arrival_from_realtime(&receiver_data->arrival, &realtime, *(int64_t *)args);
 
-  receiver_data.format.sample_rate = payload[0];
-  receiver_data.format.sample_size = payload[1];
-  receiver_data.format.channels = payload[2];
-  receiver_data.format.channel_map = (payload[4] << 8u) | payload[3];
-  receiver_data.audio_size = size_payload - HEADER_SIZE;
-  receiver_data.audio = &payload[5];
+  if (pool_ready()) buf = pool_get();
+  copy = buf ? buf->data : rctx_pcap.slots[rctx_pcap.packets];
+  memcpy(copy, receiver_data->audio, receiver_data->audio_size);
+  receiver_data->audio = copy;
+  receiver_data->buf = buf;
+  rctx_pcap.packets++;
+}
 
-  int ret = pcap_output_callback(&receiver_data);
-  if (ret != 0) {
-    fprintf(stderr, "WARN: output function failed with %d\n", ret);
-  }
+// With a fast replay, the packet rate is the throughput of the whole
+// receiver, output included
+static void replay_report()
+{
+  struct timespec now;
+  double secs;
+
+  if (!verbosity) return;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  secs = (now.tv_sec - rctx_pcap.opened.tv_sec) + (now.tv_nsec - rctx_pcap.opened.tv_nsec) / 1e9;
+  fprintf(stderr, "End of capture file: %llu packets in %.3f s (%.0f pkts/s), %llu invalid\n",
+    (unsigned long long)rctx_pcap.replayed, secs, secs > 0 ? rctx_pcap.replayed / secs : 0.0,
+    (unsigned long long)rctx_pcap.invalid);
 }
 
-int run_pcap(int (*output_function)(receiver_data_t*))
+// Returns the Scream packets libpcap has captured so far, waiting for one
+// if there are none. Returns -1 at the end of a capture file.
+int rcv_pcap(receiver_data_t* receiver_data, int max_packets)
 {
-  pcap_output_callback = output_function;
-  return pcap_loop(handle, -1, pcap_callback, NULL);
-}
\ No newline at end of file
+  struct pcap_stat ps;
+  int64_t offset_ns;
+  int n;
+
+  if (max_packets > MAX_BATCH) max_packets = MAX_BATCH;
+  // one at a time, so a packet isn't held back while waiting for the next
+  if (rctx_pcap.offline && !rctx_pcap.fast) max_packets = 1;
+
+  rctx_pcap.batch = receiver_data;
+  rctx_pcap.packets = 0;
+  while (rctx_pcap.packets == 0) {
+    offset_ns = realtime_offset_ns();
+    n = pcap_dispatch(rctx_pcap.handle, max_packets, pcap_callback, (u_char *)&offset_ns);
+    if (n == PCAP_ERROR) {
+      fprintf(stderr, "libpcap: %s\n", pcap_geterr(rctx_pcap.handle));
+      exit(1);
+    }
+    if (n == 0 && rctx_pcap.offline) {
+      replay_report();
+      return -1;
+    }
+  }
+  rctx_pcap.replayed += rctx_pcap.packets;
+
+  if (stats_batch(&rctx_pcap.stats, rctx_pcap.packets) && !rctx_pcap.offline) {
+    memset(&ps, 0, sizeof(ps));
+    pcap_stats(rctx_pcap.handle, &ps);
+    fprintf(stderr, "pcap: %u packets, %u drops, %llu invalid\n",
+      ps.ps_recv, ps.ps_drop, (unsigned long long)rctx_pcap.invalid);
+  }
+
+  return rctx_pcap.packets;
+}
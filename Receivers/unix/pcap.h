@@ -3,49 +3,48 @@
 
 #include "network.h"
 #include "scream.h"
+#include "sniff.h"
+#include "stats.h"
 #include <pcap.h>
 #include <ctype.h>
 
-#define PCAP_BUFSIZ PCAP_BUF_SIZE * 8
-#define SIZE_ETHERNET 14
-
-/* Ethernet addresses are 6 bytes */
-#define ETHER_ADDR_LEN	6
-
-
-struct sniff_ethernet {
-    u_char ether_dhost[ETHER_ADDR_LEN]; /* Destination host address */
-    u_char ether_shost[ETHER_ADDR_LEN]; /* Source host address */
-    u_short ether_type;                 /* IP? ARP? RARP? etc */
-};
-
-struct sniff_ip {
-    u_char ip_vhl;      /* version << 4 | header length >> 2 */
-    u_char ip_tos;      /* type of service */
-    u_short ip_len;     /* total length */
-    u_short ip_id;      /* identification */
-    u_short ip_off;     /* fragment offset field */
-#define IP_RF 0x8000        /* reserved fragment flag */
-#define IP_DF 0x4000        /* dont fragment flag */
-#define IP_MF 0x2000        /* more fragments flag */
-#define IP_OFFMASK 0x1fff   /* mask for fragmenting bits */
-    u_char ip_ttl;      /* time to live */
-    u_char ip_p;        /* protocol */
-    u_short ip_sum;     /* checksum */
-    struct in_addr ip_src,ip_dst; /* source and dest address */
-};
-#define IP_HL(ip)       (((ip)->ip_vhl) & 0x0f)
-#define IP_V(ip)        (((ip)->ip_vhl) >> 4)
-
-struct sniff_udp {
-    u_short uh_sport;               /* source port */
-    u_short uh_dport;               /* destination port */
-    u_short uh_ulen;                /* udp length */
-    u_short uh_sum;                 /* udp checksum */
-};
-
-int init_pcap(const char* interface_name, int port, char* multicast_group);
-
-int run_pcap(int (*output_function)(receiver_data_t*));
-
-#endif
\ No newline at end of file
+#define PCAP_BUFSIZ 65535  // snapshot length, whole jumbo frames
+
+// "any" device captures of tcpdump 4.99 and later: the protocol comes
+// first in the 20 byte cooked header (libpcap before 1.10 lacks the name)
+#ifndef DLT_LINUX_SLL2
+#define DLT_LINUX_SLL2 276
+#endif
+#define SIZE_SLL2 20
+
+typedef struct rctx_pcap {
+  pcap_t *handle;
+  int port;
+  int nano_ts;      // capture timestamps in ns instead of us
+  int link_offset;  // where an Ethernet header would put the ether type - 12
+  int sll2;         // DLT_LINUX_SLL2 headers instead
+  // replay of a capture file
+  int offline;
+  int fast;         // as fast as possible instead of at the original timing
+  int replay_started;
+  int64_t replay_first_ns;  // capture time of the first packet
+  int64_t replay_start_ns;  // CLOCK_MONOTONIC when it was replayed
+  uint64_t replayed;
+  struct timespec opened;
+  // the batch pcap_dispatch() fills in
+  receiver_data_t *batch;
+  int packets;
+  // libpcap's packet data is only valid during the callback, the audio is
+  // copied into a pool buffer, or here if there is no pool
+  unsigned char slots[MAX_BATCH][MAX_SO_PACKETSIZE];
+  uint64_t invalid;
+  uint64_t invalid_reported;
+  struct timespec last_warning;
+  ingest_stats_t stats;
+} rctx_pcap_t;
+
+int init_pcap(const char* interface_name, int port, int buffer_size, int timeout_ms);
+int init_pcap_offline(const char* path, int port, int fast);
+int rcv_pcap(receiver_data_t* receiver_data, int max_packets);
+
+#endif
@@ -0,0 +1,115 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pool.h"
+#include "stats.h"
+
+static rctx_pool_t rctx_pool;
+
+static packet_buf_t *pool_buf(uint32_t index)
+{
+  return (packet_buf_t *)(rctx_pool.mem + (size_t)index * rctx_pool.stride);
+}
+
+// Allocates <count> buffers of <size> bytes, all free
+int pool_init(unsigned int count, unsigned int size)
+{
+  unsigned int page = sysconf(_SC_PAGESIZE), i;
+  unsigned int align;
+
+  memset(&rctx_pool, 0, sizeof(rctx_pool));
+  rctx_pool.size = size;
+  rctx_pool.stride = sizeof(packet_buf_t) + size;
+  align = rctx_pool.stride < page ? CACHE_LINE : page;
+  rctx_pool.stride = (rctx_pool.stride + align - 1) / align * align;
+  if (posix_memalign((void **)&rctx_pool.mem, page, (size_t)count * rctx_pool.stride) != 0) {
+    perror("Failed to allocate packet buffers");
+    return 1;
+  }
+  for (i = 0; i < count; i++) {
+    pool_buf(i)->refs = 0;
+    pool_buf(i)->next = (i + 1 < count) ? i + 2 : 0;
+  }
+  rctx_pool.count = count;
+  rctx_pool.free_head = count ? 1 : 0;
+  clock_gettime(CLOCK_MONOTONIC, &rctx_pool.last_report);
+
+  if (verbosity) fprintf(stderr, "Pool of %u packet buffers of %u bytes\n", count, size);
+  return 0;
+}
+
+int pool_ready()
+{
+  return rctx_pool.count != 0;
+}
+
+unsigned int pool_buf_size()
+{
+  return rctx_pool.size;
+}
+
+// Returns a buffer holding one reference, NULL when all are in use
+packet_buf_t* pool_get()
+{
+  uint64_t head = __atomic_load_n(&rctx_pool.free_head, __ATOMIC_ACQUIRE);
+  uint64_t next;
+  packet_buf_t *buf;
+  uint32_t in_use;
+
+  do {
+    if (!(uint32_t)head) {
+      __atomic_fetch_add(&rctx_pool.exhausted, 1, __ATOMIC_RELAXED);
+      return NULL;
+    }
+    // may be stale if another thread takes the buffer first, the
+    // generation count makes the swap fail then
+    buf = pool_buf((uint32_t)head - 1);
+    next = ((head >> 32) + 1) << 32 | __atomic_load_n(&buf->next, __ATOMIC_RELAXED);
+  } while (!__atomic_compare_exchange_n(&rctx_pool.free_head, &head, next, 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+  buf->refs = 1;
+  in_use = __atomic_add_fetch(&rctx_pool.in_use, 1, __ATOMIC_RELAXED);
+  if (in_use > __atomic_load_n(&rctx_pool.high_water, __ATOMIC_RELAXED))
+    __atomic_store_n(&rctx_pool.high_water, in_use, __ATOMIC_RELAXED);
+  return buf;
+}
+
+// Another holder, e.g. a packet held back by FEC while still queued
+void pool_ref(packet_buf_t* buf)
+{
+  __atomic_add_fetch(&buf->refs, 1, __ATOMIC_RELAXED);
+}
+
+// Drops a reference, the last one returns the buffer to the pool
+void pool_put(packet_buf_t* buf)
+{
+  uint32_t index = ((unsigned char *)buf - rctx_pool.mem) / rctx_pool.stride;
+  uint64_t head, next;
+
+  if (__atomic_sub_fetch(&buf->refs, 1, __ATOMIC_ACQ_REL) != 0) return;
+
+  __atomic_sub_fetch(&rctx_pool.in_use, 1, __ATOMIC_RELAXED);
+  head = __atomic_load_n(&rctx_pool.free_head, __ATOMIC_RELAXED);
+  do {
+    __atomic_store_n(&buf->next, (uint32_t)head, __ATOMIC_RELAXED);
+    next = ((head >> 32) + 1) << 32 | (index + 1);
+  } while (!__atomic_compare_exchange_n(&rctx_pool.free_head, &head, next, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// Called by the output thread
+void pool_report()
+{
+  struct timespec now;
+
+  if (verbosity < 2 || !rctx_pool.count) return;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (now.tv_sec - rctx_pool.last_report.tv_sec < STATS_INTERVAL) return;
+
+  fprintf(stderr, "pool: %u buffers, %u max. in use, %llu times exhausted\n",
+    rctx_pool.count, __atomic_exchange_n(&rctx_pool.high_water, 0, __ATOMIC_RELAXED),
+    (unsigned long long)__atomic_load_n(&rctx_pool.exhausted, __ATOMIC_RELAXED));
+  rctx_pool.last_report = now;
+}
@@ -0,0 +1,46 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdint.h>
+
+#include "scream.h"
+#include "network.h"
+
+// A packet buffer. Whoever holds a receiver_data_t with buf set owns one
+// reference, and passes it on or drops it with pool_put(). The datagram
+// starts on a cache line of its own.
+typedef struct packet_buf {
+  uint32_t refs;
+  uint32_t next;   // free list link, index + 1
+  unsigned char data[] __attribute__((aligned(CACHE_LINE)));
+} packet_buf_t;
+
+// All buffers are allocated up front. The free list is a lock-free stack:
+// buffers are taken by the receive threads and put back by whichever
+// thread drops the last reference. Its head packs a generation count
+// (upper 32 bits) next to the index + 1 of the top buffer, so that a
+// buffer taken and put back meanwhile fails the compare and swap.
+// Buffers fit any Scream packet received from the network (-M). Larger
+// audio (IVSHMEM chunks) is not pooled. They are spaced by whole cache
+// lines, by whole pages once they are a page or larger.
+typedef struct rctx_pool {
+  unsigned char *mem;
+  unsigned int count;
+  unsigned int size;
+  unsigned int stride;
+  uint64_t free_head __attribute__((aligned(CACHE_LINE)));
+  uint32_t in_use;
+  uint32_t high_water;
+  uint64_t exhausted;
+  struct timespec last_report;
+} rctx_pool_t;
+
+int pool_init(unsigned int count, unsigned int size);
+int pool_ready();
+unsigned int pool_buf_size();
+packet_buf_t* pool_get();
+void pool_ref(packet_buf_t* buf);
+void pool_put(packet_buf_t* buf);
+void pool_report();
+
+#endif
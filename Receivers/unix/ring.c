@@ -0,0 +1,231 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "ring.h"
+#include "fec.h"
+#include "pool.h"
+#include "stats.h"
+
+static rctx_ring_t rctx_ring;
+static int (*ring_rcv_fn)(receiver_data_t* receiver_data, int max_packets);
+static int (*ring_worker_fn)(unsigned int worker, receiver_data_t* receiver_data, int max_packets);
+
+// Queues a received packet in the next free slot. A packet in a pool
+// buffer is passed on as is. The other receivers' buffers are reused on
+// their next call, so their audio is copied into a pool buffer. When the
+// output has fallen behind by the whole ring (or the pool has run dry),
+// the packet is dropped: the socket must keep being drained either way.
+static void ring_push(packet_ring_t *ring, receiver_data_t* receiver_data)
+{
+  packet_slot_t *slot;
+  packet_buf_t *buf;
+  uint32_t head = ring->head;
+
+  if (head - ring->tail_cache > ring->mask) {
+    ring->tail_cache = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (head - ring->tail_cache > ring->mask) {
+      if (receiver_data->buf) pool_put(receiver_data->buf);
+      __atomic_store_n(&ring->overflows, ring->overflows + 1, __ATOMIC_RELAXED);
+      return;
+    }
+  }
+
+  slot = &ring->slots[head & ring->mask];
+  slot->data = *receiver_data;
+  if (!receiver_data->buf && receiver_data->audio_size <= pool_buf_size()) {
+    buf = pool_get();
+    if (!buf) {
+      __atomic_store_n(&ring->overflows, ring->overflows + 1, __ATOMIC_RELAXED);
+      return;
+    }
+    memcpy(buf->data, receiver_data->audio, receiver_data->audio_size);
+    slot->data.buf = buf;
+    slot->data.audio = buf->data;
+  }
+  else if (!receiver_data->buf) {
+    if (receiver_data->audio_size > slot->capacity) {
+      free(slot->buf);
+      slot->buf = malloc(receiver_data->audio_size);
+      if (!slot->buf) {
+        perror("Failed to grow ring slot");
+        exit(1);
+      }
+      slot->capacity = receiver_data->audio_size;
+    }
+    memcpy(slot->buf, receiver_data->audio, receiver_data->audio_size);
+    slot->data.audio = slot->buf;
+  }
+
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+  sem_post(&rctx_ring.items);
+}
+
+static void *receive_thread(void *arg)
+{
+  unsigned int worker = (uintptr_t)arg;
+  packet_ring_t *ring = &rctx_ring.rings[worker];
+  receiver_data_t receiver_data[MAX_BATCH];
+  int i, n;
+
+  for (;;) {
+    if (ring_worker_fn)
+      n = ring_worker_fn(worker, receiver_data, MAX_BATCH);
+    else
+      n = ring_rcv_fn(receiver_data, MAX_BATCH);
+    if (n < 0) {
+      // the receiver ran out of packets (a replayed capture ended)
+      __atomic_store_n(&rctx_ring.done, 1, __ATOMIC_RELEASE);
+      sem_post(&rctx_ring.items);
+      return NULL;
+    }
+    for (i = 0; i < n; i++)
+      ring_push(ring, &receiver_data[i]);
+  }
+  return NULL;
+}
+
+static int start_threads(unsigned int count, unsigned int depth)
+{
+  pthread_t thread;
+  unsigned int slots = 1, i;
+  int err;
+
+  // round up to a power of 2, so indexes wrap with a mask
+  while (slots < depth) slots <<= 1;
+
+  memset(&rctx_ring, 0, sizeof(rctx_ring));
+  rctx_ring.count = count;
+  if (posix_memalign((void **)&rctx_ring.rings, CACHE_LINE, count * sizeof(packet_ring_t)) != 0) {
+    perror("Failed to allocate packet ring");
+    return 1;
+  }
+  memset(rctx_ring.rings, 0, count * sizeof(packet_ring_t));
+  for (i = 0; i < count; i++) {
+    rctx_ring.rings[i].mask = slots - 1;
+    rctx_ring.rings[i].slots = calloc(slots, sizeof(packet_slot_t));
+    if (!rctx_ring.rings[i].slots) {
+      perror("Failed to allocate packet ring");
+      return 1;
+    }
+  }
+  // Enough buffers for a full ring (two while another sender's ring
+  // drains), the ones each receive thread has posted or is handing on,
+  // and the ones FEC holds back
+  if (pool_init((count > 1 ? 2 : 1) * slots + count * 2 * MAX_BATCH + FEC_MAX_GROUP, get_max_packet_size()) != 0) {
+    return 1;
+  }
+  if (sem_init(&rctx_ring.items, 0, 0) != 0) {
+    perror("Failed to create ring semaphore");
+    return 1;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &rctx_ring.last_report);
+
+  for (i = 0; i < count; i++) {
+    err = pthread_create(&thread, NULL, receive_thread, (void *)(uintptr_t)i);
+    if (err != 0) {
+      fprintf(stderr, "Failed to start receive thread: %s\n", strerror(err));
+      return 1;
+    }
+    pthread_detach(thread);
+  }
+  return 0;
+}
+
+int start_receive_thread(int (*receiver_rcv_fn)(receiver_data_t* receiver_data, int max_packets), unsigned int depth)
+{
+  ring_rcv_fn = receiver_rcv_fn;
+  if (start_threads(1, depth) != 0) return 1;
+
+  if (verbosity) fprintf(stderr, "Receiving on a separate thread, ring of %u packets\n", rctx_ring.rings[0].mask + 1);
+  return 0;
+}
+
+// Starts <workers> receive threads, each with a ring of its own. Worker n
+// receives by calling worker_rcv_fn(n, ...).
+int start_receive_workers(unsigned int workers, int (*worker_rcv_fn)(unsigned int worker, receiver_data_t* receiver_data, int max_packets), unsigned int depth)
+{
+  ring_worker_fn = worker_rcv_fn;
+  if (start_threads(workers, depth) != 0) return 1;
+
+  if (verbosity) fprintf(stderr, "Receiving on %u threads, rings of %u packets\n", workers, rctx_ring.rings[0].mask + 1);
+  return 0;
+}
+
+static void ring_report(packet_ring_t *ring, uint32_t fill)
+{
+  struct timespec now;
+  uint64_t overflows = 0;
+  uint32_t high_water = 0;
+  unsigned int i;
+
+  if (fill > ring->high_water) ring->high_water = fill;
+  if (verbosity < 2) return;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (now.tv_sec - rctx_ring.last_report.tv_sec < STATS_INTERVAL) return;
+
+  for (i = 0; i < rctx_ring.count; i++) {
+    overflows += __atomic_load_n(&rctx_ring.rings[i].overflows, __ATOMIC_RELAXED);
+    if (rctx_ring.rings[i].high_water > high_water) high_water = rctx_ring.rings[i].high_water;
+    rctx_ring.rings[i].high_water = 0;
+  }
+  if (rctx_ring.count > 1)
+    fprintf(stderr, "ring: %u x %u slots, %u max. filled, %llu overflows, %llu underflows\n",
+      rctx_ring.count, ring->mask + 1, high_water,
+      (unsigned long long)overflows, (unsigned long long)rctx_ring.underflows);
+  else
+    fprintf(stderr, "ring: %u slots, %u max. filled, %llu overflows, %llu underflows\n",
+      ring->mask + 1, high_water,
+      (unsigned long long)overflows, (unsigned long long)rctx_ring.underflows);
+  rctx_ring.last_report = now;
+}
+
+// Returns the oldest packet in the ring, waiting for one if it is empty
+// (counted as an underflow), or NULL once the receiver has ended and the
+// rings are drained.
+// With several rings, packets are taken from one ring for as long as it
+// has any; a sender is only ever received by one of them. The slot stays
+// valid until ring_consume().
+receiver_data_t* ring_peek()
+{
+  packet_ring_t *ring = &rctx_ring.rings[rctx_ring.cur];
+  packet_slot_t *slot;
+  uint32_t head;
+  unsigned int empty = 0;
+
+  if (sem_trywait(&rctx_ring.items) != 0) {
+    rctx_ring.underflows++;
+    while (sem_wait(&rctx_ring.items) != 0 && errno == EINTR);
+  }
+
+  // the semaphore was posted after a head was published, so some ring
+  // has a packet, unless it was the receiver's last post
+  for (;;) {
+    head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if (head != ring->tail) break;
+    if (++empty == rctx_ring.count && __atomic_load_n(&rctx_ring.done, __ATOMIC_ACQUIRE))
+      return NULL;
+    if (++rctx_ring.cur == rctx_ring.count) rctx_ring.cur = 0;
+    ring = &rctx_ring.rings[rctx_ring.cur];
+  }
+
+  ring_report(ring, head - ring->tail);
+  pool_report();
+  slot = &ring->slots[ring->tail & ring->mask];
+  return &slot->data;
+}
+
+// Hands the slot returned by ring_peek() back to the receive thread, and
+// drops its reference to the audio.
+void ring_consume()
+{
+  packet_ring_t *ring = &rctx_ring.rings[rctx_ring.cur];
+  packet_slot_t *slot = &ring->slots[ring->tail & ring->mask];
+
+  if (slot->data.buf) pool_put(slot->data.buf);
+
+  __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,53 @@
+#ifndef RING_H
+#define RING_H
+
+#include <stdint.h>
+#include <semaphore.h>
+#include <time.h>
+
+#include "scream.h"
+
+#define DEFAULT_RING_DEPTH 1024
+
+// The slot's data holds a reference to a pool buffer. Only audio too large
+// for those (IVSHMEM chunks) is copied into a buffer of the slot's own.
+typedef struct packet_slot {
+  receiver_data_t data;
+  unsigned char *buf;
+  unsigned int capacity;
+} packet_slot_t;
+
+// Single producer (receive thread), single consumer (output thread).
+// head and tail live on their own cache lines. The producer keeps a cached
+// copy of tail, so it only reads the consumer's line when the ring looks
+// full.
+typedef struct packet_ring {
+  uint32_t head __attribute__((aligned(CACHE_LINE)));  // next slot to fill
+  uint32_t tail_cache;
+  uint64_t overflows;
+
+  uint32_t tail __attribute__((aligned(CACHE_LINE)));  // next slot to play
+  uint32_t high_water;
+
+  uint32_t mask __attribute__((aligned(CACHE_LINE)));
+  packet_slot_t *slots;
+} packet_ring_t;
+
+// One ring per receive thread. items counts the filled slots of all of
+// them, so the output thread can sleep when they all run empty.
+typedef struct rctx_ring {
+  packet_ring_t *rings;
+  unsigned int count;
+  unsigned int cur;  // ring the output thread takes packets from
+  sem_t items;
+  int done;  // the receive thread has ended
+  uint64_t underflows;
+  struct timespec last_report;
+} rctx_ring_t;
+
+int start_receive_thread(int (*receiver_rcv_fn)(receiver_data_t* receiver_data, int max_packets), unsigned int depth);
+int start_receive_workers(unsigned int workers, int (*worker_rcv_fn)(unsigned int worker, receiver_data_t* receiver_data, int max_packets), unsigned int depth);
+receiver_data_t* ring_peek();
+void ring_consume();
+
+#endif
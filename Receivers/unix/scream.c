@@ -16,10 +16,29 @@
 #include "scream.h"
 #include "network.h"
 #include "shmem.h"
+#include "ring.h"
+#include "pool.h"
+#include "jitter.h"
+#include "sequence.h"
+#include "conceal.h"
+#include "fec.h"
+#include "source.h"
 
 #include "raw.h"
 #include <errno.h>
 
+#if URING_ENABLE
+#include "uring.h"
+#endif
+
+#if XDP_ENABLE
+#include "xdp.h"
+#endif
+
+#if TPACKET_ENABLE
+#include "tpacket.h"
+#endif
+
 #if PULSEAUDIO_ENABLE
 #include "pulseaudio.h"
 #endif
@@ -42,6 +61,13 @@
 
 int verbosity = 0;
 
+static int (*output_send_fn)(receiver_data_t* receiver_data);
+static int jitter_enabled = 0;
+static int workers = 0;
+static uint32_t playing_addr;
+static uint16_t playing_port;
+static delay_stats_t output_delay;
+
 static void show_usage(const char *arg0)
 {
   fprintf(stderr, "\n");
@@ -58,10 +84,56 @@ static void show_usage(const char *arg0)
   fprintf(stderr, "                                        multicast mode, uses this interface for IGMP.\n");
   fprintf(stderr, "                                        In unicast, binds to this interface only.\n");
   fprintf(stderr, "         -g <group>                   : Multicast group address. Multicast mode only.\n");
-  fprintf(stderr, "         -m <ivshmem device path>     : Use shared memory device.\n");
-  fprintf(stderr, "         -P                           : Use libpcap to sniff the packets.\n");
+  fprintf(stderr, "         -m <ivshmem device path>     : Use shared memory device. For ivshmem-doorbell,\n");
+  fprintf(stderr, "                                        the path of the ivshmem-server socket.\n");
+  fprintf(stderr, "         -P                           : Sniff the packets. Uses a TPACKET_V3 ring where\n");
+  fprintf(stderr, "                                        available, libpcap otherwise.\n");
+  fprintf(stderr, "         -I recvfrom|mmsg|uring       : Socket receive engine. 'mmsg' drains the socket\n");
+  fprintf(stderr, "                                        in batches with recvmmsg(), 'uring' uses io_uring\n");
+  fprintf(stderr, "                                        multishot receive. Defaults to recvfrom.\n");
+  fprintf(stderr, "         -I xdp|xdp-generic           : Steal the Scream packets from interface -i <iface>\n");
+  fprintf(stderr, "                                        with an XDP program into an AF_XDP socket.\n");
+  fprintf(stderr, "                                        'xdp-generic' forces generic (skb) XDP mode.\n");
+  fprintf(stderr, "         -I tpacket|pcap              : Sniffer engine with -P.\n");
+  fprintf(stderr, "         -T <timeout>                 : TPACKET_V3 block retire timeout in milliseconds.\n");
+  fprintf(stderr, "                                        Defaults to 2ms.\n");
+  fprintf(stderr, "         -F <group id>                : Join TPACKET_V3 fanout group <group id>, to share\n");
+  fprintf(stderr, "                                        one interface between several instances.\n");
+  fprintf(stderr, "         -r <file>                    : Replay the Scream packets of a pcap capture file\n");
+  fprintf(stderr, "                                        (e.g. from tcpdump) at their original timing.\n");
+  fprintf(stderr, "         -R                           : With -r, replay as fast as the output takes them.\n");
+  fprintf(stderr, "         -q <packets>                 : Receive on a separate thread, queueing up to\n");
+  fprintf(stderr, "                                        <packets> packets for the output.\n");
+  fprintf(stderr, "         -j <margin>                  : Play out through an adaptive jitter buffer, sized\n");
+  fprintf(stderr, "                                        to the measured jitter plus <margin> milliseconds.\n");
+  fprintf(stderr, "                                        Implies -q %d.\n", DEFAULT_RING_DEPTH);
+  fprintf(stderr, "         -b <size>|auto               : Socket receive buffer size in KiB. 'auto' sizes it\n");
+  fprintf(stderr, "                                        to the stream, and grows it when the kernel drops\n");
+  fprintf(stderr, "                                        packets. With -I pcap, the libpcap buffer size.\n");
+  fprintf(stderr, "         -B <usecs>                   : Busy poll: spin on the socket for up to <usecs>\n");
+  fprintf(stderr, "                                        microseconds before blocking for a packet. Lowers\n");
+  fprintf(stderr, "                                        the wakeup latency at the cost of CPU time.\n");
+  fprintf(stderr, "                                        With -m and no doorbell, the receiver sleeps until\n");
+  fprintf(stderr, "                                        <usecs> before the next chunk is due and spins\n");
+  fprintf(stderr, "                                        until <usecs> after. Defaults to %dus there.\n", SHMEM_SPIN_US);
+  fprintf(stderr, "         -M <bytes>                   : Largest packet to receive, header included. Larger\n");
+  fprintf(stderr, "                                        ones are dropped. Defaults to %d, what fits a\n", DEFAULT_MAX_PACKET_SIZE);
+  fprintf(stderr, "                                        1500 byte MTU; raise it for larger PayloadSize.\n");
+  fprintf(stderr, "         -w <workers>                 : Receive on <workers> threads, each with its own\n");
+  fprintf(stderr, "                                        SO_REUSEPORT socket. Senders are spread over them.\n");
+  fprintf(stderr, "                                        Unicast mode only.\n");
+  fprintf(stderr, "                                        Implies -q %d.\n", DEFAULT_RING_DEPTH);
+  fprintf(stderr, "         -S <address>[:<port>][,...]  : Only play the streams of these senders (up to %d),\n", MAX_SOURCES);
+  fprintf(stderr, "                                        and join the multicast group for them only.\n");
+  fprintf(stderr, "                                        By default, the first sender heard is played.\n");
+  fprintf(stderr, "         -f <timeout>                 : Let another sender take over after the one playing\n");
+  fprintf(stderr, "                                        was silent for <timeout> milliseconds. Defaults\n");
+  fprintf(stderr, "                                        to %dms.\n", DEFAULT_FAILOVER_MS);
   fprintf(stderr, "\n");
   fprintf(stderr, "         -o pulse|alsa|jack|sndio|raw : Send audio to PulseAudio, ALSA, Jack or stdout.\n");
+  fprintf(stderr, "         -o alsa-mmap                 : ALSA, converting the audio straight into the\n");
+  fprintf(stderr, "                                        device buffer through mmap. Not yet tried on\n");
+  fprintf(stderr, "                                        sound hardware.\n");
   fprintf(stderr, "         -d <device>                  : ALSA device name. 'default' if not specified.\n");
   fprintf(stderr, "         -d <device>                  : sndio device name. 'AUDIODEVICE' if not specified.\n");
   fprintf(stderr, "         -s <sink name>               : Pulseaudio sink name.\n");
@@ -73,7 +145,8 @@ static void show_usage(const char *arg0)
   fprintf(stderr, "                                        Only relevant for PulseAudio output.\n");
   fprintf(stderr, "         -c                           : Do not connect jack ports.\n");
   fprintf(stderr, "\n");
-  fprintf(stderr, "         -v                           : Be verbose.\n");
+  fprintf(stderr, "         -v                           : Be verbose. Twice to print receive stats\n");
+  fprintf(stderr, "                                        every %d seconds.\n", STATS_INTERVAL);
   fprintf(stderr, "\n");
   exit(1);
 }
@@ -119,18 +192,70 @@ error_exit:
   exit(1);
 }
 
+// Takes a packet through the playout stages to the output
+static int play(receiver_data_t* receiver_data)
+{
+  unsigned int gap = 0;
+
+  if (!sequence_check(receiver_data)) return 0;
+  if (jitter_enabled) gap = jitter_wait(receiver_data);
+  else if (!(receiver_data->flags & RECEIVER_HAS_SEQ) && receiver_data->src_port)
+    gap = conceal_arrival_gap(receiver_data);
+  stats_delay(&output_delay, &receiver_data->arrival);
+  // Shared memory has no sender to lose audio on the way, so without the
+  // jitter buffer its chunks go to the output uncopied
+  if (!jitter_enabled && !(receiver_data->flags & RECEIVER_HAS_SEQ) && !receiver_data->src_port)
+    return output_send_fn(receiver_data);
+  return conceal_send(receiver_data, gap, output_send_fn);
+}
+
+// Picks the packets of the sender to play (the workers of -w have done
+// that already), and hands them on to FEC
+static int receive(receiver_data_t* receiver_data)
+{
+  if (!workers && !source_check(receiver_data, 0)) return 0;
+
+  if (receiver_data->src_addr != playing_addr || receiver_data->src_port != playing_port) {
+    // another sender took over, its sequence numbers and media time
+    // have nothing to do with the previous one's
+    playing_addr = receiver_data->src_addr;
+    playing_port = receiver_data->src_port;
+    sequence_restart();
+    fec_restart();
+    if (jitter_enabled) jitter_restart();
+  }
+  return fec_receive(receiver_data, play);
+}
+
+#if RECVMMSG_ENABLE
+// Receive function of the -w worker threads: only the packets of the
+// sender playing go to the output thread
+static int rcv_worker(unsigned int worker, receiver_data_t* receiver_data, int max_packets)
+{
+  int i, n, packets = 0;
+
+  n = rcv_network_worker(worker, receiver_data, max_packets);
+  for (i = 0; i < n; i++) {
+    if (source_check(&receiver_data[i], worker))
+      receiver_data[packets++] = receiver_data[i];
+    else if (receiver_data[i].buf)
+      pool_put(receiver_data[i].buf);
+  }
+  return packets;
+}
+#endif
+
 
 int main(int argc, char*argv[]) {
-  int error, res;
+  int error, i, n;
 
   // function pointer definition for receiver
-  void (*receiver_rcv_fn)(receiver_data_t* receiver_data);
-  receiver_data_t receiver_data;
-
-  int (*output_send_fn)(receiver_data_t* receiver_data);
+  int (*receiver_rcv_fn)(receiver_data_t* receiver_data, int max_packets);
+  receiver_data_t receiver_data[MAX_BATCH];
 
   // Command line options
   enum receiver_type receiver_mode = Multicast;
+  enum ingest_type ingest_mode = Recvfrom;
 
 #if PULSEAUDIO_ENABLE
   enum output_type output_mode = Pulseaudio;
@@ -158,9 +283,24 @@ int main(int argc, char*argv[]) {
   in_addr_t interface        = INADDR_ANY;
   uint16_t port              = DEFAULT_PORT;
   int jack_connect           = 1;
+  int block_timeout_ms       = 2;
+  int fanout_group           = -1;
+  int xdp_generic            = 0;
+  int ring_depth             = 0;
+  int jitter_margin_ms       = -1;
+  int alsa_mmap              = 0;
+  char *lock_sender          = NULL;
+  char *replay_file          = NULL;
+  int replay_fast            = 0;
+  int rcvbuf                 = 0;
+  int busy_poll_us           = 0;
+  int max_packet             = DEFAULT_MAX_PACKET_SIZE;
+  int failover_ms            = DEFAULT_FAILOVER_MS;
+  uint32_t sources[MAX_SOURCES];
+  unsigned int num_sources   = 0;
   int opt;
   
-  while ((opt = getopt(argc, argv, "i:g:p:m:x:o:d:s:n:t:l:Puvhc")) != -1) {
+  while ((opt = getopt(argc, argv, "i:g:p:m:x:o:d:s:n:t:l:I:T:F:q:j:w:S:f:b:B:M:r:PRuvhc")) != -1) {
     switch (opt) {
     case 'i':
       interface_name = strdup(optarg);
@@ -178,14 +318,81 @@ int main(int argc, char*argv[]) {
     case 'P':
       receiver_mode = Pcap;
       break;
+    case 'r':
+      receiver_mode = Pcap;
+      replay_file = strdup(optarg);
+      break;
+    case 'R':
+      replay_fast = 1;
+      break;
     case 'm':
       receiver_mode = SharedMem;
       ivshmem_device = strdup(optarg);
       break;
+    case 'I':
+      if (strcmp(optarg,"recvfrom") == 0) ingest_mode = Recvfrom;
+      else if (strcmp(optarg,"mmsg") == 0) ingest_mode = Recvmmsg;
+      else if (strcmp(optarg,"uring") == 0) ingest_mode = Uring;
+      else if (strcmp(optarg,"xdp") == 0) ingest_mode = Xdp;
+      else if (strcmp(optarg,"xdp-generic") == 0) { ingest_mode = Xdp; xdp_generic = 1; }
+      else if (strcmp(optarg,"tpacket") == 0) ingest_mode = Tpacket;
+      else if (strcmp(optarg,"pcap") == 0) ingest_mode = Libpcap;
+      else {
+        fprintf(stderr, "invalid receive engine: %s\n", optarg);
+        return 1;
+      }
+      break;
+    case 'T':
+      block_timeout_ms = atoi(optarg);
+      if (block_timeout_ms <= 0) show_usage(argv[0]);
+      break;
+    case 'F':
+      fanout_group = atoi(optarg);
+      if (fanout_group < 0 || fanout_group > 0xffff) show_usage(argv[0]);
+      break;
+    case 'q':
+      ring_depth = atoi(optarg);
+      if (ring_depth <= 0) show_usage(argv[0]);
+      break;
+    case 'j':
+      jitter_margin_ms = atoi(optarg);
+      if (jitter_margin_ms < 0) show_usage(argv[0]);
+      break;
+    case 'b':
+      if (strcmp(optarg, "auto") == 0) rcvbuf = RCVBUF_AUTO;
+      else {
+        rcvbuf = atoi(optarg);
+        if (rcvbuf <= 0 || rcvbuf > 1024 * 1024) show_usage(argv[0]);
+        rcvbuf *= 1024;
+      }
+      break;
+    case 'B':
+      busy_poll_us = atoi(optarg);
+      if (busy_poll_us <= 0) show_usage(argv[0]);
+      break;
+    case 'M':
+      max_packet = atoi(optarg);
+      if (max_packet < HEADER_V2_SIZE || max_packet > MAX_SO_PACKETSIZE) show_usage(argv[0]);
+      break;
+    case 'w':
+      workers = atoi(optarg);
+      if (workers <= 0 || workers > MAX_WORKERS) show_usage(argv[0]);
+      break;
+    case 'S':
+      lock_sender = strdup(optarg);
+      break;
+    case 'f':
+      failover_ms = atoi(optarg);
+      if (failover_ms <= 0) show_usage(argv[0]);
+      break;
     case 'o':
       output = strdup(optarg);
       if (strcmp(output,"pulse") == 0) output_mode = Pulseaudio;
       else if (strcmp(output,"alsa") == 0) output_mode = Alsa;
+      else if (strcmp(output,"alsa-mmap") == 0) {
+        output_mode = Alsa;
+        alsa_mmap = 1;
+      }
       else if (strcmp(output,"jack") == 0) output_mode = Jack;
       else if (strcmp(output,"sndio") == 0) output_mode = Sndio;
       else if (strcmp(output,"raw") == 0) output_mode = Raw;
@@ -228,10 +435,47 @@ int main(int argc, char*argv[]) {
       interface = get_interface(interface_name);
   }
 
+  if ((ingest_mode == Tpacket || ingest_mode == Libpcap) && receiver_mode != Pcap) {
+    fprintf(stderr, "Sniffer engines need -P\n");
+    show_usage(argv[0]);
+  }
+
+  if (replay_fast && !replay_file) {
+    fprintf(stderr, "-R needs -r\n");
+    show_usage(argv[0]);
+  }
+
+  // the queue would drop what the output can't take at once
+  if (replay_fast && (ring_depth || jitter_margin_ms >= 0)) {
+    fprintf(stderr, "-R can't be combined with -q or -j\n");
+    show_usage(argv[0]);
+  }
+
+#if !PCAP_ENABLE
+  if (replay_file) {
+    fprintf(stderr, "%s compiled without libpcap support, -r not available\n", argv[0]);
+    return 1;
+  }
+#endif
+
+  // Multicast datagrams are delivered to every socket bound to the group,
+  // so more sockets would only mean more copies
+  if (workers && receiver_mode != Unicast) {
+    fprintf(stderr, "-w needs unicast mode (-u)\n");
+    show_usage(argv[0]);
+  }
+
+  if (busy_poll_us && receiver_mode != SharedMem && (receiver_mode == Pcap
+      || (ingest_mode != Recvfrom && ingest_mode != Recvmmsg))) {
+    fprintf(stderr, "-B needs -I recvfrom or mmsg, or -m\n");
+    show_usage(argv[0]);
+  }
+
   if (optind < argc) {
     fprintf(stderr, "Expected argument after options\n");
     show_usage(argv[0]);
   }
+  set_max_packet_size(max_packet);
 
   // Opportunistic call to renice us, so we can keep up under
   // higher load conditions. This may fail when run as non-root.
@@ -254,7 +498,7 @@ int main(int argc, char*argv[]) {
     case Alsa:
 #if ALSA_ENABLE
       if (verbosity) fprintf(stderr, "Using ALSA output\n");
-      if (alsa_output_init(target_latency_ms, alsa_device) != 0) {
+      if (alsa_output_init(target_latency_ms, alsa_device, alsa_mmap) != 0) {
         return 1;
       }
       output_send_fn = alsa_output_send;
@@ -297,17 +541,50 @@ int main(int argc, char*argv[]) {
       break;
   }
 
+  if (source_init(lock_sender, failover_ms) != 0) {
+    return 1;
+  }
+  num_sources = source_lock_addrs(sources);
+  stats_delay_init(&output_delay, "output");
+  sequence_init();
+  conceal_init();
+  fec_init();
+
   // initialize receiver
   switch (receiver_mode) {
     case SharedMem:
       if (verbosity) fprintf(stderr, "Starting IVSHMEM receiver\n");
-      init_shmem(ivshmem_device, target_latency_ms);
+      init_shmem(ivshmem_device, target_latency_ms, busy_poll_us);
       receiver_rcv_fn = rcv_shmem;
       break;
     case Pcap:
 #if PCAP_ENABLE
-      res = init_pcap(interface_name, port, multicast_group);
-      return res == 0 ? run_pcap(output_send_fn) : res;
+      if (replay_file) {
+        if (verbosity) fprintf(stderr, "Replaying %s\n", replay_file);
+        if (init_pcap_offline(replay_file, port, replay_fast) != 0) {
+          return 1;
+        }
+        receiver_rcv_fn = rcv_pcap;
+        break;
+      }
+#endif
+#if TPACKET_ENABLE
+      if (ingest_mode != Libpcap) {
+        if (verbosity) fprintf(stderr, "Starting TPACKET_V3 sniffer\n");
+        if (init_tpacket(interface_name, port, block_timeout_ms, fanout_group) != 0) {
+          return 1;
+        }
+        receiver_rcv_fn = rcv_tpacket;
+        break;
+      }
+#endif
+#if PCAP_ENABLE
+      if (verbosity) fprintf(stderr, "Starting libpcap sniffer\n");
+      if (init_pcap(interface_name, port, rcvbuf == RCVBUF_AUTO ? 0 : rcvbuf, block_timeout_ms) != 0) {
+        return 1;
+      }
+      receiver_rcv_fn = rcv_pcap;
+      break;
 #else
       fprintf(stderr, "%s compiled without libpcap support. Aborting", argv[0]);
       return 1;
@@ -316,18 +593,98 @@ int main(int argc, char*argv[]) {
     case Multicast:
     default:
       if (verbosity) fprintf(stderr, "Starting %s receiver\n", receiver_mode == Unicast ? "unicast" : "multicast");
-      if (init_network(receiver_mode, interface, port, multicast_group) != 0) {
+      if (init_network(receiver_mode, ingest_mode, interface, port, multicast_group, workers, rcvbuf, busy_poll_us, sources, num_sources) != 0) {
+        return 1;
+      }
+      if (workers) {
+#if RECVMMSG_ENABLE
+        if (verbosity) fprintf(stderr, "Using recvmmsg receive engine on %d threads\n", workers);
+        if (!ring_depth) ring_depth = DEFAULT_RING_DEPTH;
+        receiver_rcv_fn = NULL;
+        break;
+#else
+        fprintf(stderr, "%s compiled without recvmmsg support, -w not available\n", argv[0]);
         return 1;
+#endif
+      }
+      switch (ingest_mode) {
+        case Xdp:
+#if XDP_ENABLE
+          if (init_xdp(interface_name, port, receiver_mode == Multicast ? (multicast_group ? multicast_group : DEFAULT_MULTICAST_GROUP) : NULL, xdp_generic) != 0) {
+            return 1;
+          }
+          if (verbosity) fprintf(stderr, "Using AF_XDP receive engine\n");
+          receiver_rcv_fn = rcv_xdp;
+#else
+          fprintf(stderr, "%s compiled without AF_XDP support. Aborting\n", argv[0]);
+          return 1;
+#endif
+          break;
+        case Uring:
+#if URING_ENABLE
+          if (init_uring(get_network_socket()) == 0) {
+            if (verbosity) fprintf(stderr, "Using io_uring receive engine\n");
+            receiver_rcv_fn = rcv_uring;
+            break;
+          }
+          fprintf(stderr, "io_uring multishot receive not supported, falling back to recvmmsg\n");
+#else
+          fprintf(stderr, "%s compiled without io_uring support, falling back to recvmmsg\n", argv[0]);
+#endif
+          // fall through
+        case Recvmmsg:
+#if RECVMMSG_ENABLE
+          if (verbosity) fprintf(stderr, "Using recvmmsg receive engine\n");
+          receiver_rcv_fn = rcv_network_mmsg;
+          break;
+#else
+          fprintf(stderr, "%s compiled without recvmmsg support, falling back to recvfrom\n", argv[0]);
+#endif
+          // fall through
+        case Recvfrom:
+        default:
+          receiver_rcv_fn = rcv_network;
+          break;
       }
-      receiver_rcv_fn = rcv_network;
       break;
   }
 
+  if (jitter_margin_ms >= 0) {
+    jitter_init(jitter_margin_ms);
+    jitter_enabled = 1;
+    if (!ring_depth) ring_depth = DEFAULT_RING_DEPTH;
+  }
 
-  for (;;) {
-    receiver_rcv_fn(&receiver_data);
-    if (output_send_fn(&receiver_data) != 0)
+  if (ring_depth) {
+    // A slow output write no longer holds up draining the socket
+#if RECVMMSG_ENABLE
+    if (workers) {
+      if (start_receive_workers(workers, rcv_worker, ring_depth) != 0) {
+        return 1;
+      }
+    }
+    else
+#endif
+    if (start_receive_thread(receiver_rcv_fn, ring_depth) != 0) {
       return 1;
+    }
+    for (;;) {
+      receiver_data_t *data = ring_peek();
+      // the end of a replayed capture
+      if (!data) return 0;
+      if (receive(data) != 0)
+        return 1;
+      ring_consume();
+    }
+  }
+
+  for (;;) {
+    n = receiver_rcv_fn(receiver_data, MAX_BATCH);
+    if (n < 0) return 0;
+    for (i = 0; i < n; i++) {
+      if (receive(&receiver_data[i]) != 0)
+        return 1;
+    }
   }
 
 };
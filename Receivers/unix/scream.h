@@ -2,15 +2,29 @@
 #define SCREAM_H
 
 #include <stdint.h>
+#include <time.h>
 
 enum receiver_type {
   Unicast, Multicast, SharedMem, Pcap
 };
 
+enum ingest_type {
+  Recvfrom, Recvmmsg, Uring, Xdp, Tpacket, Libpcap
+};
+
 enum output_type {
   Raw, Alsa, Pulseaudio, Jack, Sndio
 };
 
+// Max. number of packets a receiver hands to the output in one go
+#define MAX_BATCH 64
+// Max. number of receive threads with -w
+#define MAX_WORKERS 64
+// Max. number of senders given with -S
+#define MAX_SOURCES 8
+
+#define CACHE_LINE 64
+
 typedef struct receiver_format {
   unsigned char sample_rate;
   unsigned char sample_size;
@@ -18,10 +32,23 @@ typedef struct receiver_format {
   uint16_t channel_map;
 } receiver_format_t;
 
+// receiver_data_t flags
+#define RECEIVER_HAS_SEQ 0x01     // seq and timestamp are valid (protocol v2)
+#define RECEIVER_FEC_PARITY 0x02  // a parity packet, see fec.h
+
 typedef struct receiver_data {
   receiver_format_t format;
   unsigned int audio_size;
   unsigned char* audio;
+  unsigned int flags;
+  uint32_t seq;         // packet sequence number
+  uint64_t timestamp;   // sender media time of the first frame, in frames
+  uint32_t src_addr;    // sender IPv4 address and UDP port, network byte
+  uint16_t src_port;    // order; 0 where there is no sender (IVSHMEM)
+  struct timespec arrival;  // when the packet reached the host (CLOCK_MONOTONIC):
+                            // the kernel's receive timestamp where available
+  struct packet_buf *buf;   // pool buffer holding the audio (see pool.h), or
+                            // NULL if it is only valid until the next receive
 } receiver_data_t;
 
 extern int verbosity;
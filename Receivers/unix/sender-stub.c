@@ -0,0 +1,503 @@
+// sender-stub: stands in for the Scream driver sending over the network,
+// so that the receiver's handling of lost, reordered and duplicate packets
+// can be tried without a Windows guest and a lossy network.
+//
+// It sends protocol v1 or (with -2) v2 packets at the pace of the audio,
+// and skips, swaps and duplicates packets on a fixed pattern. Channel 0
+// holds a cosine with a period of 64 frames, channel 1 the frame number
+// (see NUMBER_BITS), the other channels are silent.
+//
+// With -k, it sends a given number of packets per second instead, in a
+// batch every millisecond, to load the receiver (see bench.sh). The load
+// can come from several senders (-n), each on its own source port, and
+// with -A its own source address.
+//
+// With -C, it instead checks the audio a receiver wrote with -o raw: it
+// counts steps in the sine, and from the frame numbers tells gaps that
+// were filled with as much audio as went missing from gaps that weren't
+// filled, or filled with the wrong amount, and audio played twice or out
+// of order.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "network.h"
+#include "conceal.h"
+
+#define SINE_PERIOD 64        // frames
+#define SINE_AMPLITUDE 16384  // of 32768
+// The sine changes by at most 2 pi / SINE_PERIOD of its amplitude from one
+// frame to the next, a quarter of the amplitude is a step
+#define STEP_LIMIT (SINE_AMPLITUDE / 4)
+// Frame numbers wrap around at NUMBER_BITS, and are sent with the bit
+// above set: faded towards 0, as the fill of a gap does, a number then
+// changes by more than 1, so the fill doesn't pass for received audio
+#define NUMBER_BITS 14
+#define NUMBER_MASK ((1 << NUMBER_BITS) - 1)
+// A run of this many frames numbered in sequence is received audio
+#define RUN_FRAMES 8
+// With -k, packets go out in one sendmmsg() per tick
+#define LOAD_TICK_NS 1000000
+#define LOAD_BATCH 1024
+#define MAX_SENDERS 64
+
+typedef struct sender {
+  int sockfd;             // of the first sender
+  int sockfds[MAX_SENDERS];
+  unsigned int senders;
+  struct sockaddr_in dest;
+  int v2;
+  unsigned int rate;
+  unsigned int bits;
+  unsigned int channels;
+  unsigned int frames;    // per packet
+  unsigned char packet[MAX_SO_PACKETSIZE];
+  unsigned int size;
+  uint64_t sent, lost, swapped, duplicated;
+} sender_t;
+
+static void show_usage(const char *arg0)
+{
+  fprintf(stderr, "\n");
+  fprintf(stderr, "Usage: %s [-a <address>] [-p <port>] [-2] [-L <n>] [-O <n>] [-D <n>] [-d <seconds>]\n", arg0);
+  fprintf(stderr, "       %s -k <packets/s> [-n <senders>] [-A <address>] [-a <address>] [-p <port>] [-2] [-d <seconds>]\n", arg0);
+  fprintf(stderr, "       %s -C [-r <rate>] [-b <bits>] [-c <channels>]\n", arg0);
+  fprintf(stderr, "\n");
+  fprintf(stderr, "         -a <address>                 : Send to <address>, default %s.\n", DEFAULT_MULTICAST_GROUP);
+  fprintf(stderr, "         -p <port>                    : Send to <port>, default %d.\n", DEFAULT_PORT);
+  fprintf(stderr, "         -2                           : Send protocol v2 packets, with sequence numbers\n");
+  fprintf(stderr, "                                        and media time.\n");
+  fprintf(stderr, "         -r <rate>                    : Sample rate, default 48000.\n");
+  fprintf(stderr, "         -b <bits>                    : Sample size, default 16.\n");
+  fprintf(stderr, "         -c <channels>                : Channels, default 2.\n");
+  fprintf(stderr, "         -s <bytes>                   : Audio per packet, default %d.\n", DEFAULT_PAYLOAD_SIZE);
+  fprintf(stderr, "         -L <n>                       : Lose every <n>th packet.\n");
+  fprintf(stderr, "         -O <n>                       : Send every <n>th packet after the next one.\n");
+  fprintf(stderr, "         -D <n>                       : Send every <n>th packet twice.\n");
+  fprintf(stderr, "         -P <seconds>                 : Lose, swap and duplicate packets during the\n");
+  fprintf(stderr, "                                        first <seconds> only.\n");
+  fprintf(stderr, "         -d <seconds>                 : Stop after <seconds>, default 12.\n");
+  fprintf(stderr, "         -k <packets/s>               : Send <packets/s>, whatever the pace of the audio,\n");
+  fprintf(stderr, "                                        to load the receiver.\n");
+  fprintf(stderr, "         -n <senders>                 : With -k, spread the packets over <senders>, each\n");
+  fprintf(stderr, "                                        sending from its own port, up to %d.\n", MAX_SENDERS);
+  fprintf(stderr, "         -A <address>                 : Send from <address>, the next senders from the\n");
+  fprintf(stderr, "                                        addresses after it.\n");
+  fprintf(stderr, "         -C                           : Check the raw audio of a receiver on stdin.\n");
+  fprintf(stderr, "\n");
+  exit(1);
+}
+
+static int64_t now_ns()
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static void sleep_until(int64_t due_ns)
+{
+  struct timespec due = { due_ns / 1000000000LL, due_ns % 1000000000LL };
+
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) == EINTR);
+}
+
+static void put_le(unsigned char *p, uint64_t v, int bytes)
+{
+  for (int i = 0; i < bytes; i++, v >>= 8) p[i] = v & 0xff;
+}
+
+// Samples are left aligned in 32 bits, whatever their size
+static void put_sample(unsigned char *p, unsigned int bytes, int32_t v)
+{
+  put_le(p, (uint32_t)v >> (32 - 8 * bytes), bytes);
+}
+
+static int32_t get_sample(const unsigned char *p, unsigned int bytes)
+{
+  uint32_t u = 0;
+
+  for (unsigned int i = 0; i < bytes; i++) u |= (uint32_t)p[i] << (8 * i);
+  return (int32_t)(u << (32 - 8 * bytes));
+}
+
+static int32_t sine(uint64_t frame)
+{
+  return (int32_t)lrint(SINE_AMPLITUDE * cos(2 * M_PI * (frame % SINE_PERIOD) / SINE_PERIOD)) * 65536;
+}
+
+// Writes packet <n>, which starts at frame <n> * frames of the stream
+static void make_packet(sender_t *s, uint64_t n)
+{
+  unsigned int bytes = s->bits / 8, header = s->v2 ? HEADER_V2_SIZE : HEADER_SIZE;
+  uint64_t frame = n * s->frames;
+  unsigned char *p = s->packet + header;
+
+  s->packet[0] = (s->rate % 44100 ? 0 : 128) + s->rate / (s->rate % 44100 ? 48000 : 44100);
+  s->packet[1] = s->bits | (s->v2 ? HEADER_V2_FLAG : 0);
+  s->packet[2] = s->channels;
+  put_le(&s->packet[3], s->channels == 1 ? 0x4 : (1 << s->channels) - 1, 2);
+  if (s->v2) {
+    put_le(&s->packet[5], (uint32_t)n, 4);
+    put_le(&s->packet[9], frame, 8);
+  }
+
+  memset(p, 0, s->frames * s->channels * bytes);
+  for (unsigned int f = 0; f < s->frames; f++, frame++, p += s->channels * bytes) {
+    put_sample(p, bytes, sine(frame));
+    if (s->channels > 1) put_sample(p + bytes, bytes, (int32_t)(((frame & NUMBER_MASK) | (NUMBER_MASK + 1)) << 16));
+  }
+  s->size = header + s->frames * s->channels * bytes;
+}
+
+static void send_packet(sender_t *s, uint64_t n)
+{
+  make_packet(s, n);
+  if (sendto(s->sockfd, s->packet, s->size, 0, (struct sockaddr *)&s->dest, sizeof(s->dest)) < 0) {
+    perror("sendto");
+    exit(1);
+  }
+  s->sent++;
+}
+
+static int is_nth(uint64_t n, int every)
+{
+  return every && n % every == 0;
+}
+
+// Packets are numbered from 1 for the pattern. Packet n is due when its
+// audio would start playing: a lost packet leaves a gap in time as well,
+// a swapped one is sent right after its successor.
+static void run(sender_t *s, int duration, int pattern_secs, int lose, int swap, int dup)
+{
+  int64_t start = now_ns(), packet_ns = s->frames * 1000000000LL / s->rate;
+  uint64_t n, packets = duration * 1000000000LL / packet_ns;
+  int held = 0, pattern;
+
+  for (n = 1; n <= packets; n++) {
+    sleep_until(start + (int64_t)(n - 1) * packet_ns);
+    pattern = !pattern_secs || (int64_t)(n - 1) * packet_ns < pattern_secs * 1000000000LL;
+
+    if (pattern && is_nth(n, lose)) {
+      s->lost++;
+    }
+    else if (pattern && is_nth(n, swap) && n < packets) {
+      s->swapped++;
+      held = 1;
+      continue;
+    }
+    else {
+      send_packet(s, n - 1);
+      if (pattern && is_nth(n, dup)) {
+        send_packet(s, n - 1);
+        s->duplicated++;
+      }
+    }
+    if (held) {
+      send_packet(s, n - 2);
+      held = 0;
+    }
+  }
+
+  fprintf(stderr, "%llu packets sent, %llu lost (%.1f ms), %llu swapped, %llu duplicated\n",
+    (unsigned long long)s->sent, (unsigned long long)s->lost,
+    s->lost * packet_ns / 1e6, (unsigned long long)s->swapped, (unsigned long long)s->duplicated);
+}
+
+// Sends <pps> packets per second for <duration> seconds, taking turns
+// between the senders. All packets carry the same audio, v2 packets are
+// still numbered for each sender.
+static int load(sender_t *s, int duration, unsigned int pps)
+{
+  unsigned char *packets;
+  struct mmsghdr msgs[LOAD_BATCH];
+  struct iovec iovs[LOAD_BATCH];
+  int64_t start = now_ns(), tick = start, elapsed;
+  uint64_t total = (uint64_t)pps * duration, due = 0, failed = 0, n[MAX_SENDERS], due_sender;
+  unsigned int batch, i, j;
+  int sent;
+
+  make_packet(s, 0);
+  packets = malloc((size_t)LOAD_BATCH * s->size);
+  if (!packets) {
+    perror("malloc");
+    return 1;
+  }
+  memset(msgs, 0, sizeof(msgs));
+  for (i = 0; i < LOAD_BATCH; i++) {
+    memcpy(packets + i * s->size, s->packet, s->size);
+    iovs[i].iov_base = packets + i * s->size;
+    iovs[i].iov_len = s->size;
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+    msgs[i].msg_hdr.msg_name = &s->dest;
+    msgs[i].msg_hdr.msg_namelen = sizeof(s->dest);
+  }
+
+  memset(n, 0, sizeof(n));
+  while (due < total) {
+    tick += LOAD_TICK_NS;
+    sleep_until(tick);
+    due = (uint64_t)((now_ns() - start) * (double)pps / 1e9);
+    if (due > total) due = total;
+    for (i = 0; i < s->senders; i++) {
+      // sender i sends the packets numbered i, i + senders, ...
+      due_sender = (due + s->senders - 1 - i) / s->senders;
+      while (n[i] < due_sender) {
+        batch = due_sender - n[i] > LOAD_BATCH ? LOAD_BATCH : due_sender - n[i];
+        if (s->v2) {
+          for (j = 0; j < batch; j++) {
+            put_le(packets + j * s->size + 5, (uint32_t)(n[i] + j), 4);
+            put_le(packets + j * s->size + 9, (n[i] + j) * s->frames, 8);
+          }
+        }
+        sent = sendmmsg(s->sockfds[i], msgs, batch, 0);
+        if (sent < 0) {
+          if (errno != ENOBUFS && errno != EAGAIN) {
+            perror("sendmmsg");
+            return 1;
+          }
+          // the packets are lost, as on a congested link
+          sent = 0;
+        }
+        s->sent += sent;
+        failed += batch - sent;
+        n[i] += batch;
+      }
+    }
+  }
+
+  elapsed = now_ns() - start;
+  fprintf(stderr, "%llu packets sent in %.1f s (%.0f pkts/s) by %u senders, %llu failed to send\n",
+    (unsigned long long)s->sent, elapsed / 1e9, s->sent * 1e9 / elapsed, s->senders, (unsigned long long)failed);
+  free(packets);
+  return 0;
+}
+
+typedef struct check {
+  uint64_t frames, steps;
+  uint64_t filled, filled_frames;  // gaps filled with as much as was missing
+  uint64_t unfilled, unfilled_frames;
+  uint64_t misfilled;              // filled with more or less audio
+  uint64_t backwards;              // audio played again, or out of order
+} check_t;
+
+// A gap of <missing> frames between two runs, with <between> frames of
+// the output that belong to neither
+static void check_gap(check_t *c, int missing, uint64_t between)
+{
+  if (missing < 0) {
+    c->backwards++;
+  }
+  else if (between == (uint64_t)missing) {
+    // the crossfade back into the received audio takes the first frames
+    // of the next run
+    c->filled++;
+    c->filled_frames += between > CONCEAL_XFADE_FRAMES ? between - CONCEAL_XFADE_FRAMES : 0;
+  }
+  else if (between == 0) {
+    c->unfilled++;
+    c->unfilled_frames += missing;
+  }
+  else {
+    c->misfilled++;
+  }
+}
+
+// Frames between <run_end> and <first> (negative: <first> came before),
+// up to half the range of the numbers
+static int missing(unsigned int first, unsigned int run_end)
+{
+  int d = (first - run_end) & NUMBER_MASK;
+
+  return (d > NUMBER_MASK / 2 ? d - NUMBER_MASK - 1 : d) - 1;
+}
+
+static int check(unsigned int rate, unsigned int bits, unsigned int channels)
+{
+  unsigned int bytes = bits / 8, frame_size = bytes * channels;
+  unsigned char buf[4096 * 32];
+  check_t c;
+  int32_t sample, last_sample = 0;
+  unsigned int number, last_number = 0, run_end = 0, first;
+  uint64_t run_length = 0, between = 0;
+  int have_run = 0;
+  size_t got = 0, n, i;
+  ssize_t r;
+
+  if (channels < 2) {
+    fprintf(stderr, "Checking needs 2 channels or more\n");
+    return 1;
+  }
+
+  memset(&c, 0, sizeof(c));
+  for (;;) {
+    r = read(0, buf + got, sizeof(buf) - got);
+    if (r <= 0) break;
+    got += r;
+    n = got / frame_size;
+    for (i = 0; i < n; i++, c.frames++) {
+      sample = get_sample(buf + i * frame_size, bytes) >> 16;
+      number = ((uint32_t)get_sample(buf + i * frame_size + bytes, bytes) >> 16) & NUMBER_MASK;
+
+      if (c.frames && abs(sample - last_sample) > STEP_LIMIT) c.steps++;
+      last_sample = sample;
+
+      if (c.frames && number == ((last_number + 1) & NUMBER_MASK)) {
+        if (++run_length == RUN_FRAMES - 1) {
+          // a new run: its first frame follows <between> others
+          first = (number - (RUN_FRAMES - 1)) & NUMBER_MASK;
+          if (have_run) check_gap(&c, missing(first, run_end), between);
+          have_run = 1;
+          between = 0;
+        }
+      }
+      else {
+        // frames of a run too short to count belong to the gap
+        if (run_length < RUN_FRAMES - 1) between += run_length + 1;
+        else run_end = last_number;
+        run_length = 0;
+      }
+      last_number = number;
+    }
+    memmove(buf, buf + n * frame_size, got - n * frame_size);
+    got -= n * frame_size;
+  }
+
+  fprintf(stderr, "%llu frames (%.1f s), %llu steps\n",
+    (unsigned long long)c.frames, (double)c.frames / rate, (unsigned long long)c.steps);
+  fprintf(stderr, "%llu gaps filled (%.1f ms), %llu gaps not filled (%.1f ms), %llu filled with the wrong length\n",
+    (unsigned long long)c.filled, c.filled_frames * 1000.0 / rate,
+    (unsigned long long)c.unfilled, c.unfilled_frames * 1000.0 / rate, (unsigned long long)c.misfilled);
+  fprintf(stderr, "%llu times audio played again or out of order\n", (unsigned long long)c.backwards);
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  sender_t s;
+  char *address = DEFAULT_MULTICAST_GROUP, *source = NULL;
+  struct sockaddr_in from;
+  int port = DEFAULT_PORT, payload = DEFAULT_PAYLOAD_SIZE, duration = 12, pattern_secs = 0;
+  int lose = 0, swap = 0, dup = 0, checking = 0, opt;
+  unsigned int pps = 0;
+
+  memset(&s, 0, sizeof(s));
+  s.rate = 48000;
+  s.bits = 16;
+  s.channels = 2;
+  s.senders = 1;
+
+  while ((opt = getopt(argc, argv, "a:p:2r:b:c:s:L:O:D:P:d:k:n:A:Ch")) != -1) {
+    switch (opt) {
+    case 'a':
+      address = optarg;
+      break;
+    case 'p':
+      port = atoi(optarg);
+      if (port <= 0 || port > 0xffff) show_usage(argv[0]);
+      break;
+    case '2':
+      s.v2 = 1;
+      break;
+    case 'r':
+      s.rate = atoi(optarg);
+      if (!s.rate || (s.rate % 44100 && s.rate % 48000)) show_usage(argv[0]);
+      break;
+    case 'b':
+      s.bits = atoi(optarg);
+      if (s.bits != 16 && s.bits != 24 && s.bits != 32) show_usage(argv[0]);
+      break;
+    case 'c':
+      s.channels = atoi(optarg);
+      if (s.channels < 1 || s.channels > MAX_STREAM_CHANNELS) show_usage(argv[0]);
+      break;
+    case 's':
+      payload = atoi(optarg);
+      break;
+    case 'L':
+      lose = atoi(optarg);
+      if (lose < 0) show_usage(argv[0]);
+      break;
+    case 'O':
+      swap = atoi(optarg);
+      if (swap < 0) show_usage(argv[0]);
+      break;
+    case 'D':
+      dup = atoi(optarg);
+      if (dup < 0) show_usage(argv[0]);
+      break;
+    case 'P':
+      pattern_secs = atoi(optarg);
+      if (pattern_secs < 0) show_usage(argv[0]);
+      break;
+    case 'd':
+      duration = atoi(optarg);
+      if (duration <= 0) show_usage(argv[0]);
+      break;
+    case 'k':
+      pps = atoi(optarg);
+      if (!pps) show_usage(argv[0]);
+      break;
+    case 'n':
+      s.senders = atoi(optarg);
+      if (s.senders < 1 || s.senders > MAX_SENDERS) show_usage(argv[0]);
+      break;
+    case 'A':
+      source = optarg;
+      break;
+    case 'C':
+      checking = 1;
+      break;
+    default:
+      show_usage(argv[0]);
+    }
+  }
+  if (checking) return check(s.rate, s.bits, s.channels);
+  if (s.senders > 1 && !pps) show_usage(argv[0]);
+
+  if (payload <= 0 || payload % (s.bits / 8 * s.channels)
+      || payload + HEADER_V2_SIZE > MAX_SO_PACKETSIZE) {
+    fprintf(stderr, "The audio per packet must be whole frames, up to %d bytes\n", MAX_SO_PACKETSIZE - HEADER_V2_SIZE);
+    return 1;
+  }
+  s.frames = payload / (s.bits / 8 * s.channels);
+
+  memset(&s.dest, 0, sizeof(s.dest));
+  s.dest.sin_family = AF_INET;
+  s.dest.sin_port = htons(port);
+  if (inet_pton(AF_INET, address, &s.dest.sin_addr) != 1) show_usage(argv[0]);
+  memset(&from, 0, sizeof(from));
+  from.sin_family = AF_INET;
+  if (source && inet_pton(AF_INET, source, &from.sin_addr) != 1) show_usage(argv[0]);
+
+  for (unsigned int i = 0; i < s.senders; i++) {
+    s.sockfds[i] = socket(AF_INET, SOCK_DGRAM, 0);
+    if (s.sockfds[i] < 0) {
+      perror("Failed to create socket");
+      return 1;
+    }
+    if (source) {
+      if (bind(s.sockfds[i], (struct sockaddr *)&from, sizeof(from)) < 0) {
+        perror("Failed to bind to the source address");
+        return 1;
+      }
+      from.sin_addr.s_addr = htonl(ntohl(from.sin_addr.s_addr) + 1);
+    }
+  }
+  s.sockfd = s.sockfds[0];
+
+  if (pps) return load(&s, duration, pps);
+  run(&s, duration, pattern_secs, lose, swap, dup);
+  return 0;
+}
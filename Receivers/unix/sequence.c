@@ -0,0 +1,74 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "sequence.h"
+#include "stats.h"
+
+static rctx_sequence_t rctx_sequence;
+
+void sequence_init()
+{
+  memset(&rctx_sequence, 0, sizeof(rctx_sequence));
+  clock_gettime(CLOCK_MONOTONIC, &rctx_sequence.last_report);
+}
+
+// Another sender took over: its sequence numbers start afresh
+void sequence_restart()
+{
+  rctx_sequence.running = 0;
+}
+
+static void sequence_report()
+{
+  struct timespec now;
+
+  if (verbosity < 2) return;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (now.tv_sec - rctx_sequence.last_report.tv_sec < STATS_INTERVAL) return;
+
+  fprintf(stderr, "sequence: %llu lost, %llu reordered, %llu duplicates, %llu sender restarts\n",
+    (unsigned long long)(rctx_sequence.gaps - rctx_sequence.reordered),
+    (unsigned long long)rctx_sequence.reordered,
+    (unsigned long long)rctx_sequence.duplicates,
+    (unsigned long long)rctx_sequence.restarts);
+  rctx_sequence.last_report = now;
+}
+
+// Tracks the sequence numbers of protocol v2 packets. Returns 0 for a
+// packet that arrived after its successor: it has missed its turn, and is
+// dropped rather than played out of order.
+int sequence_check(receiver_data_t* receiver_data)
+{
+  int32_t diff;
+  uint64_t bit;
+
+  if (!(receiver_data->flags & RECEIVER_HAS_SEQ)) return 1;
+
+  diff = (int32_t)(receiver_data->seq - rctx_sequence.expected);
+  if (rctx_sequence.running && diff < 0 && diff >= -SEQ_REORDER_WINDOW) {
+    bit = 1ULL << (-diff - 1);
+    if (rctx_sequence.seen & bit) {
+      rctx_sequence.duplicates++;
+    }
+    else {
+      rctx_sequence.seen |= bit;
+      rctx_sequence.reordered++;
+    }
+    sequence_report();
+    return 0;
+  }
+
+  if (!rctx_sequence.running || diff < 0 || diff > SEQ_MAX_GAP) {
+    if (rctx_sequence.running) rctx_sequence.restarts++;
+    rctx_sequence.running = 1;
+    rctx_sequence.seen = 0;
+    diff = 0;
+  }
+  rctx_sequence.gaps += diff;
+  rctx_sequence.seen = (diff < 63 ? rctx_sequence.seen << (diff + 1) : 0) | 1;
+  rctx_sequence.expected = receiver_data->seq + 1;
+
+  sequence_report();
+  return 1;
+}
@@ -0,0 +1,30 @@
+#ifndef SEQUENCE_H
+#define SEQUENCE_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "scream.h"
+
+// A packet up to this many sequence numbers behind the newest one arrived
+// out of order; further back, or a jump further ahead than SEQ_MAX_GAP,
+// means the sender restarted.
+#define SEQ_REORDER_WINDOW 64
+#define SEQ_MAX_GAP 10000
+
+typedef struct rctx_sequence {
+  int running;
+  uint32_t expected;
+  uint64_t seen;       // bit n: expected - 1 - n was received
+  uint64_t gaps;       // sequence numbers skipped
+  uint64_t reordered;  // skipped ones that turned up later
+  uint64_t duplicates;
+  uint64_t restarts;
+  struct timespec last_report;
+} rctx_sequence_t;
+
+void sequence_init();
+void sequence_restart();
+int sequence_check(receiver_data_t* receiver_data);
+
+#endif
@@ -1,32 +1,205 @@
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "config.h"
 #include "shmem.h"
 
+#if IVSHMEM_DOORBELL_ENABLE
+#include <sys/epoll.h>
+#endif
+
 static rctx_shmem_t rctx_shmem;
 static useconds_t shmem_poll_delay;
 
-int init_shmem(char* shmem_device_file, int target_latency_ms)
+static void set_peer_live(int64_t id, int live)
+{
+  if (id < 0 || id > UINT16_MAX) return;
+  if (live)
+    rctx_shmem.live_peers[id / 8] |= 1 << (id % 8);
+  else
+    rctx_shmem.live_peers[id / 8] &= ~(1 << (id % 8));
+}
+
+// The doorbell is free if nobody claimed it, or if whoever did is gone
+// (e.g. a receiver that was killed, and left its ID in the header)
+static int doorbell_free(uint16_t doorbell_peer)
+{
+  return doorbell_peer == 0
+    || !(rctx_shmem.live_peers[(doorbell_peer - 1) / 8] & (1 << ((doorbell_peer - 1) % 8)));
+}
+
+#if IVSHMEM_DOORBELL_ENABLE
+// Reads one message of the ivshmem-server protocol: a little endian 64 bit
+// value, with or without a file descriptor. <msg_fd> is -1 without.
+static int read_server_msg(int sock, int64_t *value, int *msg_fd)
+{
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } control;
+  struct iovec iov = { value, sizeof(*value) };
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  ssize_t n;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+
+  do {
+    n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+  } while (n < 0 && errno == EINTR);
+  if (n != sizeof(*value)) return 1;
+
+  *msg_fd = -1;
+  for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+      memcpy(msg_fd, CMSG_DATA(cmsg), sizeof(int));
+  }
+  *value = le64toh(*value);
+  return 0;
+}
+
+// Connects to an ivshmem-server (or QEMU's -chardev socket of an
+// ivshmem-doorbell device) as a peer. The server hands out the shared
+// memory, then the eventfds of the other peers' vectors and last those of
+// our own. Returns the shared memory's fd, or -1.
+static int connect_server(const char *path)
+{
+  struct sockaddr_un addr;
+  int64_t version, value;
+  int shm_fd = -1, msg_fd;
+
+  rctx_shmem.server_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (rctx_shmem.server_fd < 0) {
+    perror("Failed to create ivshmem-server socket");
+    return -1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+  if (connect(rctx_shmem.server_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    perror("Failed to connect to ivshmem-server");
+    return -1;
+  }
+
+  if (read_server_msg(rctx_shmem.server_fd, &version, &msg_fd) != 0 || version != 0) {
+    fprintf(stderr, "Unsupported ivshmem-server protocol\n");
+    return -1;
+  }
+  if (read_server_msg(rctx_shmem.server_fd, &rctx_shmem.peer_id, &msg_fd) != 0
+      || read_server_msg(rctx_shmem.server_fd, &value, &shm_fd) != 0 || value != -1 || shm_fd < 0) {
+    fprintf(stderr, "ivshmem-server didn't send the shared memory\n");
+    return -1;
+  }
+
+  // the other peers' vectors are of no use to us, ours come last
+  while (rctx_shmem.doorbell_fd < 0) {
+    if (read_server_msg(rctx_shmem.server_fd, &value, &msg_fd) != 0) {
+      fprintf(stderr, "ivshmem-server didn't send our interrupt vector\n");
+      return -1;
+    }
+    set_peer_live(value, 1);
+    if (value == rctx_shmem.peer_id && msg_fd >= 0)
+      rctx_shmem.doorbell_fd = msg_fd;
+    else if (msg_fd >= 0)
+      close(msg_fd);
+  }
+
+  rctx_shmem.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (rctx_shmem.epoll_fd < 0) {
+    perror("Failed to create epoll instance");
+    return -1;
+  }
+  struct epoll_event ev = { .events = EPOLLIN };
+  ev.data.fd = rctx_shmem.doorbell_fd;
+  epoll_ctl(rctx_shmem.epoll_fd, EPOLL_CTL_ADD, rctx_shmem.doorbell_fd, &ev);
+  // peers coming and going, and our further vectors
+  ev.data.fd = rctx_shmem.server_fd;
+  epoll_ctl(rctx_shmem.epoll_fd, EPOLL_CTL_ADD, rctx_shmem.server_fd, &ev);
+
+  if (verbosity) fprintf(stderr, "Connected to ivshmem-server as peer %lld\n", (long long)rctx_shmem.peer_id);
+  return shm_fd;
+}
+
+static void drain_server()
+{
+  struct shmheader *header = (struct shmheader*)rctx_shmem.mmap;
+  int64_t value;
+  int msg_fd;
+
+  if (read_server_msg(rctx_shmem.server_fd, &value, &msg_fd) != 0) {
+    // the shared memory and our eventfd stay valid without the server
+    if (verbosity) fprintf(stderr, "ivshmem-server closed the connection\n");
+    epoll_ctl(rctx_shmem.epoll_fd, EPOLL_CTL_DEL, rctx_shmem.server_fd, NULL);
+    close(rctx_shmem.server_fd);
+    rctx_shmem.server_fd = -1;
+    return;
+  }
+  if (msg_fd >= 0) {
+    set_peer_live(value, 1);
+    close(msg_fd);
+    return;
+  }
+  set_peer_live(value, 0);
+  if (header->doorbell_peer == value + 1) {
+    // the receiver the guest rang has gone, take over
+    header->doorbell_peer = rctx_shmem.peer_id + 1;
+  }
+}
+#endif
+
+int init_shmem(char* shmem_device_file, int target_latency_ms, int busy_poll_us)
 {
   struct stat st;
+  int shmFD;
+
+  rctx_shmem.doorbell_fd = -1;
+  rctx_shmem.server_fd = -1;
+  rctx_shmem.epoll_fd = -1;
+
   if (stat(shmem_device_file, &st) < 0)  {
     fprintf(stderr, "Failed to stat the shared memory file: %s\n", shmem_device_file);
     exit(2);
   }
 
-  int shmFD = open(shmem_device_file, O_RDONLY);
-  if (shmFD < 0) {
-    fprintf(stderr, "Failed to open the shared memory file: %s\n", shmem_device_file);
+  if (S_ISSOCK(st.st_mode)) {
+#if IVSHMEM_DOORBELL_ENABLE
+    shmFD = connect_server(shmem_device_file);
+    if (shmFD < 0 || fstat(shmFD, &st) < 0) exit(3);
+    // read-write, for publishing our peer ID
+    rctx_shmem.mmap = mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, shmFD, 0);
+    rctx_shmem.size = st.st_size;
+#else
+    fprintf(stderr, "Compiled without ivshmem-doorbell support: %s\n", shmem_device_file);
     exit(3);
+#endif
+  }
+  else {
+    shmFD = open(shmem_device_file, O_RDONLY);
+    if (shmFD < 0) {
+      fprintf(stderr, "Failed to open the shared memory file: %s\n", shmem_device_file);
+      exit(3);
+    }
+    rctx_shmem.mmap = mmap(0, st.st_size, PROT_READ, MAP_SHARED, shmFD, 0);
+    rctx_shmem.size = st.st_size;
   }
 
-  rctx_shmem.mmap = mmap(0, st.st_size, PROT_READ, MAP_SHARED, shmFD, 0);
   if (rctx_shmem.mmap == MAP_FAILED) {
     fprintf(stderr, "Failed to map the shared memory file: %s\n", shmem_device_file);
     close(shmFD);
     exit(4);
   }
 
-  struct shmheader *header = (struct shmheader*)rctx_shmem.mmap;
-  rctx_shmem.read_idx = header->write_idx;
   shmem_poll_delay = target_latency_ms * 1000 / 8;
+  rctx_shmem.spin_ns = (busy_poll_us ? busy_poll_us : SHMEM_SPIN_US) * 1000LL;
+  stats_init(&rctx_shmem.stats, "shmem");
 
   return 0;
 }
@@ -35,43 +208,390 @@ int32_t mod(int32_t x, int32_t N){
     return (x % N + N) %N;
 }
 
-void rcv_shmem(receiver_data_t* receiver_data)
+// Waits for the guest to write the next chunk. With a doorbell, until the
+// guest rings it. A guest driver without doorbell support never does, so
+// until the first ring the wait is bounded by the poll period. Returns 1 if
+// the wait timed out.
+static int shmem_wait()
 {
-  struct shmheader *header = (struct shmheader*)rctx_shmem.mmap;
+  rctx_shmem.wakeups++;
+#if IVSHMEM_DOORBELL_ENABLE
+  if (rctx_shmem.doorbell_fd >= 0) {
+    struct epoll_event events[2];
+    uint64_t count;
+    int n, i;
+
+    n = epoll_wait(rctx_shmem.epoll_fd, events, 2, rctx_shmem.ringing ? SHMEM_DOORBELL_TIMEOUT_MS : shmem_poll_delay / 1000);
+    for (i = 0; i < n; i++) {
+      if (events[i].data.fd == rctx_shmem.doorbell_fd) {
+        if (read(rctx_shmem.doorbell_fd, &count, sizeof(count)) == sizeof(count))
+          rctx_shmem.doorbells += count;
+        rctx_shmem.ringing = 1;
+      }
+      else {
+        drain_server();
+      }
+    }
+    return n == 0;
+  }
+#endif
+  usleep(shmem_poll_delay);
+  return 1;
+}
+
+static int64_t now_ns()
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static int chunk_ready()
+{
+  struct shmheader *live = (struct shmheader*)rctx_shmem.mmap;
+
+  return __atomic_load_n(&live->write_idx, __ATOMIC_ACQUIRE) != rctx_shmem.read_idx;
+}
+
+// Without a doorbell, but knowing that the guest writes a chunk every 20 ms:
+// sleeps until the spin window before the next chunk is due and spins on
+// write_idx through the window. A late chunk is then checked for once per
+// spin window, for up to half a chunk. Beyond that, the guest has paused
+// and we go back to polling, until the next chunk sets the pace again.
+// Returns 1 if the chunk didn't come.
+static int shmem_wait_deadline()
+{
+  struct shmheader *header = &rctx_shmem.header;
+  int64_t rate = ((header->sample_rate >= 128) ? 44100 : 48000) * (header->sample_rate % 128);
+  int64_t bytes_per_sec = rate * (header->sample_size / 8) * header->channels;
+  int64_t period_ns, due_ns, wake_ns, now;
+  struct timespec wake;
+
+  if (!bytes_per_sec || !rctx_shmem.last_chunk_ns) {
+    rctx_shmem.wakeups++;
+    usleep(shmem_poll_delay);
+    if (!chunk_ready()) return 1;
+    rctx_shmem.last_chunk_ns = now_ns();
+    return 0;
+  }
+
+  period_ns = header->chunk_size * 1000000000LL / bytes_per_sec;
+  due_ns = rctx_shmem.last_chunk_ns + period_ns;
+  wake_ns = due_ns - rctx_shmem.spin_ns;
+  if (now_ns() < wake_ns) {
+    rctx_shmem.wakeups++;
+    wake.tv_sec = wake_ns / 1000000000LL;
+    wake.tv_nsec = wake_ns % 1000000000LL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) == EINTR);
+    if (chunk_ready()) {
+      // Already there, so we don't know when it came: we woke up too late
+      // (timer slack, or the pace was set by a late detection). Wake up
+      // earlier next time, by twice as much each time in a row.
+      rctx_shmem.last_chunk_ns = due_ns - (rctx_shmem.spin_ns << rctx_shmem.early);
+      if ((rctx_shmem.spin_ns << (rctx_shmem.early + 1)) < period_ns / 4) rctx_shmem.early++;
+      return 0;
+    }
+  }
+
+  while (!chunk_ready()) {
+    now = now_ns();
+    if (now >= due_ns + period_ns / 2) {
+      rctx_shmem.last_chunk_ns = 0;
+      rctx_shmem.misses++;
+      return 1;
+    }
+    if (now < due_ns + rctx_shmem.spin_ns) {
+      // the guest's vCPU may be waiting for this core
+      sched_yield();
+    }
+    else {
+      rctx_shmem.wakeups++;
+      usleep(rctx_shmem.spin_ns / 1000);
+    }
+  }
+  rctx_shmem.last_chunk_ns = now_ns();
+  rctx_shmem.early = 0;
+  return 0;
+}
+
+static unsigned int stream_rate(const struct shmheader *header)
+{
+  return ((header->sample_rate >= 128) ? 44100 : 48000) * (header->sample_rate % 128);
+}
+
+static void shmem_report(const struct timespec *since)
+{
+  double elapsed = (rctx_shmem.stats.last_report.tv_sec - since->tv_sec)
+    + (rctx_shmem.stats.last_report.tv_nsec - since->tv_nsec) / 1e9;
+
+  fprintf(stderr, "shmem: %.0f wakeups/s, %llu doorbells, %llu missed deadlines, %llu overwritten, %llu torn\n",
+    elapsed > 0 ? rctx_shmem.wakeups / elapsed : 0.0, (unsigned long long)rctx_shmem.doorbells,
+    (unsigned long long)rctx_shmem.misses, (unsigned long long)rctx_shmem.overwritten,
+    (unsigned long long)rctx_shmem.torn);
+  rctx_shmem.wakeups = 0;
+  rctx_shmem.doorbells = 0;
+  rctx_shmem.misses = 0;
+  rctx_shmem.overwritten = 0;
+  rctx_shmem.torn = 0;
+
+  fprintf(stderr, "shmem backlog: mean %.2f, max %u chunks, %.1f ms caught up, %llu skips\n",
+    rctx_shmem.chunks ? (double)rctx_shmem.backlog_sum / rctx_shmem.chunks : 0.0, rctx_shmem.backlog_max,
+    stream_rate(&rctx_shmem.layout) ? rctx_shmem.dropped * 1000.0 / stream_rate(&rctx_shmem.layout) : 0.0,
+    (unsigned long long)rctx_shmem.skips);
+  rctx_shmem.chunks = 0;
+  rctx_shmem.backlog_sum = 0;
+  rctx_shmem.backlog_max = 0;
+  rctx_shmem.dropped = 0;
+  rctx_shmem.skips = 0;
+}
+
+// The header describes chunks that lie within the shared memory
+static int layout_valid(const struct shmheader *header)
+{
+  size_t end;
+
+  if (header->chunk_size == 0 || header->write_idx >= header->max_chunks || header->offset < SHMEM_V1_HEADER_SIZE
+      || header->channels == 0 || header->channel_map == 0)
+    return 0;
+  if (shmem_version(header) >= 2)
+    end = shmem_tags_offset(header) + header->max_chunks * sizeof(struct shmchunk_tag);
+  else
+    end = header->offset + (size_t)header->chunk_size * header->max_chunks;
+  return end <= rctx_shmem.size;
+}
+
+// The guest has set up a new stream
+static int layout_changed(const struct shmheader *a, const struct shmheader *b)
+{
+  if (shmem_version(a) != shmem_version(b)
+      || (shmem_version(a) >= 2 && a->generation != b->generation))
+    return 1;
+  return a->offset != b->offset || a->max_chunks != b->max_chunks || a->chunk_size != b->chunk_size
+    || a->sample_rate != b->sample_rate || a->sample_size != b->sample_size
+    || a->channels != b->channels || a->channel_map != b->channel_map;
+}
+
+// Samples left aligned in 32 bits
+static int64_t frame_sample(const unsigned char *p, unsigned int bytes)
+{
+  switch (bytes) {
+    case 2: return (int32_t)((uint32_t)p[0] << 16 | (uint32_t)p[1] << 24);
+    case 3: return (int32_t)((uint32_t)p[0] << 8 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 24);
+    default: return (int32_t)((uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+  }
+}
+
+// How audible dropping frame <f> is: its level, and the step between the
+// frames it leaves next to each other
+static int64_t drop_cost(const unsigned char *audio, unsigned int f, unsigned int bytes, unsigned int channels)
+{
+  unsigned int frame_size = bytes * channels, c;
+  const unsigned char *p = audio + f * frame_size;
+  int64_t cost = 0;
+
+  for (c = 0; c < channels; c++, p += bytes) {
+    cost += llabs(frame_sample(p, bytes))
+      + llabs(frame_sample(p + frame_size, bytes) - frame_sample(p - frame_size, bytes));
+  }
+  return cost;
+}
+
+// Version 2: whether a chunk still has the tag it was read with, after
+// reading it. A new stream moves the chunks, and may overwrite this one
+// without touching its tag, so the header must not have changed either.
+static int chunk_intact(const struct shmchunk_tag *tag, const struct shmchunk_tag *read)
+{
+  struct shmheader *live = (struct shmheader*)rctx_shmem.mmap;
+
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(&live->generation, __ATOMIC_RELAXED) == read->generation
+    && __atomic_load_n(&tag->seq, __ATOMIC_RELAXED) == read->seq && tag->generation == read->generation;
+}
+
+// Copies the chunk with one frame in every SHMEM_CATCHUP_FRAMES dropped,
+// where the audio is quietest and smoothest, so the playout speeds up by
+// about 1.6% without skipping audio. Returns the size of the copy, 0 if the
+// sample size isn't supported.
+static size_t catch_up(const unsigned char *audio, const struct shmheader *header)
+{
+  unsigned int bytes = header->sample_size / 8;
+  unsigned int frame_size = bytes * header->channels;
+  unsigned int frames, start, end, f, drop;
+  unsigned char *copy;
+  size_t size = 0;
+  int64_t cost, best;
+
+  if (header->sample_size != 16 && header->sample_size != 24 && header->sample_size != 32) return 0;
+  if (rctx_shmem.catchup_size < header->chunk_size) {
+    copy = realloc(rctx_shmem.catchup, header->chunk_size);
+    if (!copy) return 0;
+    rctx_shmem.catchup = copy;
+    rctx_shmem.catchup_size = header->chunk_size;
+  }
+
+  frames = header->chunk_size / frame_size;
+  for (start = 0; start + SHMEM_CATCHUP_FRAMES <= frames; start = end) {
+    end = start + SHMEM_CATCHUP_FRAMES;
+    // the first and last frame of the chunk lack a neighbour to compare with
+    drop = start ? start : 1;
+    best = INT64_MAX;
+    for (f = drop; f < end && f + 1 < frames; f++) {
+      cost = drop_cost(audio, f, bytes, header->channels);
+      if (cost < best) {
+        best = cost;
+        drop = f;
+      }
+    }
+    memcpy(rctx_shmem.catchup + size, audio + start * frame_size, (drop - start) * frame_size);
+    size += (drop - start) * frame_size;
+    memcpy(rctx_shmem.catchup + size, audio + (drop + 1) * frame_size, (end - drop - 1) * frame_size);
+    size += (end - drop - 1) * frame_size;
+    rctx_shmem.dropped++;
+  }
+  memcpy(rctx_shmem.catchup + size, audio + start * frame_size, header->chunk_size - start * frame_size);
+  return size + header->chunk_size - start * frame_size;
+}
+
+// Copies the chunk at read_idx out of the shared memory, so the output
+// plays it from a buffer the guest can't rewrite. NULL without memory.
+static unsigned char *copy_chunk(const struct shmheader *header)
+{
+  unsigned char *copy;
+
+  if (rctx_shmem.copy_size < header->chunk_size) {
+    copy = realloc(rctx_shmem.copy, header->chunk_size);
+    if (!copy) {
+      perror("Failed to allocate the shared memory chunk copy");
+      return NULL;
+    }
+    rctx_shmem.copy = copy;
+    rctx_shmem.copy_size = header->chunk_size;
+  }
+  memcpy(rctx_shmem.copy, &rctx_shmem.mmap[header->offset + (size_t)header->chunk_size * rctx_shmem.read_idx],
+    header->chunk_size);
+  return rctx_shmem.copy;
+}
+
+// Chunks found rewritten while they were copied, and dropped (since the
+// last -v -v report), for ivshmem-stub -x
+uint64_t shmem_torn_chunks()
+{
+  return rctx_shmem.torn;
+}
+
+int rcv_shmem(receiver_data_t* receiver_data, int max_packets)
+{
+  struct shmheader *live = (struct shmheader*)rctx_shmem.mmap;
+  struct shmheader *header = &rctx_shmem.header;
+  struct shmchunk_tag *tag;
+  struct shmchunk_tag read_tag = { 0, 0 };
+  struct timespec since;
+  unsigned char *audio;
+  unsigned int backlog;
+  size_t size;
+  int timed_out = 0;
+
+  (void)max_packets;  // one chunk per call
 
   int valid = 0;
   do {
-    if (header->magic != 0x11112014) {
-      while (header->magic != 0x11112014) {
-        usleep(10000);//10ms
-      }
+    // The guest clears the header (and with version 2 makes the generation
+    // odd) while it sets up a new stream. Only a consistent copy is used.
+    if (live->magic != SHMEM_MAGIC || shmem_read_header(live, header) != 0 || !layout_valid(header)) {
+      usleep(10000);//10ms
+      continue;
+    }
+    if (rctx_shmem.layout.magic != SHMEM_MAGIC) {
+      rctx_shmem.layout = *header;
       rctx_shmem.read_idx = header->write_idx;
       continue;
     }
+    // A new stream starts over at the first chunk, don't drop it
+    if (layout_changed(&rctx_shmem.layout, header)) {
+      rctx_shmem.layout = *header;
+      rctx_shmem.read_idx = 0;
+      continue;
+    }
+    // With several receivers, the first one gets rung and the others poll
+    if (rctx_shmem.doorbell_fd >= 0 && doorbell_free(live->doorbell_peer)) {
+      live->doorbell_peer = rctx_shmem.peer_id + 1;
+    }
     if (rctx_shmem.read_idx == header->write_idx) {
-      usleep(shmem_poll_delay);
+      if (rctx_shmem.doorbell_fd < 0)
+        timed_out = shmem_wait_deadline();
+      else
+        timed_out = shmem_wait();
       continue;
     }
-    if (header->channels == 0 || header->channel_map == 0)
+    // A guest that stops ringing (e.g. after a driver downgrade) costs one
+    // long wait, then polling takes over again
+    if (timed_out) rctx_shmem.ringing = 0;
+
+    if (++rctx_shmem.read_idx == header->max_chunks) {
+      rctx_shmem.read_idx = 0;
+    }
+    if(mod(header->write_idx-rctx_shmem.read_idx, header->max_chunks) > SHMEM_SKIP_CHUNKS){//too far behind to catch up, skip forward
+      rctx_shmem.read_idx = mod((header->write_idx-1), header->max_chunks);
+      rctx_shmem.skips++;
+    }
+
+    // Version 2: the chunk must be complete, and of the format we read it as
+    tag = (struct shmchunk_tag *)&rctx_shmem.mmap[shmem_tags_offset(header)] + rctx_shmem.read_idx;
+    if (shmem_version(header) >= 2) {
+      read_tag.seq = __atomic_load_n(&tag->seq, __ATOMIC_ACQUIRE);
+      read_tag.generation = tag->generation;
+      if (read_tag.seq == 0 || read_tag.generation != header->generation) {
+        rctx_shmem.overwritten++;
+        rctx_shmem.read_idx = header->write_idx;
+        continue;
+      }
+    }
+    // and the guest mustn't have started a new stream since the header was read
+    if (shmem_version(header) >= 2
+        && __atomic_load_n(&live->generation, __ATOMIC_ACQUIRE) != header->generation) {
       continue;
+    }
 
     valid = 1;
   } while (!valid);
 
-  if (++rctx_shmem.read_idx == header->max_chunks) {
-    rctx_shmem.read_idx = 0;
-  }
-
-  if(mod(header->write_idx-rctx_shmem.read_idx, header->max_chunks) > 3){//we are too far behind, skip forward
-    rctx_shmem.read_idx = mod((header->write_idx-1), header->max_chunks);
-  }
+  // Behind the guest (the output's clock is slower, or it stalled): play
+  // faster until the newest chunk is reached
+  backlog = mod(header->write_idx - rctx_shmem.read_idx, header->max_chunks);
+  if (backlog > SHMEM_CATCHUP_CHUNKS) rctx_shmem.catching_up = 1;
+  else if (backlog == 0) rctx_shmem.catching_up = 0;
+  rctx_shmem.chunks++;
+  rctx_shmem.backlog_sum += backlog;
+  if (backlog > rctx_shmem.backlog_max) rctx_shmem.backlog_max = backlog;
 
   receiver_data->format.sample_rate = header->sample_rate;
   receiver_data->format.sample_size = header->sample_size;
   receiver_data->format.channels = header->channels;
   receiver_data->format.channel_map = header->channel_map;
 
+  audio = copy_chunk(header);
+  if (!audio) return 0;
+  // the copy is only good if the guest didn't rewrite the chunk meanwhile
+  if (shmem_version(header) >= 2 && !chunk_intact(tag, &read_tag)) {
+    rctx_shmem.torn++;
+    rctx_shmem.read_idx = header->write_idx;
+    return 0;
+  }
   receiver_data->audio_size = header->chunk_size;
-  receiver_data->audio = &rctx_shmem.mmap[header->offset+header->chunk_size*rctx_shmem.read_idx];
-}
+  receiver_data->audio = audio;
+  if (rctx_shmem.catching_up && (size = catch_up(audio, header)) != 0) {
+    receiver_data->audio_size = size;
+    receiver_data->audio = rctx_shmem.catchup;
+  }
+  receiver_data->buf = NULL;
+  receiver_data->flags = 0;
+  receiver_data->src_addr = 0;
+  receiver_data->src_port = 0;
+  clock_gettime(CLOCK_MONOTONIC, &receiver_data->arrival);
 
+  since = rctx_shmem.stats.last_report;
+  if (stats_batch(&rctx_shmem.stats, 1)) shmem_report(&since);
+
+  return 1;
+}
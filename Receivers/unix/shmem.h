@@ -4,6 +4,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stddef.h>
+#include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 
@@ -11,6 +13,22 @@
 #include <sys/mman.h>
 
 #include "scream.h"
+#include "stats.h"
+
+#define SHMEM_MAGIC 0x11112014
+#define SHMEM_EXT_MAGIC 0x32524353  // "SCR2", version 2 of the layout
+// Without a doorbell, the window spun in around the time the next chunk is
+// due, unless set with -B
+#define SHMEM_SPIN_US 100
+// Longest wait for the doorbell once the guest rings it
+#define SHMEM_DOORBELL_TIMEOUT_MS 100
+// With more chunks than this waiting, the chunks are played a little faster
+// until the reader has caught up with the guest
+#define SHMEM_CATCHUP_CHUNKS 1
+// One frame in this many is dropped while catching up
+#define SHMEM_CATCHUP_FRAMES 64
+// With more chunks than this waiting, the reader skips to the newest one
+#define SHMEM_SKIP_CHUNKS 3
 
 struct shmheader {
   uint32_t magic;
@@ -22,14 +40,101 @@ struct shmheader {
   uint8_t  sample_size;
   uint8_t  channels;
   uint16_t channel_map;
+  // Written by the receiver: its ivshmem-server peer ID + 1, for the guest
+  // to ring its doorbell after each chunk. 0 if nobody listens. Takes the
+  // padding at the end of the header, so the chunks don't move.
+  uint16_t doorbell_peer;
+  // Version 2, if <offset> leaves room for it and <ext_magic> is set. Older
+  // drivers put the first chunk here.
+  uint32_t ext_magic;
+  uint16_t version;
+  uint16_t reserved;
+  // Seqlock: odd while the guest rewrites the header for a new format
+  uint32_t generation;
+};
+
+#define SHMEM_V1_HEADER_SIZE offsetof(struct shmheader, ext_magic)
+
+// Version 2: after the chunks (8 byte aligned), a tag for each chunk
+struct shmchunk_tag {
+  uint32_t seq;         // 0 while the chunk is written, then its sequence number
+  uint32_t generation;  // of the header (format) the chunk was written for
 };
 
+static inline int shmem_version(const struct shmheader *header)
+{
+  if (header->offset < sizeof(struct shmheader) || header->ext_magic != SHMEM_EXT_MAGIC) return 1;
+  return header->version;
+}
+
+static inline size_t shmem_tags_offset(const struct shmheader *header)
+{
+  return (header->offset + (size_t)header->chunk_size * header->max_chunks + 7) & ~(size_t)7;
+}
+
+// Copies the live header. A version 2 header is read like a seqlock: the
+// copy is only good if the generation was even and didn't change meanwhile.
+// A version 1 header is read twice, ignoring write_idx and doorbell_peer,
+// which change all the time. Returns 1 while the guest rewrites the header.
+static inline int shmem_read_header(const struct shmheader *live, struct shmheader *copy)
+{
+  struct shmheader again;
+  uint32_t generation = __atomic_load_n(&live->generation, __ATOMIC_ACQUIRE);
+
+  memcpy(copy, live, sizeof(*copy));
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  if (shmem_version(copy) >= 2) {
+    return (generation & 1) || copy->generation != generation
+      || __atomic_load_n(&live->generation, __ATOMIC_RELAXED) != generation;
+  }
+  memcpy(&again, live, SHMEM_V1_HEADER_SIZE);
+  again.write_idx = copy->write_idx;
+  again.doorbell_peer = copy->doorbell_peer;
+  return memcmp(copy, &again, SHMEM_V1_HEADER_SIZE) != 0;
+}
+
 typedef struct rctx_shmem {
   unsigned char* mmap;
+  size_t size;
+  struct shmheader header;  // consistent copy of the live header
+  struct shmheader layout;  // the one the chunks are read with
   uint16_t read_idx;
+  // ivshmem-doorbell: the eventfd of our interrupt vector 0, -1 with a
+  // plain shared memory file
+  int doorbell_fd;
+  int server_fd;
+  int epoll_fd;
+  int64_t peer_id;
+  // the ivshmem-server peers connected, a bit per ID
+  uint8_t live_peers[(UINT16_MAX + 1) / 8];
+  int ringing;  // the guest rings the doorbell
+  // Without a doorbell: sleep until shortly before the next chunk is due,
+  // then spin for up to twice this long (-B)
+  int64_t spin_ns;
+  int64_t last_chunk_ns;  // when the newest chunk came
+  int early;              // doubles the correction of a late wakeup
+  uint64_t wakeups;
+  uint64_t doorbells;
+  uint64_t misses;  // chunks that didn't come within the spin window
+  uint64_t overwritten;  // version 2: chunks the guest rewrote before we got to them
+  uint64_t torn;         // version 2: chunks it rewrote while they were copied
+  // The chunk handed out, copied out of the shared memory
+  unsigned char *copy;
+  size_t copy_size;
+  // Falling behind: a copy of the chunk with frames dropped
+  unsigned char *catchup;
+  size_t catchup_size;
+  int catching_up;
+  uint64_t chunks;
+  uint64_t backlog_sum;  // chunks waiting after each chunk read
+  unsigned int backlog_max;
+  uint64_t dropped;      // frames
+  uint64_t skips;
+  ingest_stats_t stats;
 } rctx_shmem_t;
 
-int init_shmem(char* shmem_device_file, int target_latency_ms);
-void rcv_shmem(receiver_data_t* receiver_data);
+int init_shmem(char* shmem_device_file, int target_latency_ms, int busy_poll_us);
+int rcv_shmem(receiver_data_t* receiver_data, int max_packets);
+uint64_t shmem_torn_chunks();
 
 #endif
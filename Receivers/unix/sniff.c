@@ -0,0 +1,45 @@
+#include "sniff.h"
+#include "network.h"
+
+// Locates the Scream packet in an Ethernet frame and parses it in place.
+// Returns 0 for anything but unfragmented UDP/IPv4 to or from <port>.
+int parse_frame(receiver_data_t* receiver_data, unsigned char* pkg, unsigned int caplen, int port)
+{
+  const struct sniff_ethernet *ethernet;  /* The ethernet header */
+
+  if (caplen < SIZE_ETHERNET) return 0;
+
+  ethernet = (struct sniff_ethernet*)(pkg);
+  if (ntohs(ethernet->ether_type) != ETHERTYPE_IPV4) return 0;
+
+  return parse_ip(receiver_data, pkg + SIZE_ETHERNET, caplen - SIZE_ETHERNET, port);
+}
+
+// The IPv4 packet of a frame, whatever link layer header came before it
+int parse_ip(receiver_data_t* receiver_data, unsigned char* pkg, unsigned int caplen, int port)
+{
+  const struct sniff_ip *ip;              /* The IP header */
+  const struct sniff_udp *udp;            /* The UDP header */
+  unsigned int size_ip;
+  unsigned int size_payload;
+
+  if (caplen < 20 + 8) return 0;
+
+  ip = (struct sniff_ip*)(pkg);
+  size_ip = IP_HL(ip) * 4;
+  if (IP_V(ip) != 4 || size_ip < 20 || ip->ip_p != IPPROTO_UDP) return 0;
+  if (ntohs(ip->ip_off) & (IP_MF | IP_OFFMASK)) return 0;
+  // the IP header may have options, and the length may be made up
+  if (caplen < size_ip + 8 || ntohs(ip->ip_len) < size_ip + 8) return 0;
+
+  udp = (struct sniff_udp*)(pkg + size_ip);
+  if (ntohs(udp->uh_dport) != port && ntohs(udp->uh_sport) != port) return 0;
+
+  size_payload = ntohs(ip->ip_len) - (size_ip + 8);
+  if (size_ip + 8 + size_payload > caplen) return 0;
+
+  if (!parse_packet(receiver_data, pkg + size_ip + 8, size_payload)) return 0;
+  receiver_data->src_addr = ip->ip_src.s_addr;
+  receiver_data->src_port = udp->uh_sport;
+  return 1;
+}
@@ -0,0 +1,50 @@
+#ifndef SNIFF_H
+#define SNIFF_H
+
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#include "scream.h"
+
+#define SIZE_ETHERNET 14
+#define ETHERTYPE_IPV4 0x0800
+
+/* Ethernet addresses are 6 bytes */
+#define ETHER_ADDR_LEN	6
+
+
+struct sniff_ethernet {
+    u_char ether_dhost[ETHER_ADDR_LEN]; /* Destination host address */
+    u_char ether_shost[ETHER_ADDR_LEN]; /* Source host address */
+    u_short ether_type;                 /* IP? ARP? RARP? etc */
+};
+
+struct sniff_ip {
+    u_char ip_vhl;      /* version << 4 | header length >> 2 */
+    u_char ip_tos;      /* type of service */
+    u_short ip_len;     /* total length */
+    u_short ip_id;      /* identification */
+    u_short ip_off;     /* fragment offset field */
+#define IP_RF 0x8000        /* reserved fragment flag */
+#define IP_DF 0x4000        /* dont fragment flag */
+#define IP_MF 0x2000        /* more fragments flag */
+#define IP_OFFMASK 0x1fff   /* mask for fragmenting bits */
+    u_char ip_ttl;      /* time to live */
+    u_char ip_p;        /* protocol */
+    u_short ip_sum;     /* checksum */
+    struct in_addr ip_src,ip_dst; /* source and dest address */
+};
+#define IP_HL(ip)       (((ip)->ip_vhl) & 0x0f)
+#define IP_V(ip)        (((ip)->ip_vhl) >> 4)
+
+struct sniff_udp {
+    u_short uh_sport;               /* source port */
+    u_short uh_dport;               /* destination port */
+    u_short uh_ulen;                /* udp length */
+    u_short uh_sum;                 /* udp checksum */
+};
+
+int parse_frame(receiver_data_t* receiver_data, unsigned char* pkg, unsigned int caplen, int port);
+int parse_ip(receiver_data_t* receiver_data, unsigned char* pkg, unsigned int caplen, int port);
+
+#endif
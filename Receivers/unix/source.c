@@ -0,0 +1,230 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "source.h"
+#include "stats.h"
+
+static rctx_source_t rctx_source;
+
+static int source_parse_lock(const char *lock, size_t len)
+{
+  char addr[INET_ADDRSTRLEN];
+  const char *colon = memchr(lock, ':', len);
+  struct in_addr in;
+  size_t addr_len = colon ? (size_t)(colon - lock) : len;
+  int port = 0;
+
+  if (colon) {
+    port = atoi(colon + 1);
+    if (port <= 0 || port > 0xffff) return 1;
+  }
+  if (addr_len >= sizeof(addr) || rctx_source.locked >= MAX_SOURCES) return 1;
+  memcpy(addr, lock, addr_len);
+  addr[addr_len] = 0;
+  if (inet_pton(AF_INET, addr, &in) != 1) return 1;
+
+  rctx_source.lock_addr[rctx_source.locked] = in.s_addr;
+  rctx_source.lock_port[rctx_source.locked] = htons(port);
+  rctx_source.locked++;
+  return 0;
+}
+
+// <lock> is a comma separated list of "address" or "address:port", or
+// NULL to play whichever sender comes first. Returns 1 if it can't be
+// parsed.
+int source_init(const char *lock, int failover_ms)
+{
+  const char *comma;
+  size_t len;
+
+  memset(&rctx_source, 0, sizeof(rctx_source));
+  rctx_source.failover_ns = failover_ms * 1000000LL;
+  clock_gettime(CLOCK_MONOTONIC, &rctx_source.last_report);
+  if (!lock) return 0;
+
+  for (;;) {
+    comma = strchr(lock, ',');
+    len = comma ? (size_t)(comma - lock) : strlen(lock);
+    if (source_parse_lock(lock, len) != 0) {
+      fprintf(stderr, "Invalid sender: %.*s\n", (int)len, lock);
+      return 1;
+    }
+    if (!comma) return 0;
+    lock = comma + 1;
+  }
+}
+
+// The distinct addresses of the senders given with -S, for source
+// specific multicast joins. <addrs> has room for MAX_SOURCES.
+unsigned int source_lock_addrs(uint32_t *addrs)
+{
+  unsigned int i, j, n = 0;
+
+  for (i = 0; i < rctx_source.locked; i++) {
+    for (j = 0; j < n && addrs[j] != rctx_source.lock_addr[i]; j++);
+    if (j == n) addrs[n++] = rctx_source.lock_addr[i];
+  }
+  return n;
+}
+
+static const char *source_name(uint32_t addr, uint16_t port)
+{
+  static __thread char name[INET_ADDRSTRLEN + 6];
+  char ip[INET_ADDRSTRLEN];
+
+  inet_ntop(AF_INET, &addr, ip, sizeof(ip));
+  snprintf(name, sizeof(name), "%s:%u", ip, ntohs(port));
+  return name;
+}
+
+// Called by the thread receiving the sender playing
+static void source_report()
+{
+  struct timespec now;
+  uint64_t ignored = 0;
+  unsigned int senders = 0, i;
+  uint64_t active;
+
+  if (verbosity < 2) return;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (now.tv_sec - rctx_source.last_report.tv_sec < STATS_INTERVAL) return;
+
+  // the other workers' counters, as far as they have got
+  for (i = 0; i < MAX_WORKERS; i++) {
+    senders += __atomic_load_n(&rctx_source.tables[i].used, __ATOMIC_RELAXED);
+    ignored += __atomic_load_n(&rctx_source.tables[i].ignored, __ATOMIC_RELAXED);
+  }
+  active = __atomic_load_n(&rctx_source.active, __ATOMIC_RELAXED);
+  fprintf(stderr, "source: %u senders, playing %s, %llu switches, %llu packets from others ignored\n",
+    senders, source_name(active >> 16, active & 0xffff),
+    (unsigned long long)__atomic_load_n(&rctx_source.switches, __ATOMIC_RELAXED), (unsigned long long)ignored);
+  rctx_source.last_report = now;
+}
+
+static unsigned int source_hash(uint32_t addr, uint16_t port)
+{
+  return ((addr ^ ((uint32_t)port << 16)) * 2654435761u) >> (32 - SOURCE_BITS);
+}
+
+static source_entry_t *source_find(source_table_t *table, uint32_t addr, uint16_t port, int insert)
+{
+  unsigned int i = source_hash(addr, port);
+  source_entry_t *e;
+
+  for (;; i = (i + 1) & (SOURCE_SLOTS - 1)) {
+    e = &table->entries[i];
+    if (!e->used) break;
+    if (e->addr == addr && e->port == port) return e;
+  }
+  if (!insert) return NULL;
+
+  memset(e, 0, sizeof(*e));
+  e->used = 1;
+  e->addr = addr;
+  e->port = port;
+  __atomic_store_n(&table->used, table->used + 1, __ATOMIC_RELAXED);
+  return e;
+}
+
+// Probing stops at the first free slot, so entries can't simply be
+// cleared. Senders gone quiet are dropped by rebuilding the table.
+static void source_expire(source_table_t *table, int64_t now_ns)
+{
+  source_entry_t old[SOURCE_SLOTS];
+  uint64_t active = __atomic_load_n(&rctx_source.active, __ATOMIC_RELAXED);
+  int i;
+
+  memcpy(old, table->entries, sizeof(old));
+  memset(table->entries, 0, sizeof(table->entries));
+  __atomic_store_n(&table->used, 0, __ATOMIC_RELAXED);
+  for (i = 0; i < SOURCE_SLOTS; i++) {
+    if (!old[i].used) continue;
+    if (now_ns - old[i].last_seen_ns > SOURCE_EXPIRE_S * 1000000000LL
+        && SOURCE_KEY(old[i].addr, old[i].port) != active)
+      continue;
+    *source_find(table, old[i].addr, old[i].port, 1) = old[i];
+  }
+}
+
+static int source_is_locked(uint32_t addr, uint16_t port)
+{
+  unsigned int i;
+
+  for (i = 0; i < rctx_source.locked; i++) {
+    if (addr == rctx_source.lock_addr[i] && (!rctx_source.lock_port[i] || port == rctx_source.lock_port[i]))
+      return 1;
+  }
+  return 0;
+}
+
+// Keeps track of the senders of a stream, and picks the one to play: the
+// first one heard, until it has been silent for the failover timeout. Any
+// other sender can then take over. Returns 0 for the packets of the
+// others, so several guests can share one group and port without being
+// mixed up. Each receive thread passes its own <table>.
+int source_check(receiver_data_t* receiver_data, unsigned int table)
+{
+  source_table_t *t = &rctx_source.tables[table];
+  uint64_t key = SOURCE_KEY(receiver_data->src_addr, receiver_data->src_port);
+  uint64_t active;
+  struct timespec now;
+  int64_t now_ns;
+  source_entry_t *e;
+
+  if (rctx_source.locked && !source_is_locked(receiver_data->src_addr, receiver_data->src_port)) {
+    __atomic_store_n(&t->ignored, t->ignored + 1, __ATOMIC_RELAXED);
+    return 0;
+  }
+
+  // a coarse clock is fine for timeouts this long, and cheap per packet
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+  now_ns = now.tv_sec * 1000000000LL + now.tv_nsec;
+
+  e = source_find(t, receiver_data->src_addr, receiver_data->src_port, 0);
+  if (!e) {
+    // keep a free slot, so that probing always terminates
+    if (t->used >= SOURCE_SLOTS - 1) source_expire(t, now_ns);
+    if (t->used >= SOURCE_SLOTS - 1) {
+      __atomic_store_n(&t->ignored, t->ignored + 1, __ATOMIC_RELAXED);
+      return 0;
+    }
+    e = source_find(t, receiver_data->src_addr, receiver_data->src_port, 1);
+    if (verbosity) fprintf(stderr, "New sender %s\n", source_name(e->addr, e->port));
+  }
+  e->last_seen_ns = now_ns;
+  e->packets++;
+  e->format = receiver_data->format;
+
+  active = __atomic_load_n(&rctx_source.active, __ATOMIC_ACQUIRE);
+  if (key == active) {
+    // the coarse clock ticks every few ms, spare the other workers most
+    // of the cache line transfers
+    if (__atomic_load_n(&rctx_source.active_seen_ns, __ATOMIC_RELAXED) != now_ns)
+      __atomic_store_n(&rctx_source.active_seen_ns, now_ns, __ATOMIC_RELAXED);
+    source_report();
+    return 1;
+  }
+
+  if (active && now_ns - __atomic_load_n(&rctx_source.active_seen_ns, __ATOMIC_RELAXED) < rctx_source.failover_ns) {
+    __atomic_store_n(&t->ignored, t->ignored + 1, __ATOMIC_RELAXED);
+    return 0;
+  }
+
+  // Stamp first, so no other worker sees the new sender with the old
+  // one's time. Another worker may be taking over at the same time.
+  __atomic_store_n(&rctx_source.active_seen_ns, now_ns, __ATOMIC_RELAXED);
+  if (!__atomic_compare_exchange_n(&rctx_source.active, &active, key, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    __atomic_store_n(&t->ignored, t->ignored + 1, __ATOMIC_RELAXED);
+    return 0;
+  }
+
+  if (active) __atomic_fetch_add(&rctx_source.switches, 1, __ATOMIC_RELAXED);
+  if (verbosity) {
+    fprintf(stderr, "Playing sender %s (%u channels, %u bits)\n", source_name(e->addr, e->port),
+      e->format.channels, e->format.sample_size);
+  }
+  return 1;
+}
@@ -0,0 +1,57 @@
+#ifndef SOURCE_H
+#define SOURCE_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "scream.h"
+
+#define SOURCE_BITS 5
+#define SOURCE_SLOTS (1 << SOURCE_BITS)  // open addressed, linear probing
+#define SOURCE_EXPIRE_S 60                // senders quiet for longer are forgotten
+#define DEFAULT_FAILOVER_MS 1000
+
+#define SOURCE_KEY(addr, port) ((1ULL << 48) | ((uint64_t)(addr) << 16) | (port))
+
+typedef struct source_entry {
+  int used;
+  uint32_t addr;   // network byte order, as in receiver_data_t
+  uint16_t port;
+  receiver_format_t format;
+  int64_t last_seen_ns;
+  uint64_t packets;
+} source_entry_t;
+
+// The senders one receive thread has seen. With -w, every worker keeps
+// its own, as each sender is received by one worker only.
+typedef struct source_table {
+  source_entry_t entries[SOURCE_SLOTS];
+  unsigned int used;
+  uint64_t ignored;
+} __attribute__((aligned(CACHE_LINE))) source_table_t;
+
+typedef struct rctx_source {
+  source_table_t tables[MAX_WORKERS];
+
+  // The sender playing (SOURCE_KEY(), 0 before the first packet) and the
+  // last time it was heard. Shared between the workers: only the one
+  // receiving that sender writes active_seen_ns, a sender taking over
+  // replaces active with a compare and swap.
+  uint64_t active __attribute__((aligned(CACHE_LINE)));
+  int64_t active_seen_ns;
+
+  // with -S, only these senders are played (port 0: any port)
+  unsigned int locked;
+  uint32_t lock_addr[MAX_SOURCES];
+  uint16_t lock_port[MAX_SOURCES];
+  int64_t failover_ns;
+
+  uint64_t switches;
+  struct timespec last_report;
+} rctx_source_t;
+
+int source_init(const char *lock, int failover_ms);
+unsigned int source_lock_addrs(uint32_t *addrs);
+int source_check(receiver_data_t* receiver_data, unsigned int table);
+
+#endif
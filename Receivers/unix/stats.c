@@ -0,0 +1,117 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#include "stats.h"
+
+#ifdef RUSAGE_THREAD
+#define STATS_RUSAGE RUSAGE_THREAD
+#else
+#define STATS_RUSAGE RUSAGE_SELF
+#endif
+
+static void cpu_time(struct timeval *tv)
+{
+  struct rusage ru;
+
+  getrusage(STATS_RUSAGE, &ru);
+  timeradd(&ru.ru_utime, &ru.ru_stime, tv);
+}
+
+void stats_init(ingest_stats_t *stats, const char *name)
+{
+  memset(stats, 0, sizeof(ingest_stats_t));
+  stats->name = name;
+  clock_gettime(CLOCK_MONOTONIC, &stats->last_report);
+  cpu_time(&stats->last_cpu);
+}
+
+// Account one receive call that returned <packets> packets. Prints and
+// resets the interval counters every STATS_INTERVAL seconds when running
+// with -v -v. Returns 1 if a report was printed, so callers can append
+// their own counters.
+int stats_batch(ingest_stats_t *stats, unsigned int packets)
+{
+  struct timespec now;
+  struct timeval cpu, used;
+  double elapsed, cpu_us;
+  int bucket = 0;
+
+  stats->calls++;
+  stats->packets += packets;
+  while (bucket < STATS_HIST_BUCKETS - 1 && (packets >> (bucket + 1)))
+    bucket++;
+  stats->batch_hist[bucket]++;
+
+  if (verbosity < 2) return 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  elapsed = (now.tv_sec - stats->last_report.tv_sec) + (now.tv_nsec - stats->last_report.tv_nsec) / 1e9;
+  if (elapsed < STATS_INTERVAL) return 0;
+
+  cpu_time(&cpu);
+  timersub(&cpu, &stats->last_cpu, &used);
+  cpu_us = used.tv_sec * 1e6 + used.tv_usec;
+
+  fprintf(stderr, "%s: %.0f pkts/s, %.0f calls/s, %.2f pkts/call, %.2f us CPU/pkt",
+    stats->name,
+    stats->packets / elapsed,
+    stats->calls / elapsed,
+    stats->calls ? (double)stats->packets / stats->calls : 0.0,
+    stats->packets ? cpu_us / stats->packets : 0.0);
+  if (stats->count_drops)
+    fprintf(stderr, ", %llu dropped by the kernel", (unsigned long long)stats->drops);
+  fprintf(stderr, "\n");
+  fprintf(stderr, "%s: batch sizes 1:%llu 2-3:%llu 4-7:%llu 8-15:%llu 16-31:%llu 32-63:%llu 64-127:%llu 128+:%llu\n",
+    stats->name,
+    (unsigned long long)stats->batch_hist[0], (unsigned long long)stats->batch_hist[1],
+    (unsigned long long)stats->batch_hist[2], (unsigned long long)stats->batch_hist[3],
+    (unsigned long long)stats->batch_hist[4], (unsigned long long)stats->batch_hist[5],
+    (unsigned long long)stats->batch_hist[6], (unsigned long long)stats->batch_hist[7]);
+
+  stats->calls = 0;
+  stats->packets = 0;
+  stats->drops = 0;
+  memset(stats->batch_hist, 0, sizeof(stats->batch_hist));
+  stats->last_report = now;
+  stats->last_cpu = cpu;
+  return 1;
+}
+
+void stats_delay_init(delay_stats_t *stats, const char *name)
+{
+  memset(stats, 0, sizeof(delay_stats_t));
+  stats->name = name;
+  stats->min_ns = INT64_MAX;
+  clock_gettime(CLOCK_MONOTONIC, &stats->last_report);
+}
+
+// Account the delay of one packet, from its receiver_data_t arrival time
+// until now. Prints and resets every STATS_INTERVAL seconds when running
+// with -v -v, and returns 1 then.
+int stats_delay(delay_stats_t *stats, const struct timespec *arrival)
+{
+  struct timespec now;
+  int64_t delay;
+
+  if (verbosity < 2) return 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  delay = (now.tv_sec - arrival->tv_sec) * 1000000000LL + (now.tv_nsec - arrival->tv_nsec);
+  stats->packets++;
+  stats->sum_ns += delay;
+  if (delay < stats->min_ns) stats->min_ns = delay;
+  if (delay > stats->max_ns) stats->max_ns = delay;
+
+  if (now.tv_sec - stats->last_report.tv_sec < STATS_INTERVAL) return 0;
+
+  fprintf(stderr, "%s: %.3f ms min, %.3f ms avg, %.3f ms max since arrival\n",
+    stats->name, stats->min_ns / 1e6, stats->sum_ns / 1e6 / stats->packets, stats->max_ns / 1e6);
+
+  stats->packets = 0;
+  stats->sum_ns = 0;
+  stats->min_ns = INT64_MAX;
+  stats->max_ns = 0;
+  stats->last_report = now;
+  return 1;
+}
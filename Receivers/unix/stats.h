@@ -0,0 +1,42 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "scream.h"
+
+// Seconds between two periodic stats lines (printed with -v -v)
+#define STATS_INTERVAL 10
+
+// Batch size histogram buckets: 1, 2-3, 4-7, 8-15, 16-31, 32-63, 64-127, 128+
+#define STATS_HIST_BUCKETS 8
+
+typedef struct ingest_stats {
+  const char *name;
+  struct timespec last_report;
+  struct timeval last_cpu;
+  uint64_t calls;
+  uint64_t packets;
+  uint64_t batch_hist[STATS_HIST_BUCKETS];
+  int count_drops;  // the engine knows about datagrams the kernel dropped
+  uint64_t drops;
+} ingest_stats_t;
+
+// Time from a packet's arrival on the host to a point in the pipeline
+typedef struct delay_stats {
+  const char *name;
+  struct timespec last_report;
+  uint64_t packets;
+  int64_t sum_ns;
+  int64_t min_ns;
+  int64_t max_ns;
+} delay_stats_t;
+
+void stats_init(ingest_stats_t *stats, const char *name);
+int stats_batch(ingest_stats_t *stats, unsigned int packets);
+void stats_delay_init(delay_stats_t *stats, const char *name);
+int stats_delay(delay_stats_t *stats, const struct timespec *arrival);
+
+#endif
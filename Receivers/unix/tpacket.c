@@ -0,0 +1,209 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <net/if.h>
+#include <sys/mman.h>
+#include <linux/filter.h>
+#include <linux/if_ether.h>
+
+#include "tpacket.h"
+
+static rctx_tpacket_t rctx_tpacket;
+
+// Kernel side equivalent of the "udp port <port>" libpcap filter, so only
+// Scream traffic is copied into the ring.
+static int attach_filter(int sockfd, int port)
+{
+  struct sock_filter code[] = {
+    BPF_STMT(BPF_LD  | BPF_H   | BPF_ABS, 12),                  // ether type
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,   ETHERTYPE_IPV4, 0, 10),
+    BPF_STMT(BPF_LD  | BPF_B   | BPF_ABS, 23),                  // ip protocol
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,   IPPROTO_UDP, 0, 8),
+    BPF_STMT(BPF_LD  | BPF_H   | BPF_ABS, 20),                  // fragment offset
+    BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K,  IP_OFFMASK, 6, 0),
+    BPF_STMT(BPF_LDX | BPF_B   | BPF_MSH, SIZE_ETHERNET),       // ip header length
+    BPF_STMT(BPF_LD  | BPF_H   | BPF_IND, SIZE_ETHERNET + 2),   // udp destination port
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,   port, 2, 0),
+    BPF_STMT(BPF_LD  | BPF_H   | BPF_IND, SIZE_ETHERNET),       // udp source port
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,   port, 0, 1),
+    BPF_STMT(BPF_RET | BPF_K, 0x40000),
+    BPF_STMT(BPF_RET | BPF_K, 0),
+  };
+  struct sock_fprog prog = { sizeof(code) / sizeof(code[0]), code };
+
+  return setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog));
+}
+
+int init_tpacket(const char* interface_name, int port, int block_timeout_ms, int fanout_group)
+{
+  struct tpacket_req3 req;
+  struct sockaddr_ll sll;
+  struct packet_mreq mreq;
+  int version = TPACKET_V3;
+  int ifindex = 0;
+
+  memset(&rctx_tpacket, 0, sizeof(rctx_tpacket));
+  rctx_tpacket.port = port;
+  rctx_tpacket.lo_ifindex = if_nametoindex("lo");
+
+  if (interface_name) {
+    ifindex = if_nametoindex(interface_name);
+    if (!ifindex) {
+      fprintf(stderr, "Invalid interface: %s\n", interface_name);
+      return 1;
+    }
+  }
+
+  // protocol 0: nothing is queued until bind()
+  rctx_tpacket.sockfd = socket(AF_PACKET, SOCK_RAW, 0);
+  if (rctx_tpacket.sockfd < 0) {
+    // needs CAP_NET_RAW, see README.md
+    perror("Failed to create packet socket");
+    return 1;
+  }
+
+  if (attach_filter(rctx_tpacket.sockfd, port) != 0) {
+    perror("Failed to attach packet filter");
+    return 1;
+  }
+
+  if (setsockopt(rctx_tpacket.sockfd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) != 0) {
+    perror("Failed to select TPACKET_V3");
+    return 1;
+  }
+
+  // A block is handed to us when it is full or when the retire timeout
+  // expires, so the timeout bounds the added latency.
+  memset(&req, 0, sizeof(req));
+  req.tp_block_size = TPACKET_BLOCK_SIZE;
+  req.tp_block_nr = TPACKET_BLOCK_NR;
+  req.tp_frame_size = TPACKET_FRAME_SIZE;
+  req.tp_frame_nr = (TPACKET_BLOCK_SIZE / TPACKET_FRAME_SIZE) * TPACKET_BLOCK_NR;
+  req.tp_retire_blk_tov = block_timeout_ms;
+  if (setsockopt(rctx_tpacket.sockfd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) != 0) {
+    perror("Failed to set up packet ring");
+    return 1;
+  }
+
+  rctx_tpacket.ring = mmap(0, TPACKET_BLOCK_SIZE * TPACKET_BLOCK_NR, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED, rctx_tpacket.sockfd, 0);
+  if (rctx_tpacket.ring == MAP_FAILED) {
+    // MAP_LOCKED fails with a low RLIMIT_MEMLOCK, try again without
+    rctx_tpacket.ring = mmap(0, TPACKET_BLOCK_SIZE * TPACKET_BLOCK_NR, PROT_READ | PROT_WRITE, MAP_SHARED, rctx_tpacket.sockfd, 0);
+    if (rctx_tpacket.ring == MAP_FAILED) {
+      perror("Failed to map packet ring");
+      return 1;
+    }
+  }
+
+  memset(&sll, 0, sizeof(sll));
+  sll.sll_family = AF_PACKET;
+  sll.sll_protocol = htons(ETH_P_ALL);
+  sll.sll_ifindex = ifindex;
+  if (bind(rctx_tpacket.sockfd, (struct sockaddr *)&sll, sizeof(sll)) != 0) {
+    perror("Failed to bind packet socket");
+    return 1;
+  }
+
+  if (ifindex) {
+    // like pcap_open_live(..., promisc=1, ...)
+    memset(&mreq, 0, sizeof(mreq));
+    mreq.mr_ifindex = ifindex;
+    mreq.mr_type = PACKET_MR_PROMISC;
+    if (setsockopt(rctx_tpacket.sockfd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) != 0) {
+      fprintf(stderr, "WARN: could not put %s into promiscuous mode\n", interface_name);
+    }
+  }
+
+  // Instances in the same fanout group share the traffic of the interface.
+  // The flow hash keeps all packets of one sender on the same instance.
+  if (fanout_group >= 0) {
+    int fanout = (fanout_group & 0xffff) | (PACKET_FANOUT_HASH << 16);
+    if (setsockopt(rctx_tpacket.sockfd, SOL_PACKET, PACKET_FANOUT, &fanout, sizeof(fanout)) != 0) {
+      perror("Failed to join packet fanout group");
+      return 1;
+    }
+  }
+
+  stats_init(&rctx_tpacket.stats, "tpacket");
+
+  return 0;
+}
+
+static void release_block()
+{
+  __atomic_store_n(&rctx_tpacket.desc->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+  rctx_tpacket.desc = NULL;
+  rctx_tpacket.block = (rctx_tpacket.block + 1) % TPACKET_BLOCK_NR;
+}
+
+static int next_block()
+{
+  struct tpacket_block_desc *desc = (struct tpacket_block_desc *)(rctx_tpacket.ring + rctx_tpacket.block * TPACKET_BLOCK_SIZE);
+
+  if (!(__atomic_load_n(&desc->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER))
+    return 0;
+
+  rctx_tpacket.desc = desc;
+  rctx_tpacket.next_pkt = (struct tpacket3_hdr *)((unsigned char *)desc + desc->hdr.bh1.offset_to_first_pkt);
+  rctx_tpacket.pkts_left = desc->hdr.bh1.num_pkts;
+  rctx_tpacket.blocks++;
+  return 1;
+}
+
+// Returns the Scream packets of the current ring block. The audio points
+// into the ring; a block goes back to the kernel once all of its packets
+// have been handed out and the next call comes in.
+int rcv_tpacket(receiver_data_t* receiver_data, int max_packets)
+{
+  struct pollfd pfd;
+  struct tpacket3_hdr *hdr;
+  struct sockaddr_ll *sll;
+  struct timespec realtime;
+  int64_t offset_ns;
+  int packets = 0;
+
+  if (max_packets > MAX_BATCH) max_packets = MAX_BATCH;
+
+  while (packets == 0) {
+    if (rctx_tpacket.desc && rctx_tpacket.pkts_left == 0)
+      release_block();
+
+    if (!rctx_tpacket.desc && !next_block()) {
+      pfd.fd = rctx_tpacket.sockfd;
+      pfd.events = POLLIN | POLLERR;
+      pfd.revents = 0;
+      poll(&pfd, 1, -1);
+      continue;
+    }
+
+    offset_ns = realtime_offset_ns();
+    while (rctx_tpacket.pkts_left && packets < max_packets) {
+      hdr = rctx_tpacket.next_pkt;
+      sll = (struct sockaddr_ll *)((unsigned char *)hdr + TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+      // like libpcap, don't see packets on loopback twice
+      if (!(sll->sll_pkttype == PACKET_OUTGOING && sll->sll_ifindex == rctx_tpacket.lo_ifindex)
+          && parse_frame(&receiver_data[packets], (unsigned char *)hdr + hdr->tp_mac, hdr->tp_snaplen, rctx_tpacket.port)) {
+        // the kernel's receive timestamp
+        realtime.tv_sec = hdr->tp_sec;
+        realtime.tv_nsec = hdr->tp_nsec;
+        arrival_from_realtime(&receiver_data[packets].arrival, &realtime, offset_ns);
+        packets++;
+      }
+      rctx_tpacket.next_pkt = (struct tpacket3_hdr *)((unsigned char *)hdr + hdr->tp_next_offset);
+      rctx_tpacket.pkts_left--;
+    }
+  }
+
+  if (stats_batch(&rctx_tpacket.stats, packets)) {
+    struct tpacket_stats_v3 st;
+    socklen_t len = sizeof(st);
+    memset(&st, 0, sizeof(st));
+    getsockopt(rctx_tpacket.sockfd, SOL_PACKET, PACKET_STATISTICS, &st, &len);
+    fprintf(stderr, "tpacket: %llu blocks, %u packets, %u drops, %u queue freezes\n",
+      (unsigned long long)rctx_tpacket.blocks, st.tp_packets, st.tp_drops, st.tp_freeze_q_cnt);
+    rctx_tpacket.blocks = 0;
+  }
+
+  return packets;
+}
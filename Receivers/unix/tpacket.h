@@ -0,0 +1,33 @@
+#ifndef TPACKET_H
+#define TPACKET_H
+
+#include <stdint.h>
+#include <linux/if_packet.h>
+
+#include "scream.h"
+#include "network.h"
+#include "sniff.h"
+#include "stats.h"
+
+#define TPACKET_BLOCK_SIZE (1 << 16)
+#define TPACKET_BLOCK_NR 32
+#define TPACKET_FRAME_SIZE 2048
+#define DEFAULT_BLOCK_TIMEOUT 2 // ms
+
+typedef struct rctx_tpacket {
+  int sockfd;
+  int port;
+  int lo_ifindex;
+  unsigned char *ring;
+  unsigned int block;                // block currently read by us
+  struct tpacket_block_desc *desc;   // NULL if we wait for the kernel
+  struct tpacket3_hdr *next_pkt;
+  uint32_t pkts_left;
+  uint64_t blocks;
+  ingest_stats_t stats;
+} rctx_tpacket_t;
+
+int init_tpacket(const char* interface_name, int port, int block_timeout_ms, int fanout_group);
+int rcv_tpacket(receiver_data_t* receiver_data, int max_packets);
+
+#endif
@@ -0,0 +1,280 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+static rctx_uring_t rctx_uring;
+
+static int uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+  return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(unsigned int to_submit, unsigned int min_complete, unsigned int flags)
+{
+  return (int)syscall(__NR_io_uring_enter, rctx_uring.ringfd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int uring_register(unsigned int opcode, void *arg, unsigned int nr_args)
+{
+  return (int)syscall(__NR_io_uring_register, rctx_uring.ringfd, opcode, arg, nr_args);
+}
+
+static void recycle_buffer(uint16_t bid)
+{
+  struct io_uring_buf *buf = &rctx_uring.buf_ring->bufs[rctx_uring.buf_tail & (URING_BUFFERS - 1)];
+
+  buf->addr = (uint64_t)(uintptr_t)(rctx_uring.buffers + (size_t)bid * rctx_uring.buffer_size);
+  buf->len = rctx_uring.buffer_size;
+  buf->bid = bid;
+  rctx_uring.buf_tail++;
+}
+
+static void publish_buffers()
+{
+  __atomic_store_n(&rctx_uring.buf_ring->tail, rctx_uring.buf_tail, __ATOMIC_RELEASE);
+}
+
+// Queue a multishot recvmsg. It keeps posting one completion per
+// datagram until the kernel runs out of provided buffers.
+static void arm_recv()
+{
+  unsigned int tail = *rctx_uring.sq_tail;
+  unsigned int idx = tail & *rctx_uring.sq_mask;
+  struct io_uring_sqe *sqe = &rctx_uring.sqes[idx];
+
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  sqe->opcode = IORING_OP_RECVMSG;
+  sqe->fd = rctx_uring.sockfd;
+  sqe->addr = (uint64_t)(uintptr_t)&rctx_uring.msg;
+  sqe->len = 1;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_BUFFER_GROUP;
+
+  rctx_uring.sq_array[idx] = idx;
+  __atomic_store_n(rctx_uring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+  rctx_uring.to_submit++;
+  rctx_uring.armed = 1;
+}
+
+static int submit_and_wait(unsigned int min_complete)
+{
+  int ret = uring_enter(rctx_uring.to_submit, min_complete, min_complete ? IORING_ENTER_GETEVENTS : 0);
+  rctx_uring.enters++;
+  if (ret > 0) {
+    rctx_uring.submissions += ret;
+    rctx_uring.to_submit -= ret;
+  }
+  return ret;
+}
+
+int init_uring(int sockfd)
+{
+  struct io_uring_params p;
+  struct io_uring_buf_reg reg;
+  unsigned char *sq_ptr = MAP_FAILED, *cq_ptr = MAP_FAILED;
+  size_t sq_size, cq_size;
+  unsigned int head;
+
+  memset(&rctx_uring, 0, sizeof(rctx_uring));
+  rctx_uring.sqes = MAP_FAILED;
+  rctx_uring.buf_ring = MAP_FAILED;
+  rctx_uring.buffers = MAP_FAILED;
+  rctx_uring.sockfd = sockfd;
+  // the kernel puts the sender address and the control messages
+  // (timestamp, drop counter) in front of each payload
+  rctx_uring.msg.msg_namelen = sizeof(struct sockaddr_in);
+  rctx_uring.msg.msg_controllen = CONTROL_SIZE;
+  // rounded up, so the headers of the next buffer stay aligned
+  rctx_uring.buffer_size = (URING_BUFFER_OVERHEAD + get_max_packet_size() + 7) & ~(size_t)7;
+
+  // one completion per provided buffer must fit, an overflowing
+  // completion queue terminates the multishot request
+  memset(&p, 0, sizeof(p));
+  p.flags = IORING_SETUP_CQSIZE;
+  p.cq_entries = URING_BUFFERS;
+  rctx_uring.ringfd = uring_setup(URING_ENTRIES, &p);
+  if (rctx_uring.ringfd < 0) {
+    if (verbosity) perror("io_uring_setup");
+    return 1;
+  }
+
+  sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+  cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (cq_size > sq_size) sq_size = cq_size;
+    cq_size = sq_size;
+  }
+
+  sq_ptr = mmap(0, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, rctx_uring.ringfd, IORING_OFF_SQ_RING);
+  if (sq_ptr == MAP_FAILED) goto error_exit;
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    cq_ptr = sq_ptr;
+  }
+  else {
+    cq_ptr = mmap(0, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, rctx_uring.ringfd, IORING_OFF_CQ_RING);
+    if (cq_ptr == MAP_FAILED) goto error_exit;
+  }
+  rctx_uring.sqes = mmap(0, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, rctx_uring.ringfd, IORING_OFF_SQES);
+  if (rctx_uring.sqes == MAP_FAILED) goto error_exit;
+
+  rctx_uring.sq_head = (unsigned int *)(sq_ptr + p.sq_off.head);
+  rctx_uring.sq_tail = (unsigned int *)(sq_ptr + p.sq_off.tail);
+  rctx_uring.sq_mask = (unsigned int *)(sq_ptr + p.sq_off.ring_mask);
+  rctx_uring.sq_array = (unsigned int *)(sq_ptr + p.sq_off.array);
+  rctx_uring.cq_head = (unsigned int *)(cq_ptr + p.cq_off.head);
+  rctx_uring.cq_tail = (unsigned int *)(cq_ptr + p.cq_off.tail);
+  rctx_uring.cq_mask = (unsigned int *)(cq_ptr + p.cq_off.ring_mask);
+  rctx_uring.cqes = (struct io_uring_cqe *)(cq_ptr + p.cq_off.cqes);
+
+  // provided buffer ring (needs Linux 5.19)
+  rctx_uring.buf_ring = mmap(0, URING_BUFFERS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  rctx_uring.buffers = mmap(0, URING_BUFFERS * rctx_uring.buffer_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (rctx_uring.buf_ring == MAP_FAILED || rctx_uring.buffers == MAP_FAILED) goto error_exit;
+
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t)(uintptr_t)rctx_uring.buf_ring;
+  reg.ring_entries = URING_BUFFERS;
+  reg.bgid = URING_BUFFER_GROUP;
+  if (uring_register(IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+    if (verbosity) perror("io_uring_register(IORING_REGISTER_PBUF_RING)");
+    goto error_exit;
+  }
+  for (uint16_t bid = 0; bid < URING_BUFFERS; bid++) {
+    recycle_buffer(bid);
+  }
+  publish_buffers();
+
+  // multishot recvmsg (needs Linux 6.0). Older kernels reject the
+  // request right away, which shows up as an error completion.
+  arm_recv();
+  if (submit_and_wait(0) < 0) {
+    if (verbosity) perror("io_uring_enter");
+    goto error_exit;
+  }
+  head = *rctx_uring.cq_head;
+  if (head != __atomic_load_n(rctx_uring.cq_tail, __ATOMIC_ACQUIRE)) {
+    struct io_uring_cqe *cqe = &rctx_uring.cqes[head & *rctx_uring.cq_mask];
+    if (cqe->res < 0) {
+      if (verbosity) fprintf(stderr, "io_uring multishot recvmsg: %s\n", strerror(-cqe->res));
+      goto error_exit;
+    }
+  }
+
+  stats_init(&rctx_uring.stats, "io_uring");
+  rctx_uring.stats.count_drops = 1;
+
+  return 0;
+
+error_exit:
+  // another engine takes over, don't leave the rings behind
+  if (rctx_uring.buffers != MAP_FAILED) munmap(rctx_uring.buffers, URING_BUFFERS * rctx_uring.buffer_size);
+  if (rctx_uring.buf_ring != MAP_FAILED) munmap(rctx_uring.buf_ring, URING_BUFFERS * sizeof(struct io_uring_buf));
+  if (rctx_uring.sqes != MAP_FAILED) munmap(rctx_uring.sqes, p.sq_entries * sizeof(struct io_uring_sqe));
+  if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr) munmap(cq_ptr, cq_size);
+  if (sq_ptr != MAP_FAILED) munmap(sq_ptr, sq_size);
+  close(rctx_uring.ringfd);
+  return 1;
+}
+
+int rcv_uring(receiver_data_t* receiver_data, int max_packets)
+{
+  struct io_uring_cqe *cqe;
+  struct io_uring_recvmsg_out *out;
+  struct sockaddr_in *name;
+  struct msghdr control;
+  struct timespec realtime, now;
+  int64_t offset_ns;
+  unsigned char *buf, *payload;
+  unsigned int head, tail;
+  uint16_t bid;
+  int i, packets = 0;
+
+  if (max_packets > MAX_BATCH) max_packets = MAX_BATCH;
+
+  // the previous batch has been played, hand its buffers back
+  for (i = 0; i < rctx_uring.num_in_use; i++) {
+    recycle_buffer(rctx_uring.in_use[i]);
+  }
+  rctx_uring.num_in_use = 0;
+  publish_buffers();
+
+  while (packets == 0) {
+    if (!rctx_uring.armed) {
+      rctx_uring.rearms++;
+      arm_recv();
+    }
+
+    head = *rctx_uring.cq_head;
+    tail = __atomic_load_n(rctx_uring.cq_tail, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+      if (submit_and_wait(1) < 0 && errno != EINTR) {
+        perror("io_uring_enter");
+      }
+      continue;
+    }
+
+    offset_ns = realtime_offset_ns();
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (; head != tail && packets < max_packets; head++) {
+      cqe = &rctx_uring.cqes[head & *rctx_uring.cq_mask];
+      rctx_uring.completions++;
+
+      // the kernel ends the multishot request e.g. when it runs out of buffers
+      if (!(cqe->flags & IORING_CQE_F_MORE)) rctx_uring.armed = 0;
+
+      if (cqe->res < 0) {
+        if (cqe->res != -ENOBUFS && verbosity) {
+          fprintf(stderr, "io_uring recvmsg: %s\n", strerror(-cqe->res));
+        }
+        continue;
+      }
+      if (!(cqe->flags & IORING_CQE_F_BUFFER)) continue;
+
+      bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+      buf = rctx_uring.buffers + (size_t)bid * rctx_uring.buffer_size;
+      out = (struct io_uring_recvmsg_out *)buf;
+      // name and control data take the space reserved for them, whatever
+      // their actual length
+      payload = buf + sizeof(struct io_uring_recvmsg_out) + rctx_uring.msg.msg_namelen + rctx_uring.msg.msg_controllen;
+
+      if (out->flags & MSG_TRUNC) network_oversized();
+      if ((out->flags & MSG_TRUNC) || !parse_packet(&receiver_data[packets], payload, out->payloadlen)) {
+        recycle_buffer(bid);
+        continue;
+      }
+      name = (struct sockaddr_in *)(out + 1);
+      receiver_data[packets].src_addr = name->sin_addr.s_addr;
+      receiver_data[packets].src_port = name->sin_port;
+      memset(&control, 0, sizeof(control));
+      control.msg_control = (unsigned char *)(name) + rctx_uring.msg.msg_namelen;
+      control.msg_controllen = out->controllen;
+      if (parse_cmsg(&control, &realtime, &rctx_uring.drops))
+        arrival_from_realtime(&receiver_data[packets].arrival, &realtime, offset_ns);
+      else
+        receiver_data[packets].arrival = now;
+      packets++;
+      rctx_uring.in_use[rctx_uring.num_in_use++] = bid;
+    }
+    __atomic_store_n(rctx_uring.cq_head, head, __ATOMIC_RELEASE);
+    publish_buffers();
+  }
+
+  network_drops(rctx_uring.drops, &receiver_data[packets - 1], &rctx_uring.stats);
+  if (stats_batch(&rctx_uring.stats, packets)) {
+    fprintf(stderr, "io_uring: %llu enters, %llu submissions, %llu completions, %llu rearms\n",
+      (unsigned long long)rctx_uring.enters, (unsigned long long)rctx_uring.submissions,
+      (unsigned long long)rctx_uring.completions, (unsigned long long)rctx_uring.rearms);
+    rctx_uring.enters = 0;
+    rctx_uring.submissions = 0;
+    rctx_uring.completions = 0;
+    rctx_uring.rearms = 0;
+  }
+
+  return packets;
+}
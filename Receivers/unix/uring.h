@@ -0,0 +1,48 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+
+#include "scream.h"
+#include "network.h"
+#include "stats.h"
+
+#define URING_ENTRIES 8
+#define URING_BUFFERS 256 // must be a power of 2
+#define URING_BUFFER_GROUP 0
+// each buffer holds a packet of up to -M bytes after these
+#define URING_BUFFER_OVERHEAD (sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_in) + CONTROL_SIZE)
+
+typedef struct rctx_uring {
+  int ringfd;
+  int sockfd;
+  struct msghdr msg;
+  int armed;
+  unsigned int to_submit;
+
+  // submission and completion queue, shared with the kernel
+  unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+  struct io_uring_sqe *sqes;
+  unsigned int *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqes;
+
+  // provided buffer ring; buffers handed to the output are given
+  // back to the kernel on the next call
+  struct io_uring_buf_ring *buf_ring;
+  unsigned char *buffers;
+  size_t buffer_size;
+  uint16_t buf_tail;
+  uint16_t in_use[MAX_BATCH];
+  int num_in_use;
+
+  uint32_t drops;  // the kernel's drop counter, as last reported
+  uint64_t enters, submissions, completions, rearms;
+  ingest_stats_t stats;
+} rctx_uring_t;
+
+int init_uring(int sockfd);
+int rcv_uring(receiver_data_t* receiver_data, int max_packets);
+
+#endif
@@ -0,0 +1,333 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <net/if.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+
+#include "xdp.h"
+
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+
+// All traffic arrives on queue 0 with a single queue NIC. For multi queue
+// NICs, steer the Scream traffic there with 'ethtool -N' or use one channel.
+#define XDP_QUEUE 0
+
+static rctx_xdp_t rctx_xdp;
+
+static int sys_bpf(int cmd, union bpf_attr *attr)
+{
+  return (int)syscall(__NR_bpf, cmd, attr, sizeof(union bpf_attr));
+}
+
+#define INSN(c, d, s, o, i) ((struct bpf_insn){ .code = (c), .dst_reg = (d), .src_reg = (s), .off = (o), .imm = (i) })
+
+// XDP program: redirect unfragmented UDP/IPv4 to <port> (and <group>, if
+// not 0) that fits a UMEM frame into the socket of the receiving queue,
+// pass everything else on to the network stack.
+static int load_program(int mapfd, int port, in_addr_t group)
+{
+  struct bpf_insn prog[40];
+  int pass_jumps[10];
+  int n = 0, j = 0, i;
+  union bpf_attr attr;
+
+  prog[n++] = INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0);
+  prog[n++] = INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_1, offsetof(struct xdp_md, data), 0);
+  prog[n++] = INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_3, BPF_REG_1, offsetof(struct xdp_md, data_end), 0);
+  // bounds check: ethernet + ip + udp + scream header
+  prog[n++] = INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_2, 0, 0);
+  prog[n++] = INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0, SIZE_ETHERNET + 20 + 8 + HEADER_SIZE);
+  pass_jumps[j++] = n;
+  prog[n++] = INSN(BPF_JMP | BPF_JGT | BPF_X, BPF_REG_4, BPF_REG_3, 0, 0);
+  // fits a UMEM frame
+  prog[n++] = INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_2, 0, 0);
+  prog[n++] = INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0, XDP_MAX_FRAME_LEN);
+  pass_jumps[j++] = n;
+  prog[n++] = INSN(BPF_JMP | BPF_JGT | BPF_X, BPF_REG_3, BPF_REG_4, 0, 0);
+  // ether type
+  prog[n++] = INSN(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_5, BPF_REG_2, 12, 0);
+  pass_jumps[j++] = n;
+  prog[n++] = INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, 0, htons(ETHERTYPE_IPV4));
+  // IPv4 without options
+  prog[n++] = INSN(BPF_LDX | BPF_MEM | BPF_B, BPF_REG_5, BPF_REG_2, SIZE_ETHERNET, 0);
+  pass_jumps[j++] = n;
+  prog[n++] = INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, 0, 0x45);
+  // UDP
+  prog[n++] = INSN(BPF_LDX | BPF_MEM | BPF_B, BPF_REG_5, BPF_REG_2, SIZE_ETHERNET + 9, 0);
+  pass_jumps[j++] = n;
+  prog[n++] = INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, 0, IPPROTO_UDP);
+  // not fragmented
+  prog[n++] = INSN(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_5, BPF_REG_2, SIZE_ETHERNET + 6, 0);
+  prog[n++] = INSN(BPF_ALU64 | BPF_AND | BPF_K, BPF_REG_5, 0, 0, htons(IP_MF | IP_OFFMASK));
+  pass_jumps[j++] = n;
+  prog[n++] = INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, 0, 0);
+  // destination port
+  prog[n++] = INSN(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_5, BPF_REG_2, SIZE_ETHERNET + 20 + 2, 0);
+  pass_jumps[j++] = n;
+  prog[n++] = INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, 0, htons(port));
+  // destination group
+  if (group) {
+    prog[n++] = INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_5, BPF_REG_2, SIZE_ETHERNET + 16, 0);
+    pass_jumps[j++] = n;
+    prog[n++] = INSN(BPF_JMP32 | BPF_JNE | BPF_K, BPF_REG_5, 0, 0, (int32_t)group);
+  }
+  // return bpf_redirect_map(&xsks, ctx->rx_queue_index, XDP_PASS)
+  prog[n++] = INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_6, offsetof(struct xdp_md, rx_queue_index), 0);
+  prog[n++] = INSN(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, mapfd);
+  prog[n++] = INSN(0, 0, 0, 0, 0);
+  prog[n++] = INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, XDP_PASS);
+  prog[n++] = INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map);
+  prog[n++] = INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+  // pass:
+  for (i = 0; i < j; i++) {
+    prog[pass_jumps[i]].off = n - pass_jumps[i] - 1;
+  }
+  prog[n++] = INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, XDP_PASS);
+  prog[n++] = INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+
+  memset(&attr, 0, sizeof(attr));
+  attr.prog_type = BPF_PROG_TYPE_XDP;
+  attr.insns = (uint64_t)(uintptr_t)prog;
+  attr.insn_cnt = n;
+  attr.license = (uint64_t)(uintptr_t)"GPL";
+  return sys_bpf(BPF_PROG_LOAD, &attr);
+}
+
+static int bind_xsk(struct sockaddr_xdp *sxdp)
+{
+  int tries = XDP_BIND_RETRIES;
+
+  while (bind(rctx_xdp.xskfd, (struct sockaddr *)sxdp, sizeof(*sxdp)) != 0) {
+    if (errno != EBUSY || !tries--) return -1;
+    usleep(XDP_BIND_RETRY_MS * 1000);
+  }
+  return 0;
+}
+
+static int attach_program(int progfd, int ifindex, uint32_t flags)
+{
+  union bpf_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.link_create.prog_fd = progfd;
+  attr.link_create.target_ifindex = ifindex;
+  attr.link_create.attach_type = BPF_XDP;
+  attr.link_create.flags = flags;
+  return sys_bpf(BPF_LINK_CREATE, &attr);
+}
+
+static void *map_ring(xdp_ring_t *ring, struct xdp_ring_offset *off, size_t entry_size, uint32_t entries, off_t pgoff)
+{
+  unsigned char *map = mmap(0, off->desc + entries * entry_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, rctx_xdp.xskfd, pgoff);
+  if (map == MAP_FAILED) return NULL;
+
+  ring->producer = (uint32_t *)(map + off->producer);
+  ring->consumer = (uint32_t *)(map + off->consumer);
+  ring->ring = map + off->desc;
+  ring->mask = entries - 1;
+  return map;
+}
+
+static void fill_frame(uint64_t addr)
+{
+  uint32_t prod = *rctx_xdp.fill.producer;
+
+  ((uint64_t *)rctx_xdp.fill.ring)[prod & rctx_xdp.fill.mask] = addr;
+  __atomic_store_n(rctx_xdp.fill.producer, prod + 1, __ATOMIC_RELEASE);
+}
+
+int init_xdp(const char* interface_name, int port, char* multicast_group, int generic)
+{
+  struct xdp_umem_reg umem_reg;
+  struct xdp_mmap_offsets off;
+  struct sockaddr_xdp sxdp;
+  union bpf_attr attr;
+  socklen_t optlen;
+  uint32_t entries = XDP_NUM_FRAMES;
+  uint32_t completion_entries = 8;
+  in_addr_t group = multicast_group ? inet_addr(multicast_group) : 0;
+  int ifindex, queue = XDP_QUEUE;
+
+  memset(&rctx_xdp, 0, sizeof(rctx_xdp));
+  rctx_xdp.port = port;
+
+  if (!interface_name || !(ifindex = if_nametoindex(interface_name))) {
+    fprintf(stderr, "AF_XDP needs a network interface name (-i)\n");
+    return 1;
+  }
+  if (get_max_packet_size() > XDP_MAX_PACKET_SIZE) {
+    fprintf(stderr, "AF_XDP receives packets up to %u bytes, -M %u is too large\n", (unsigned int)XDP_MAX_PACKET_SIZE, get_max_packet_size());
+    return 1;
+  }
+
+  rctx_xdp.xskfd = socket(AF_XDP, SOCK_RAW, 0);
+  if (rctx_xdp.xskfd < 0) {
+    perror("Failed to create AF_XDP socket");
+    return 1;
+  }
+
+  // UMEM: the frames the NIC (or the generic XDP path) writes packets to
+  rctx_xdp.umem = mmap(0, XDP_NUM_FRAMES * XDP_FRAME_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (rctx_xdp.umem == MAP_FAILED) {
+    perror("Failed to allocate UMEM");
+    return 1;
+  }
+  memset(&umem_reg, 0, sizeof(umem_reg));
+  umem_reg.addr = (uint64_t)(uintptr_t)rctx_xdp.umem;
+  umem_reg.len = XDP_NUM_FRAMES * XDP_FRAME_SIZE;
+  umem_reg.chunk_size = XDP_FRAME_SIZE;
+  if (setsockopt(rctx_xdp.xskfd, SOL_XDP, XDP_UMEM_REG, &umem_reg, sizeof(umem_reg)) != 0
+      || setsockopt(rctx_xdp.xskfd, SOL_XDP, XDP_UMEM_FILL_RING, &entries, sizeof(entries)) != 0
+      || setsockopt(rctx_xdp.xskfd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &completion_entries, sizeof(completion_entries)) != 0
+      || setsockopt(rctx_xdp.xskfd, SOL_XDP, XDP_RX_RING, &entries, sizeof(entries)) != 0) {
+    perror("Failed to set up UMEM");
+    return 1;
+  }
+
+  optlen = sizeof(off);
+  if (getsockopt(rctx_xdp.xskfd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) != 0
+      || !map_ring(&rctx_xdp.rx, &off.rx, sizeof(struct xdp_desc), entries, XDP_PGOFF_RX_RING)
+      || !map_ring(&rctx_xdp.fill, &off.fr, sizeof(uint64_t), entries, XDP_UMEM_PGOFF_FILL_RING)
+      || !map_ring(&rctx_xdp.completion, &off.cr, sizeof(uint64_t), completion_entries, XDP_UMEM_PGOFF_COMPLETION_RING)) {
+    perror("Failed to map AF_XDP rings");
+    return 1;
+  }
+  for (uint64_t frame = 0; frame < XDP_NUM_FRAMES; frame++) {
+    fill_frame(frame * XDP_FRAME_SIZE);
+  }
+
+  memset(&attr, 0, sizeof(attr));
+  attr.map_type = BPF_MAP_TYPE_XSKMAP;
+  attr.key_size = sizeof(uint32_t);
+  attr.value_size = sizeof(uint32_t);
+  attr.max_entries = XDP_MAX_QUEUES;
+  rctx_xdp.mapfd = sys_bpf(BPF_MAP_CREATE, &attr);
+  if (rctx_xdp.mapfd < 0) {
+    perror("Failed to create XSKMAP");
+    return 1;
+  }
+
+  rctx_xdp.progfd = load_program(rctx_xdp.mapfd, port, group);
+  if (rctx_xdp.progfd < 0) {
+    perror("Failed to load XDP program");
+    return 1;
+  }
+
+  // native XDP first, generic (skb) mode if the driver has no XDP support.
+  // The program is detached when the link fd is closed on exit.
+  rctx_xdp.linkfd = generic ? -1 : attach_program(rctx_xdp.progfd, ifindex, XDP_FLAGS_DRV_MODE);
+  if (rctx_xdp.linkfd < 0) {
+    generic = 1;
+    rctx_xdp.linkfd = attach_program(rctx_xdp.progfd, ifindex, XDP_FLAGS_SKB_MODE);
+  }
+  if (rctx_xdp.linkfd < 0) {
+    perror("Failed to attach XDP program");
+    return 1;
+  }
+
+  // zero copy needs driver support, copy mode works everywhere
+  memset(&sxdp, 0, sizeof(sxdp));
+  sxdp.sxdp_family = AF_XDP;
+  sxdp.sxdp_ifindex = ifindex;
+  sxdp.sxdp_queue_id = queue;
+  sxdp.sxdp_flags = generic ? XDP_COPY : XDP_ZEROCOPY;
+  if (bind_xsk(&sxdp) != 0) {
+    if (generic) {
+      perror("Failed to bind AF_XDP socket");
+      return 1;
+    }
+    sxdp.sxdp_flags = XDP_COPY;
+    if (bind_xsk(&sxdp) != 0) {
+      perror("Failed to bind AF_XDP socket");
+      return 1;
+    }
+  }
+
+  memset(&attr, 0, sizeof(attr));
+  attr.map_fd = rctx_xdp.mapfd;
+  attr.key = (uint64_t)(uintptr_t)&queue;
+  attr.value = (uint64_t)(uintptr_t)&rctx_xdp.xskfd;
+  if (sys_bpf(BPF_MAP_UPDATE_ELEM, &attr) != 0) {
+    perror("Failed to register AF_XDP socket");
+    return 1;
+  }
+
+  if (verbosity) {
+    fprintf(stderr, "AF_XDP on %s queue %d, %s XDP, %s mode\n", interface_name, queue,
+      generic ? "generic" : "native", sxdp.sxdp_flags == XDP_ZEROCOPY ? "zero copy" : "copy");
+  }
+
+  stats_init(&rctx_xdp.stats, "af_xdp");
+
+  return 0;
+}
+
+// Parses the Scream packets straight out of the UMEM frames. Frames handed
+// to the output go back to the fill ring on the next call.
+int rcv_xdp(receiver_data_t* receiver_data, int max_packets)
+{
+  struct pollfd pfd;
+  struct xdp_desc *desc;
+  uint32_t cons, prod;
+  struct timespec now;
+  int i, packets = 0;
+
+  if (max_packets > MAX_BATCH) max_packets = MAX_BATCH;
+
+  for (i = 0; i < rctx_xdp.num_in_use; i++) {
+    fill_frame(rctx_xdp.in_use[i]);
+  }
+  rctx_xdp.num_in_use = 0;
+
+  while (packets == 0) {
+    cons = *rctx_xdp.rx.consumer;
+    prod = __atomic_load_n(rctx_xdp.rx.producer, __ATOMIC_ACQUIRE);
+    if (cons == prod) {
+      pfd.fd = rctx_xdp.xskfd;
+      pfd.events = POLLIN;
+      pfd.revents = 0;
+      poll(&pfd, 1, -1);
+      continue;
+    }
+
+    // AF_XDP frames carry no kernel timestamp, they get the time they are
+    // picked up; the ring is drained right after the wakeup
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (; cons != prod && packets < max_packets; cons++) {
+      desc = &((struct xdp_desc *)rctx_xdp.rx.ring)[cons & rctx_xdp.rx.mask];
+      if (parse_frame(&receiver_data[packets], rctx_xdp.umem + desc->addr, desc->len, rctx_xdp.port)) {
+        receiver_data[packets].arrival = now;
+        packets++;
+        rctx_xdp.in_use[rctx_xdp.num_in_use++] = desc->addr & ~((uint64_t)XDP_FRAME_SIZE - 1);
+      }
+      else {
+        fill_frame(desc->addr & ~((uint64_t)XDP_FRAME_SIZE - 1));
+      }
+    }
+    __atomic_store_n(rctx_xdp.rx.consumer, cons, __ATOMIC_RELEASE);
+  }
+
+  if (stats_batch(&rctx_xdp.stats, packets)) {
+    struct xdp_statistics st;
+    socklen_t len = sizeof(st);
+    memset(&st, 0, sizeof(st));
+    getsockopt(rctx_xdp.xskfd, SOL_XDP, XDP_STATISTICS, &st, &len);
+    fprintf(stderr, "af_xdp: %llu dropped, %llu rx ring full, %llu fill ring empty\n",
+      (unsigned long long)st.rx_dropped, (unsigned long long)st.rx_ring_full,
+      (unsigned long long)st.rx_fill_ring_empty_descs);
+  }
+
+  return packets;
+}
@@ -0,0 +1,53 @@
+#ifndef XDP_H
+#define XDP_H
+
+#include <stdint.h>
+#include <linux/bpf.h>
+#include <linux/if_xdp.h>
+
+#include "scream.h"
+#include "network.h"
+#include "sniff.h"
+#include "stats.h"
+
+#define XDP_FRAME_SIZE 2048
+// A frame starts XDP_PACKET_HEADROOM into its UMEM chunk. Longer frames
+// would be dropped by the kernel, the XDP program passes them on to the
+// network stack instead. Without multi-buffer support, native mode can't
+// be attached with an MTU much above this anyway.
+#define XDP_MAX_FRAME_LEN (XDP_FRAME_SIZE - XDP_PACKET_HEADROOM)
+#define XDP_MAX_PACKET_SIZE (XDP_MAX_FRAME_LEN - SIZE_ETHERNET - 20 - 8)
+#define XDP_NUM_FRAMES 2048 // must be a power of 2
+#define XDP_MAX_QUEUES 64
+// The queue of an AF_XDP socket that was just closed (e.g. by the receiver
+// run before) is released by the kernel in the background
+#define XDP_BIND_RETRIES 20
+#define XDP_BIND_RETRY_MS 50
+
+typedef struct xdp_ring {
+  uint32_t *producer;
+  uint32_t *consumer;
+  void *ring;
+  uint32_t mask;
+} xdp_ring_t;
+
+typedef struct rctx_xdp {
+  int xskfd;
+  int mapfd;
+  int progfd;
+  int linkfd;
+  int port;
+  unsigned char *umem;
+  xdp_ring_t rx;
+  xdp_ring_t fill;
+  xdp_ring_t completion;
+  // frames handed to the output, given back to the fill ring on the next call
+  uint64_t in_use[MAX_BATCH];
+  int num_in_use;
+  ingest_stats_t stats;
+} rctx_xdp_t;
+
+int init_xdp(const char* interface_name, int port, char* multicast_group, int generic);
+int rcv_xdp(receiver_data_t* receiver_data, int max_packets);
+
+#endif
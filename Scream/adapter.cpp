@@ -42,6 +42,8 @@ DWORD g_silenceThreshold;
 DWORD g_DSCP;
 DWORD g_TTL;
 DWORD g_ScreamVersion;
+DWORD g_FecGroup;
+DWORD g_PayloadSize;
 
 //-----------------------------------------------------------------------------
 // Referenced forward.
@@ -92,6 +94,8 @@ Returns:
 	  DWORD               DSCP = 0;
 	  DWORD               TTL = 0;
 	  DWORD               ScreamVersion = 0;
+	  DWORD               fecGroup = 0;
+	  DWORD               payloadSize = 0;
     DWORD               silenceThreshold = 0;
 
     RtlZeroMemory(&unicastIPv4, sizeof(UNICODE_STRING));
@@ -106,6 +110,8 @@ Returns:
 		    { NULL,   RTL_QUERY_REGISTRY_DIRECT, L"DSCP", &DSCP, REG_NONE,  NULL, 0 },
 		    { NULL,   RTL_QUERY_REGISTRY_DIRECT, L"TTL", &TTL, REG_NONE,  NULL, 0 },
 		    { NULL,   RTL_QUERY_REGISTRY_DIRECT, L"Version", &ScreamVersion, REG_NONE,  NULL, 0 },
+		    { NULL,   RTL_QUERY_REGISTRY_DIRECT, L"FecGroup", &fecGroup, REG_NONE,  NULL, 0 },
+		    { NULL,   RTL_QUERY_REGISTRY_DIRECT, L"PayloadSize", &payloadSize, REG_NONE,  NULL, 0 },
         { NULL,   RTL_QUERY_REGISTRY_DIRECT, L"SilenceThreshold", &silenceThreshold, REG_NONE,  NULL, 0 },
         { NULL,   0,                         NULL,           NULL,         0,         NULL, 0 }
     };
@@ -187,6 +193,23 @@ Returns:
 		g_ScreamVersion = 0;  
 	}
 
+	// one parity packet per fecGroup packets, needs protocol v2
+	if (fecGroup >= 2 && fecGroup <= 32 && g_ScreamVersion >= 2) {
+		g_FecGroup = fecGroup;
+	}
+	else {
+		g_FecGroup = 0;
+	}
+
+	// bytes of audio per packet, 0 = 1152. A parity packet adds 25 bytes of
+	// header and timestamps, and must still fit into a UDP datagram.
+	if (payloadSize <= 65472) {
+		g_PayloadSize = payloadSize;
+	}
+	else {
+		g_PayloadSize = 0;
+	}
+
     if ((unicastIPv4.Length > 0) && RtlUnicodeStringToAnsiSize(&unicastIPv4)) {
         g_UnicastIPv4 = (PCHAR)(ExAllocatePoolWithTag(NonPagedPool, RtlUnicodeStringToAnsiSize(&unicastIPv4) + 1, MSVAD_POOLTAG));
         if (g_UnicastIPv4) {
@@ -12,6 +12,8 @@
 //=============================================================================
 
 #define MAGIC_NUM           0x11112014;
+#define EXT_MAGIC_NUM       0x32524353
+#define HEADER_VERSION      2
 
 #pragma code_seg("PAGE")
 //=============================================================================
@@ -84,6 +86,35 @@ void CIVSHMEMSaveData::ReleaseMMAP() {
     }
 }
 
+//=============================================================================
+void CIVSHMEMSaveData::RingDoorbell(UINT16 peerID) {
+    IVSHMEM_RING ring = { peerID, 0 };
+
+    IO_STATUS_BLOCK ioStatus = { 0 };
+    KEVENT event;
+    KeInitializeEvent(&event, NotificationEvent, FALSE);
+    PIRP irp = IoBuildDeviceIoControlRequest(
+        IOCTL_IVSHMEM_RING_DOORBELL,
+        m_ivshmem.devObj,
+        &ring, sizeof(IVSHMEM_RING),
+        NULL, 0,
+        FALSE,
+        &event,
+        &ioStatus
+    );
+    if (irp) {
+        if (IoCallDriver(m_ivshmem.devObj, irp) == STATUS_PENDING) {
+            KeWaitForSingleObject(&event, Executive, KernelMode, FALSE, NULL);
+        }
+        if (ioStatus.Status != 0) {
+            DPF_ENTER(("IVSHMEM: IRP for RING_DOORBELL failed with status %u\n", ioStatus.Status));
+        }
+    }
+    else {
+        DPF_ENTER(("IVSHMEM: Failed to get the IRP for RING_DOORBELL\n"));
+    }
+}
+
 //=============================================================================
 CIVSHMEMSaveData::CIVSHMEMSaveData() : m_pBuffer(NULL), m_ulOffset(0), m_ulSendOffset(0), m_fWriteDisabled(FALSE) {
     PAGED_CODE();
@@ -257,12 +288,18 @@ NTSTATUS CIVSHMEMSaveData::Initialize(DWORD nSamplesPerSec, WORD wBitsPerSample,
     if (RequestMMAP()) {
         PIVSHMEM_SCREAM_HEADER hdr = (PIVSHMEM_SCREAM_HEADER)m_ivshmem.mmap.ptr;
 
-        RtlZeroMemory(hdr, sizeof(IVSHMEM_SCREAM_HEADER));
+        // Seqlock: while the generation is odd, receivers don't trust the header
+        UINT32 generation = (hdr->extMagic == EXT_MAGIC_NUM) ? hdr->generation : 0;
+        hdr->generation = (generation + 1) | 1;
+        KeMemoryBarrier();
+
+        RtlZeroMemory(hdr, FIELD_OFFSET(IVSHMEM_SCREAM_HEADER, generation));
         m_ivshmem.writeIdx = 0;
         hdr->offset = m_ivshmem.offset = (UINT8)sizeof(IVSHMEM_SCREAM_HEADER);
         hdr->chunkSize = m_ivshmem.chunkSize;
-        hdr->maxChunks = m_ivshmem.maxChunks = (UINT16)(m_ivshmem.mmap.size / m_ivshmem.chunkSize);
+        hdr->maxChunks = m_ivshmem.maxChunks = (UINT16)((m_ivshmem.mmap.size - sizeof(IVSHMEM_SCREAM_HEADER) - 8) / (m_ivshmem.chunkSize + sizeof(IVSHMEM_SCREAM_TAG)));
         m_ivshmem.bufferSize = m_ivshmem.chunkSize*m_ivshmem.maxChunks;
+        m_ivshmem.tagsOffset = (m_ivshmem.offset + m_ivshmem.bufferSize + 7) & ~7;
 
         // Only multiples of 44100 and 48000 are supported
         hdr->sampleRate = (UINT8)((nSamplesPerSec % 44100) ? (0 + (nSamplesPerSec / 48000)) : (128 + (nSamplesPerSec / 44100)));
@@ -270,6 +307,12 @@ NTSTATUS CIVSHMEMSaveData::Initialize(DWORD nSamplesPerSec, WORD wBitsPerSample,
         hdr->channels = (UINT8)(nChannels);
         hdr->channelMap = (UINT16)(dwChannelMask);
 
+        hdr->extMagic = EXT_MAGIC_NUM;
+        hdr->version = HEADER_VERSION;
+        m_ivshmem.generation = hdr->generation + 1;
+        KeMemoryBarrier();
+        hdr->generation = m_ivshmem.generation;
+
         hdr->magic = MAGIC_NUM;
         m_ivshmem.initialized = true;
     }
@@ -322,6 +365,7 @@ void CIVSHMEMSaveData::IVSHMEMSendData() {
     }
 
     PIVSHMEM_SCREAM_HEADER hdr = (PIVSHMEM_SCREAM_HEADER)m_ivshmem.mmap.ptr;
+    BOOLEAN sent = FALSE;
     
     while (1) {
         // Read latest storeOffset. There might be new data.
@@ -336,12 +380,28 @@ void CIVSHMEMSaveData::IVSHMEMSendData() {
             if (++m_ivshmem.writeIdx >= m_ivshmem.maxChunks) {
                 m_ivshmem.writeIdx = 0;
             }
+            PIVSHMEM_SCREAM_TAG tag = (PIVSHMEM_SCREAM_TAG)((PBYTE)m_ivshmem.mmap.ptr + m_ivshmem.tagsOffset) + m_ivshmem.writeIdx;
+            tag->seq = 0;
+            KeMemoryBarrier();
             RtlCopyMemory(&mmap[m_ivshmem.writeIdx*m_ivshmem.chunkSize], &m_pBuffer[m_ulSendOffset], m_ivshmem.chunkSize);
+            tag->generation = m_ivshmem.generation;
+            if (++m_ivshmem.seq == 0) {
+                m_ivshmem.seq = 1;
+            }
+            KeMemoryBarrier();
+            tag->seq = m_ivshmem.seq;
+            KeMemoryBarrier();
             hdr->writeIdx = m_ivshmem.writeIdx;
+            sent = TRUE;
         }
 
         m_ulSendOffset += m_ivshmem.chunkSize; if (m_ulSendOffset >= m_ivshmem.bufferSize) m_ulSendOffset = 0;
     }
+
+    // With ivshmem-doorbell, wake up the receiver instead of having it poll
+    if (sent && hdr->doorbellPeer) {
+        RingDoorbell(hdr->doorbellPeer - 1);
+    }
     ReleaseMMAP();
 }
 
@@ -20,6 +20,7 @@
 #define IOCTL_IVSHMEM_REQUEST_SIZE   CTL_CODE(FILE_DEVICE_UNKNOWN, 0x801, METHOD_BUFFERED, FILE_ANY_ACCESS)
 #define IOCTL_IVSHMEM_REQUEST_MMAP   CTL_CODE(FILE_DEVICE_UNKNOWN, 0x802, METHOD_BUFFERED, FILE_ANY_ACCESS)
 #define IOCTL_IVSHMEM_RELEASE_MMAP   CTL_CODE(FILE_DEVICE_UNKNOWN, 0x803, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_IVSHMEM_RING_DOORBELL  CTL_CODE(FILE_DEVICE_UNKNOWN, 0x804, METHOD_BUFFERED, FILE_ANY_ACCESS)
 
 //-----------------------------------------------------------------------------
 //  Forward declaration
@@ -50,6 +51,13 @@ typedef struct IVSHMEM_MMAP
 }
 IVSHMEM_MMAP, *PIVSHMEM_MMAP;
 
+typedef struct IVSHMEM_RING
+{
+    UINT16         peerID;  // the peer to ring
+    UINT16         vector;  // the doorbell to ring
+}
+IVSHMEM_RING, *PIVSHMEM_RING;
+
 typedef struct IVSHMEM_OBJECT
 {
     BOOLEAN initialized;
@@ -60,6 +68,9 @@ typedef struct IVSHMEM_OBJECT
     UINT16 maxChunks; //how many chunks
     UINT32 chunkSize; //the size of a chunk
     UINT32 bufferSize; 
+    ULONG  tagsOffset; //position of the chunk tags
+    UINT32 generation; //of the header, even
+    UINT32 seq;        //of the last chunk written
 }
 IVSHMEM_OBJECT, *PIVSHMEM_OBJECT;
 
@@ -74,9 +85,23 @@ typedef struct IVSHMEM_SCREAM_HEADER
     UINT8  sampleSize;
     UINT8  channels;
     UINT16 channelMap;
+    UINT16 doorbellPeer; //set by the receiver: its peer id + 1, 0 if it polls
+    // version 2, older receivers skip it by offset
+    UINT32 extMagic;
+    UINT16 version;
+    UINT16 reserved;
+    UINT32 generation; //odd while the header is rewritten
 }
 IVSHMEM_SCREAM_HEADER, *PIVSHMEM_SCREAM_HEADER;
 
+// Version 2: one per chunk, after the chunks
+typedef struct IVSHMEM_SCREAM_TAG
+{
+    UINT32 seq;        //0 while the chunk is written, then its sequence number
+    UINT32 generation; //of the header the chunk was written for
+}
+IVSHMEM_SCREAM_TAG, *PIVSHMEM_SCREAM_TAG;
+
 //-----------------------------------------------------------------------------
 //  Classes
 //-----------------------------------------------------------------------------
@@ -122,6 +147,7 @@ private:
 
     BOOLEAN                     RequestMMAP();
     void                        ReleaseMMAP();
+    void                        RingDoorbell(UINT16 peerID);
 };
 typedef CIVSHMEMSaveData *PCIVSHMEMSaveData;
 
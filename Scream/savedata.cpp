@@ -8,11 +8,14 @@
 //=============================================================================
 #define MULTICAST_TARGET    "239.255.77.77"
 #define MULTICAST_PORT      4010
-#define PCM_PAYLOAD_SIZE    1152                        // PCM payload size (divisible by 2, 3 and 4 bytes per sample * 2 channels)
+#define PCM_PAYLOAD_SIZE    1152                        // Default PCM payload size (divisible by 2, 3 and 4 bytes per sample * 2 channels)
 #define HEADER_SIZE         5                           // m_bSamplingFreqMarker, m_bBitsPerSampleMarker, m_bChannels, m_wChannelMask
-#define CHUNK_SIZE          (PCM_PAYLOAD_SIZE + HEADER_SIZE)      // Add two bytes so we can send a small header with bytes/sample and sampling freq markers
-#define NUM_CHUNKS          800                         // How many payloads in ring buffer
-#define BUFFER_SIZE         CHUNK_SIZE * NUM_CHUNKS     // Ring buffer size
+#define HEADER_V2_SIZE      17                          // HEADER_SIZE + 32 bit sequence number + 64 bit media timestamp (little endian)
+#define HEADER_V2_FLAG      0x80                        // Set in the bits per sample marker of a v2 header
+#define HEADER_FEC_FLAG     0x40                        // Set in addition for a FEC parity packet
+#define PARITY_EXTRA        8                           // The parity packet's payload: XOR of the group's timestamps, then of the payloads
+#define NUM_CHUNKS          800                         // How many default sized payloads in ring buffer
+#define MIN_CHUNKS          8                           // At least this many payloads in ring buffer
 
 //=============================================================================
 // Statics
@@ -46,7 +49,7 @@ NTSTATUS WskSampleSyncIrpCompletionRoutine(__in PDEVICE_OBJECT Reserved, __in PI
 //=============================================================================
 
 //=============================================================================
-CSaveData::CSaveData() : m_pBuffer(NULL), m_ulOffset(0), m_ulSendOffset(0), m_fWriteDisabled(FALSE), m_socket(NULL) {
+CSaveData::CSaveData() : m_pBuffer(NULL), m_ulOffset(0), m_ulSendOffset(0), m_fWriteDisabled(FALSE), m_socket(NULL), m_pParity(NULL), m_ulParityCount(0) {
     PAGED_CODE();
 
     DPF_ENTER(("[CSaveData::CSaveData]"));
@@ -109,6 +112,11 @@ CSaveData::~CSaveData() {
             ExFreePoolWithTag(m_pBuffer, MSVAD_POOLTAG);
             IoFreeMdl(m_pMdl);
         }
+
+        if (m_pParity) {
+            ExFreePoolWithTag(m_pParity, MSVAD_POOLTAG);
+            IoFreeMdl(m_pParityMdl);
+        }
     }
 } // CSaveData
 
@@ -166,9 +174,26 @@ NTSTATUS CSaveData::Initialize(DWORD nSamplesPerSec, WORD wBitsPerSample, WORD n
     m_bChannels = (BYTE)nChannels;
     m_wChannelMask = (WORD)dwChannelMask;
 
+    // Protocol v2 (registry "Version" >= 2) adds a sequence number and the
+    // media time of the first frame, in frames, to each packet's header
+    m_ulHeaderSize = (g_ScreamVersion >= 2) ? HEADER_V2_SIZE : HEADER_SIZE;
+    m_ulFrameSize = (wBitsPerSample / 8) * nChannels;
+
+    // Registry "PayloadSize" sends larger (e.g. jumbo frame) packets, cut to
+    // whole frames. The ring buffer keeps about the same size in bytes.
+    m_ulPayloadSize = g_PayloadSize - (g_PayloadSize % m_ulFrameSize);
+    if (m_ulPayloadSize == 0) {
+        m_ulPayloadSize = PCM_PAYLOAD_SIZE;
+    }
+    m_ulChunkSize = m_ulPayloadSize + m_ulHeaderSize;
+    m_ulBufferSize = m_ulChunkSize * max(NUM_CHUNKS * PCM_PAYLOAD_SIZE / m_ulPayloadSize, MIN_CHUNKS);
+    m_ulParitySize = HEADER_V2_SIZE + PARITY_EXTRA + m_ulPayloadSize;
+    m_ulSequence = 0;
+    m_ullPosition = 0;
+
     // Allocate memory for data buffer.
     if (NT_SUCCESS(ntStatus)) {
-        m_pBuffer = (PBYTE) ExAllocatePoolWithTag(NonPagedPool, BUFFER_SIZE, MSVAD_POOLTAG);
+        m_pBuffer = (PBYTE) ExAllocatePoolWithTag(NonPagedPool, m_ulBufferSize, MSVAD_POOLTAG);
         if (!m_pBuffer) {
             DPF(D_TERSE, ("[Could not allocate memory for sending data]"));
             ntStatus = STATUS_INSUFFICIENT_RESOURCES;
@@ -177,7 +202,7 @@ NTSTATUS CSaveData::Initialize(DWORD nSamplesPerSec, WORD wBitsPerSample, WORD n
 
     // Allocate MDL for the data buffer
     if (NT_SUCCESS(ntStatus)) {
-        m_pMdl = IoAllocateMdl(m_pBuffer, BUFFER_SIZE, FALSE, FALSE, NULL);
+        m_pMdl = IoAllocateMdl(m_pBuffer, m_ulBufferSize, FALSE, FALSE, NULL);
         if (m_pMdl == NULL) {
             DPF(D_TERSE, ("[Failed to allocate MDL]"));
             ntStatus = STATUS_INSUFFICIENT_RESOURCES;
@@ -186,6 +211,23 @@ NTSTATUS CSaveData::Initialize(DWORD nSamplesPerSec, WORD wBitsPerSample, WORD n
         }
     }
 
+    // Parity packet buffer for FEC
+    if (NT_SUCCESS(ntStatus) && g_FecGroup && (m_ulHeaderSize == HEADER_V2_SIZE)) {
+        m_pParity = (PBYTE) ExAllocatePoolWithTag(NonPagedPool, m_ulParitySize, MSVAD_POOLTAG);
+        if (m_pParity) {
+            m_pParityMdl = IoAllocateMdl(m_pParity, m_ulParitySize, FALSE, FALSE, NULL);
+            if (m_pParityMdl == NULL) {
+                ExFreePoolWithTag(m_pParity, MSVAD_POOLTAG);
+                m_pParity = NULL;
+            } else {
+                MmBuildMdlForNonPagedPool(m_pParityMdl);
+            }
+        }
+        if (!m_pParity) {
+            DPF(D_TERSE, ("[Could not allocate parity buffer, sending without FEC]"));
+        }
+    }
+
     return ntStatus;
 } // Initialize
 
@@ -403,12 +445,12 @@ void CSaveData::SendData() {
             storeOffset = m_ulOffset;
 
             // Abort if there's nothing to send. Note: When storeOffset < sendOffset, we can always send a chunk.
-            if ((storeOffset >= m_ulSendOffset) && ((storeOffset - m_ulSendOffset) < CHUNK_SIZE))
+            if ((storeOffset >= m_ulSendOffset) && ((storeOffset - m_ulSendOffset) < m_ulChunkSize))
                 break;
 
             // Send a chunk
             wskbuf.Mdl = m_pMdl;
-            wskbuf.Length = CHUNK_SIZE;
+            wskbuf.Length = m_ulChunkSize;
             wskbuf.Offset = m_ulSendOffset;
             IoReuseIrp(m_irp, STATUS_UNSUCCESSFUL);
             IoSetCompletionRoutine(m_irp, WskSampleSyncIrpCompletionRoutine, &m_syncEvent, TRUE, TRUE, TRUE);
@@ -416,11 +458,74 @@ void CSaveData::SendData() {
             KeWaitForSingleObject(&m_syncEvent, Executive, KernelMode, FALSE, NULL);
             DPF(D_TERSE, ("WskSendTo: %x", m_irp->IoStatus.Status));
 
-            m_ulSendOffset += CHUNK_SIZE; if (m_ulSendOffset >= BUFFER_SIZE) m_ulSendOffset = 0;
+            if (m_pParity) {
+                AddToParity(&m_pBuffer[m_ulSendOffset]);
+            }
+
+            m_ulSendOffset += m_ulChunkSize; if (m_ulSendOffset >= m_ulBufferSize) m_ulSendOffset = 0;
+
+            if (m_pParity && (m_ulParityCount == g_FecGroup)) {
+                SendParity();
+            }
         }
     }
 }
 
+//=============================================================================
+// FEC: XOR every sent chunk into the parity packet of its group. Groups
+// start at sequence numbers that are multiples of g_FecGroup, so the
+// receiver knows which packets a parity packet covers.
+void CSaveData::AddToParity(PBYTE pChunk) {
+    ULONG seq = pChunk[5] | (pChunk[6] << 8) | (pChunk[7] << 16) | ((ULONG)pChunk[8] << 24);
+    ULONG i;
+
+    if ((m_ulParityCount > 0) && (seq != m_ulParitySequence + m_ulParityCount)) {
+        // Lost track of the group, start over
+        m_ulParityCount = 0;
+    }
+
+    if (m_ulParityCount == 0) {
+        if (seq % g_FecGroup) {
+            return;
+        }
+        RtlZeroMemory(m_pParity, m_ulParitySize);
+        RtlCopyMemory(m_pParity, pChunk, HEADER_SIZE);
+        m_pParity[1] |= HEADER_FEC_FLAG;
+        RtlCopyMemory(&m_pParity[5], &pChunk[5], 4);
+        m_pParity[9] = (BYTE)g_FecGroup;
+        m_ulParitySequence = seq;
+        m_usParityLength = 0;
+    }
+
+    for (i = 0; i < 8; i++) {
+        m_pParity[HEADER_V2_SIZE + i] ^= pChunk[9 + i];
+    }
+    for (i = 0; i < m_ulPayloadSize; i++) {
+        m_pParity[HEADER_V2_SIZE + PARITY_EXTRA + i] ^= pChunk[HEADER_V2_SIZE + i];
+    }
+    m_usParityLength ^= (USHORT)m_ulPayloadSize;
+    m_ulParityCount++;
+}
+
+//=============================================================================
+void CSaveData::SendParity() {
+    WSK_BUF wskbuf;
+
+    m_pParity[10] = (BYTE)(m_usParityLength & 0xFF);
+    m_pParity[11] = (BYTE)(m_usParityLength >> 8 & 0xFF);
+
+    wskbuf.Mdl = m_pParityMdl;
+    wskbuf.Length = m_ulParitySize;
+    wskbuf.Offset = 0;
+    IoReuseIrp(m_irp, STATUS_UNSUCCESSFUL);
+    IoSetCompletionRoutine(m_irp, WskSampleSyncIrpCompletionRoutine, &m_syncEvent, TRUE, TRUE, TRUE);
+    ((PWSK_PROVIDER_DATAGRAM_DISPATCH)(m_socket->Dispatch))->WskSendTo(m_socket, &wskbuf, 0, (PSOCKADDR)&m_sServerAddr, 0, NULL, m_irp);
+    KeWaitForSingleObject(&m_syncEvent, Executive, KernelMode, FALSE, NULL);
+    DPF(D_TERSE, ("WskSendTo parity: %x", m_irp->IoStatus.Status));
+
+    m_ulParityCount = 0;
+}
+
 #pragma code_seg("PAGE")
 //=============================================================================
 void CSaveData::WaitAllWorkItems(void) {
@@ -456,7 +561,7 @@ void CSaveData::WriteData(IN PBYTE pBuffer, IN ULONG ulByteCount) {
     }
 
     // Oversized (paranoia)
-    if (ulByteCount > (CHUNK_SIZE * NUM_CHUNKS / 2)) {
+    if (ulByteCount > (m_ulBufferSize / 2)) {
         return;
     }
 
@@ -465,10 +570,10 @@ void CSaveData::WriteData(IN PBYTE pBuffer, IN ULONG ulByteCount) {
     offset = m_ulOffset;
     toWrite = ulByteCount;
     while (toWrite > 0) {
-        w = offset % CHUNK_SIZE;
+        w = offset % m_ulChunkSize;
         if (w > 0) {
             // Fill up last chunk
-            w = (CHUNK_SIZE - w);
+            w = (m_ulChunkSize - w);
             w = (toWrite < w) ? toWrite : w;
             RtlCopyMemory(&(m_pBuffer[offset]), &(pBuffer[ulByteCount - toWrite]), w);
         }
@@ -479,13 +584,21 @@ void CSaveData::WriteData(IN PBYTE pBuffer, IN ULONG ulByteCount) {
             m_pBuffer[offset + 2] = m_bChannels;
             m_pBuffer[offset + 3] = (BYTE)(m_wChannelMask    & 0xFF);
             m_pBuffer[offset + 4] = (BYTE)(m_wChannelMask>>8 & 0xFF);
-            offset += HEADER_SIZE;
-            w = ((BUFFER_SIZE - offset) < toWrite) ? (BUFFER_SIZE - offset) : toWrite;
-            w = (w > PCM_PAYLOAD_SIZE) ? PCM_PAYLOAD_SIZE : w;
+            if (m_ulHeaderSize == HEADER_V2_SIZE) {
+                ULONGLONG timestamp = m_ullPosition / m_ulFrameSize;
+                m_pBuffer[offset + 1] |= HEADER_V2_FLAG;
+                for (int i = 0; i < 4; i++) m_pBuffer[offset + 5 + i] = (BYTE)(m_ulSequence >> (8 * i) & 0xFF);
+                for (int i = 0; i < 8; i++) m_pBuffer[offset + 9 + i] = (BYTE)(timestamp >> (8 * i) & 0xFF);
+                m_ulSequence++;
+            }
+            offset += m_ulHeaderSize;
+            w = ((m_ulBufferSize - offset) < toWrite) ? (m_ulBufferSize - offset) : toWrite;
+            w = (w > m_ulPayloadSize) ? m_ulPayloadSize : w;
             RtlCopyMemory(&(m_pBuffer[offset]), &(pBuffer[ulByteCount - toWrite]), w);
         }
         toWrite -= w;
-        offset += w;  if (offset >= BUFFER_SIZE) offset = 0;
+        m_ullPosition += w;
+        offset += w;  if (offset >= m_ulBufferSize) offset = 0;
     }
     m_ulOffset = offset;
 
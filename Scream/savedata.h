@@ -69,6 +69,21 @@ protected:
     BYTE                        m_bChannels;
     WORD                        m_wChannelMask;
 
+    ULONG                       m_ulHeaderSize;
+    ULONG                       m_ulPayloadSize;
+    ULONG                       m_ulChunkSize;
+    ULONG                       m_ulBufferSize;
+    ULONG                       m_ulFrameSize;
+    ULONG                       m_ulSequence;
+    ULONGLONG                   m_ullPosition;
+
+    PBYTE                       m_pParity;
+    PMDL                        m_pParityMdl;
+    ULONG                       m_ulParitySize;
+    ULONG                       m_ulParityCount;
+    ULONG                       m_ulParitySequence;
+    USHORT                      m_usParityLength;
+
 public:
     CSaveData();
     ~CSaveData();
@@ -89,6 +104,8 @@ private:
 
     void                        CreateSocket(void);
     void                        SendData();
+    void                        AddToParity(PBYTE pChunk);
+    void                        SendParity();
     friend VOID                 SendDataWorkerCallback(PDEVICE_OBJECT pDeviceObject, IN PVOID Context);
 };
 typedef CSaveData *PCSaveData;
@@ -137,6 +137,8 @@ extern DWORD g_UnicastSrcPort;
 extern DWORD g_DSCP;
 extern DWORD g_TTL;
 extern DWORD g_ScreamVersion;
+extern DWORD g_FecGroup;
+extern DWORD g_PayloadSize;
 extern DWORD g_silenceThreshold;
 
 #endif